@@ -0,0 +1,288 @@
+#include <array>
+#include <cstdint>
+#include <string_view>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define SCHEME_X86_SCANNERS
+#endif
+
+#include <buffer_tokenizer.h>
+
+// Те же классы символов, что у Tokenizer, но без isalnum: он зависит от локали
+// и для байтов больше 127 не определён. Такие байты считаются пробелами.
+constexpr bool IsDigitCharacter(char c) {
+    return c >= '0' && c <= '9';
+}
+
+constexpr bool IsAlphaCharacter(char c) {
+    return (c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z');
+}
+
+constexpr bool IsSymbolCharacter(char c) {
+    return IsAlphaCharacter(c) || IsDigitCharacter(c) || c == '+' || c == '-' || c == '*' ||
+           c == '?' || c == '!' || c == '<' || c == '>' || c == '=' || c == '#' || c == '/';
+}
+
+// Классы байтов для поиска границ лексем. Байт без класса - пробел.
+const uint8_t kSymbolClass = 1;
+// '(', ')', '.', '\'': начинают лексему, но в имя не входят
+const uint8_t kDelimiterClass = 2;
+
+constexpr std::array<uint8_t, 256> MakeCharClasses() {
+    std::array<uint8_t, 256> classes{};
+    for (int i = 0; i < 256; ++i) {
+        char c = static_cast<char>(i);
+        if (IsSymbolCharacter(c)) {
+            classes[i] = kSymbolClass;
+        } else if (c == '(' || c == ')' || c == '.' || c == '\'') {
+            classes[i] = kDelimiterClass;
+        }
+    }
+    return classes;
+}
+
+constexpr std::array<uint8_t, 256> kCharClasses = MakeCharClasses();
+
+// Граница для SkipSpaces - любой непробельный байт, для имени - любой,
+// который не входит в имя.
+template <bool kInSymbol>
+inline bool IsBoundary(char c) {
+    auto char_class = kCharClasses[static_cast<unsigned char>(c)];
+    return kInSymbol ? !(char_class & kSymbolClass) : char_class != 0;
+}
+
+template <bool kInSymbol>
+const char *ScanScalar(const char *cur, const char *end) {
+    while (cur != end && !IsBoundary<kInSymbol>(*cur)) {
+        ++cur;
+    }
+    return cur;
+}
+
+#ifdef SCHEME_X86_SCANNERS
+
+// Те же классы по половинкам байта для pshufb: класс байта c -
+// kLowNibbles[c & 15] & kHighNibbles[c >> 4]. Биты 0-3 означают символ
+// имени (по биту на группу старших половинок 2, 3, 4/6, 5/7), бит 4 -
+// разделитель.
+alignas(32) const uint8_t kLowNibbles[32] = {
+    0x0A, 0x0F, 0x0E, 0x0F, 0x0E, 0x0E, 0x0E, 0x1E, 0x1E, 0x1E, 0x0D, 0x05, 0x06, 0x07, 0x16, 0x07,
+    0x0A, 0x0F, 0x0E, 0x0F, 0x0E, 0x0E, 0x0E, 0x1E, 0x1E, 0x1E, 0x0D, 0x05, 0x06, 0x07, 0x16, 0x07};
+alignas(32) const uint8_t kHighNibbles[32] = {
+    0x00, 0x00, 0x11, 0x02, 0x04, 0x08, 0x04, 0x08, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,
+    0x00, 0x00, 0x11, 0x02, 0x04, 0x08, 0x04, 0x08, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00};
+
+template <bool kInSymbol>
+__attribute__((target("ssse3"))) const char *ScanSsse3(const char *cur, const char *end) {
+    auto low_table = _mm_load_si128(reinterpret_cast<const __m128i *>(kLowNibbles));
+    auto high_table = _mm_load_si128(reinterpret_cast<const __m128i *>(kHighNibbles));
+    auto nibble = _mm_set1_epi8(0x0F);
+    auto symbol = _mm_set1_epi8(0x0F);
+    auto zero = _mm_setzero_si128();
+    while (end - cur >= 16) {
+        auto bytes = _mm_loadu_si128(reinterpret_cast<const __m128i *>(cur));
+        auto low = _mm_shuffle_epi8(low_table, _mm_and_si128(bytes, nibble));
+        auto high = _mm_shuffle_epi8(high_table, _mm_and_si128(_mm_srli_epi16(bytes, 4), nibble));
+        auto classes = _mm_and_si128(low, high);
+        unsigned mask;
+        if constexpr (kInSymbol) {
+            mask = _mm_movemask_epi8(_mm_cmpeq_epi8(_mm_and_si128(classes, symbol), zero));
+        } else {
+            mask = ~_mm_movemask_epi8(_mm_cmpeq_epi8(classes, zero)) & 0xFFFF;
+        }
+        if (mask) {
+            return cur + __builtin_ctz(mask);
+        }
+        cur += 16;
+    }
+    return ScanScalar<kInSymbol>(cur, end);
+}
+
+template <bool kInSymbol>
+__attribute__((target("avx2"))) const char *ScanAvx2(const char *cur, const char *end) {
+    auto low_table = _mm256_load_si256(reinterpret_cast<const __m256i *>(kLowNibbles));
+    auto high_table = _mm256_load_si256(reinterpret_cast<const __m256i *>(kHighNibbles));
+    auto nibble = _mm256_set1_epi8(0x0F);
+    auto symbol = _mm256_set1_epi8(0x0F);
+    auto zero = _mm256_setzero_si256();
+    while (end - cur >= 32) {
+        auto bytes = _mm256_loadu_si256(reinterpret_cast<const __m256i *>(cur));
+        auto low = _mm256_shuffle_epi8(low_table, _mm256_and_si256(bytes, nibble));
+        auto high =
+            _mm256_shuffle_epi8(high_table, _mm256_and_si256(_mm256_srli_epi16(bytes, 4), nibble));
+        auto classes = _mm256_and_si256(low, high);
+        unsigned mask;
+        if constexpr (kInSymbol) {
+            mask = _mm256_movemask_epi8(_mm256_cmpeq_epi8(_mm256_and_si256(classes, symbol), zero));
+        } else {
+            mask = ~_mm256_movemask_epi8(_mm256_cmpeq_epi8(classes, zero));
+        }
+        if (mask) {
+            return cur + __builtin_ctz(mask);
+        }
+        cur += 32;
+    }
+    return ScanSsse3<kInSymbol>(cur, end);
+}
+
+#endif
+
+struct CharScannerFunctions {
+    const char *(*skip_spaces_)(const char *, const char *);
+    const char *(*skip_symbol_)(const char *, const char *);
+};
+
+bool IsCharScannerSupported(CharScanner scanner) {
+#ifdef SCHEME_X86_SCANNERS
+    if (scanner == CharScanner::SSSE3) {
+        return __builtin_cpu_supports("ssse3");
+    }
+    if (scanner == CharScanner::AVX2) {
+        return __builtin_cpu_supports("avx2");
+    }
+#endif
+    return scanner == CharScanner::SCALAR;
+}
+
+CharScannerFunctions GetCharScannerFunctions(CharScanner scanner) {
+#ifdef SCHEME_X86_SCANNERS
+    if (scanner == CharScanner::SSSE3) {
+        return {ScanSsse3<false>, ScanSsse3<true>};
+    }
+    if (scanner == CharScanner::AVX2) {
+        return {ScanAvx2<false>, ScanAvx2<true>};
+    }
+#endif
+    return {ScanScalar<false>, ScanScalar<true>};
+}
+
+CharScanner GetBestCharScanner() {
+    for (auto scanner : {CharScanner::AVX2, CharScanner::SSSE3}) {
+        if (IsCharScannerSupported(scanner)) {
+            return scanner;
+        }
+    }
+    return CharScanner::SCALAR;
+}
+
+CharScannerFunctions char_scanner = GetCharScannerFunctions(GetBestCharScanner());
+
+bool BufferTokenizer::SetCharScanner(CharScanner scanner) {
+    if (!IsCharScannerSupported(scanner)) {
+        return false;
+    }
+    char_scanner = GetCharScannerFunctions(scanner);
+    return true;
+}
+
+BufferTokenizer::BufferTokenizer() : BufferTokenizer(nullptr, nullptr) {
+}
+
+BufferTokenizer::BufferTokenizer(std::string_view source)
+        : BufferTokenizer(source.data(), source.data() + source.size()) {
+}
+
+BufferTokenizer::BufferTokenizer(const char *begin, const char *end)
+        : begin_(begin), cur_(begin), end_(end) {
+    current_ = ReadToken();
+}
+
+bool BufferTokenizer::IsEnd() const {
+    return current_.kind_ == TokenKind::END;
+}
+
+void BufferTokenizer::Next() {
+    current_ = ReadToken();
+}
+
+const TokenView &BufferTokenizer::GetToken() const {
+    return current_;
+}
+
+size_t BufferTokenizer::GetOffset() const {
+    return cur_ - begin_;
+}
+
+void BufferTokenizer::SkipSpaces() {
+    // обычно пробелов один-два, и короткий путь дешевле векторного
+    if (cur_ != end_ && IsBoundary<false>(*cur_)) {
+        return;
+    }
+    cur_ = char_scanner.skip_spaces_(cur_, end_);
+}
+
+TokenView BufferTokenizer::ReadToken() {
+    SkipSpaces();
+    TokenView token;
+    token.offset_ = cur_ - begin_;
+    if (cur_ == end_) {
+        return token;
+    }
+
+    auto start = cur_;
+    auto finish = [&](TokenKind kind) {
+        token.kind_ = kind;
+        token.text_ = std::string_view(start, cur_ - start);
+        return token;
+    };
+    auto read_number = [&](bool negative) {
+        uint64_t value = 0;
+        while (cur_ != end_ && IsDigitCharacter(*cur_)) {
+            value = value * 10 + (*cur_ - '0');
+            if (value > static_cast<uint64_t>(INT64_MAX)) {
+                throw SyntaxError("Слишком большое число");
+            }
+            ++cur_;
+        }
+        token.value_ = negative ? -static_cast<int64_t>(value) : static_cast<int64_t>(value);
+        return finish(TokenKind::CONSTANT);
+    };
+
+    char c = *cur_++;
+    switch (c) {
+        case '(':
+            return finish(TokenKind::OPEN);
+        case ')':
+            return finish(TokenKind::CLOSE);
+        case '\'':
+            return finish(TokenKind::QUOTE);
+        case '.':
+            return finish(TokenKind::DOT);
+        case '*':
+        case '/':
+        case '=':
+            return finish(TokenKind::SYMBOL);
+        case '<':
+        case '>':
+            if (cur_ != end_ && *cur_ == '=') {
+                ++cur_;
+            }
+            return finish(TokenKind::SYMBOL);
+        case '#':
+            if (cur_ == end_ || (*cur_ != 'f' && *cur_ != 't')) {
+                throw SyntaxError{"Ожидалось #f или #t, но что-то пошло не так!"};
+            }
+            ++cur_;
+            return finish(TokenKind::SYMBOL);
+        case '+':
+        case '-':
+            if (cur_ != end_ && IsDigitCharacter(*cur_)) {
+                return read_number(c == '-');
+            }
+            return finish(TokenKind::SYMBOL);
+    }
+
+    if (IsDigitCharacter(c)) {
+        --cur_;
+        return read_number(false);
+    }
+    if (IsAlphaCharacter(c)) {
+        cur_ = char_scanner.skip_symbol_(cur_, end_);
+        return finish(TokenKind::SYMBOL);
+    }
+    // как и Tokenizer, на '?' и '!' вне символа чтение заканчивается
+    cur_ = end_;
+    token.offset_ = cur_ - begin_;
+    return token;
+}
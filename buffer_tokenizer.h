@@ -0,0 +1,70 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <string_view>
+
+#include "tokenizer.h"
+
+enum class TokenKind {
+    SYMBOL,
+    CONSTANT,
+    OPEN,
+    CLOSE,
+    QUOTE,
+    DOT,
+    END
+};
+
+// Лексема без копирования: text_ указывает прямо в исходный буфер.
+struct TokenView {
+    TokenKind kind_ = TokenKind::END;
+    std::string_view text_;
+    // значение для CONSTANT
+    int64_t value_ = 0;
+    // смещение начала лексемы от начала буфера
+    size_t offset_ = 0;
+};
+
+// Поиск границ лексем: по 32 или 16 байт за раз или побайтно.
+enum class CharScanner {
+    SCALAR,
+    SSSE3,
+    AVX2
+};
+
+// Tokenizer поверх непрерывного буфера (строка, файл в памяти) вместо
+// std::istream. Лексемы те же, что у Tokenizer; буфер должен жить,
+// пока из него читают.
+class BufferTokenizer {
+public:
+    BufferTokenizer();
+
+    BufferTokenizer(const char *begin, const char *end);
+
+    explicit BufferTokenizer(std::string_view source);
+
+    bool IsEnd() const;
+
+    void Next();
+
+    const TokenView &GetToken() const;
+
+    // Смещение первого ещё не прочитанного символа.
+    size_t GetOffset() const;
+
+    // По умолчанию выбирается лучший из поддерживаемых процессором.
+    // Общий на процесс, менять только пока никто не читает (тесты, бенчмарки).
+    // false, если процессор его не поддерживает.
+    static bool SetCharScanner(CharScanner scanner);
+
+private:
+    void SkipSpaces();
+
+    TokenView ReadToken();
+
+    const char *begin_;
+    const char *cur_;
+    const char *end_;
+    TokenView current_;
+};
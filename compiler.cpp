@@ -0,0 +1,485 @@
+#include <algorithm>
+#include <iterator>
+#include <cstdint>
+#include <memory>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include <compiler.h>
+
+Symbol *const kIfSymbol = Symbol::Intern("if");
+Symbol *const kDefineSymbol = Symbol::Intern("define");
+Symbol *const kSetSymbol = Symbol::Intern("set!");
+Symbol *const kLambdaSymbol = Symbol::Intern("lambda");
+Symbol *const kAndSymbol = Symbol::Intern("and");
+Symbol *const kOrSymbol = Symbol::Intern("or");
+
+// В отличие от ToVector не разворачивает quote: формы компилируются как есть.
+std::vector<Value> FormToVector(Value head) {
+    std::vector<Value> vect;
+    while (head) {
+        if (!head.IsCell()) {
+            throw SyntaxError("Неправильный список аргументов");
+        }
+        vect.push_back(AsCell(head)->GetFirst());
+        head = AsCell(head)->GetSecond();
+    }
+    return vect;
+}
+
+std::shared_ptr<const std::vector<std::string>> ParseVariables(Value head) {
+    auto variables = std::make_shared<std::vector<std::string>>();
+    while (head) {
+        if (!head.IsCell() || !AsCell(head)->GetFirst() ||
+            !AsCell(head)->GetFirst().IsSymbol()) {
+            throw RuntimeError("После lambda должен быть список переменных");
+        }
+        variables->push_back(AsSymbol(AsCell(head)->GetFirst())->GetName());
+        head = AsCell(head)->GetSecond();
+    }
+    return variables;
+}
+
+// Собирает имена из define внутри тела lambda (они получают ячейки в кадре)
+// и отмечает, нужен ли кадр в куче: тело создаёт замыкания или что-то определяет.
+void ScanBody(const Value &form, std::vector<std::string> *locals,
+              bool *heap_frame) {
+    if (!form || !form.IsCell()) {
+        return;
+    }
+    CheckNativeStack();
+    auto head = AsCell(form)->GetFirst();
+    if (head == kQuoteSymbol) {
+        return;
+    }
+    if (head == kLambdaSymbol) {
+        *heap_frame = true;
+        return;
+    }
+    auto rest = AsCell(form)->GetSecond();
+    if (head == kDefineSymbol && rest && rest.IsCell() && AsCell(rest)->GetFirst()) {
+        *heap_frame = true;
+        auto target = AsCell(rest)->GetFirst();
+        if (target.IsCell()) {
+            target = AsCell(target)->GetFirst();
+        }
+        if (target && target.IsSymbol()) {
+            auto &defined = AsSymbol(target)->GetName();
+            if (std::find(locals->begin(), locals->end(), defined) == locals->end()) {
+                locals->push_back(defined);
+            }
+        }
+        if (AsCell(rest)->GetFirst().IsCell()) {
+            return;
+        }
+    }
+    for (auto cur = form; cur && cur.IsCell(); cur = AsCell(cur)->GetSecond()) {
+        ScanBody(AsCell(cur)->GetFirst(), locals, heap_frame);
+    }
+}
+
+// Встроенные функции, у которых есть своя инструкция.
+const std::pair<const char *, OpCode> kPrimitives[] = {
+    {"+", OpCode::ADD},       {"-", OpCode::SUBTRACT}, {"*", OpCode::MULTIPLY},
+    {"<", OpCode::LESS},      {"<=", OpCode::LESS_EQ}, {">", OpCode::MORE},
+    {">=", OpCode::MORE_EQ},  {"=", OpCode::NUM_EQ},   {"not", OpCode::NOT},
+    {"null?", OpCode::IS_NULL}, {"cons", OpCode::CONS}};
+
+// Чистые встроенные функции чисел и #t/#f, которые можно вычислить
+// при компиляции. Деления нет: деление на ноль должно случиться
+// во время исполнения, а не в недостижимой ветке.
+const char *const kFoldable[] = {"+", "-", "*", "<", "<=", ">", ">=", "=",
+                                 "max", "min", "abs", "not"};
+
+Compiler::Compiler(Code *code, const LexicalScope *scope, Scope *globals, bool optimize)
+        : code_(code), scope_(scope), globals_(globals), optimize_(optimize) {
+}
+
+void Compiler::Emit(OpCode op, int32_t arg, uint16_t depth) {
+    code_->instructions_.push_back(Instruction{op, depth, arg});
+}
+
+size_t Compiler::EmitJump(OpCode op) {
+    Emit(op, -1);
+    return code_->instructions_.size() - 1;
+}
+
+void Compiler::PatchJump(size_t jump) {
+    code_->instructions_[jump].arg_ = static_cast<int32_t>(code_->instructions_.size());
+}
+
+int32_t Compiler::AddConstant(const Value &obj) {
+    Heap::Current()->WriteBarrier(code_, obj.GetObject());
+    code_->constants_.push_back(obj);
+    return static_cast<int32_t>(code_->constants_.size() - 1);
+}
+
+int32_t Compiler::AddName(const std::string &name) {
+    for (size_t i = 0; i < code_->names_.size(); ++i) {
+        if (code_->names_[i] == name) {
+            if (!code_->bindings_[i] && globals_) {
+                code_->bindings_[i] = globals_->FindBinding(name);
+            }
+            return static_cast<int32_t>(i);
+        }
+    }
+    code_->names_.push_back(name);
+    // компиляция не заводит ячеек: их заводят define и обращения VM
+    code_->bindings_.push_back(globals_ ? globals_->FindBinding(name) : nullptr);
+    return static_cast<int32_t>(code_->names_.size() - 1);
+}
+
+void Compiler::EmitVariable(const std::string &name, const OpCode (&ops)[4]) {
+    size_t depth = 0;
+    for (auto scope = scope_; scope; scope = scope->parent_) {
+        auto &locals = *scope->code_->locals_;
+        auto on_stack = scope == scope_ && !scope->code_->heap_frame_;
+        auto found = std::find(locals.begin(), locals.end(), name);
+        if (found != locals.end()) {
+            auto index = static_cast<int32_t>(found - locals.begin());
+            if (on_stack) {
+                Emit(ops[1], index);
+            } else {
+                Emit(ops[2], index, static_cast<uint16_t>(depth));
+            }
+            return;
+        }
+        // кадр на стеке не входит в цепочку Scope
+        if (!on_stack && ++depth > UINT16_MAX) {
+            throw SyntaxError("Слишком глубокая вложенность lambda");
+        }
+    }
+    Emit(globals_ ? ops[3] : ops[0], AddName(name));
+}
+
+void Compiler::CompileExpression(const Value &expr, bool tail) {
+    CheckNativeStack();
+    if (!expr || expr.IsNumber()) {
+        Emit(OpCode::PUSH_CONST, AddConstant(expr));
+        return;
+    }
+    if (expr.IsSymbol()) {
+        if (expr == kTrueSymbol || expr == kFalseSymbol) {
+            Emit(OpCode::PUSH_CONST, AddConstant(expr));
+        } else {
+            EmitVariable(AsSymbol(expr)->GetName(), {OpCode::LOAD_VAR, OpCode::LOAD_LOCAL,
+                                                      OpCode::LOAD_ENV, OpCode::LOAD_GLOBAL});
+        }
+        return;
+    }
+    if (!expr.IsCell()) {
+        throw SyntaxError("Выражение нельзя скомпилировать");
+    }
+
+    auto head = AsCell(expr)->GetFirst();
+    auto args = FormToVector(AsCell(expr)->GetSecond());
+
+    // специальные формы распознаются по символу, как ключевые слова
+    if (head == kQuoteSymbol) {
+        return CompileQuote(args);
+    }
+    if (head == kIfSymbol) {
+        return CompileIf(args, tail);
+    }
+    if (head == kDefineSymbol) {
+        return CompileDefine(args);
+    }
+    if (head == kSetSymbol) {
+        return CompileSet(args);
+    }
+    if (head == kLambdaSymbol) {
+        if (args.size() < 2) {
+            throw SyntaxError("Недостаточно аргументов у lambda");
+        }
+        return CompileLambdaForm(ParseVariables(args[0]),
+                                 std::vector<Value>(args.begin() + 1,
+                                                                      args.end()));
+    }
+    if (head == kAndSymbol) {
+        return CompileAnd(args, tail);
+    }
+    if (head == kOrSymbol) {
+        return CompileOr(args, tail);
+    }
+    if (CompileFolded(expr, tail)) {
+        return;
+    }
+    CompileCall(head, args, tail);
+}
+
+void Compiler::CompileBody(const std::vector<Value> &body) {
+    for (size_t i = 0; i < body.size(); ++i) {
+        CompileExpression(body[i], i + 1 == body.size());
+        if (i + 1 != body.size()) {
+            Emit(OpCode::POP);
+        }
+    }
+    Emit(OpCode::RETURN);
+}
+
+void Compiler::CompileQuote(const std::vector<Value> &args) {
+    if (args.size() != 1) {
+        throw SyntaxError("Недостаточно аргументов для quote");
+    }
+    if (args[0] && args[0].IsNumber()) {
+        throw SyntaxError("?? at quote");
+    }
+    Emit(OpCode::PUSH_CONST, AddConstant(args[0]));
+}
+
+void Compiler::CompileIf(const std::vector<Value> &args, bool tail) {
+    if (args.size() < 2 || args.size() > 3 || !args[0]) {
+        throw SyntaxError("Неверные аргументы для if");
+    }
+    CompileExpression(args[0]);
+    auto to_else = EmitJump(OpCode::JUMP_IF_FALSE);
+    CompileExpression(args[1], tail);
+    auto to_end = EmitJump(OpCode::JUMP);
+    PatchJump(to_else);
+    if (args.size() == 3) {
+        CompileExpression(args[2], tail);
+    } else {
+        Emit(OpCode::PUSH_CONST, AddConstant(nullptr));
+    }
+    PatchJump(to_end);
+}
+
+// define всегда пишет в текущий кадр: ScanBody уже завёл для имени ячейку.
+const OpCode kDefineOps[4] = {OpCode::DEFINE_VAR, OpCode::DEFINE_ENV, OpCode::DEFINE_ENV,
+                              OpCode::DEFINE_GLOBAL};
+
+void Compiler::CompileDefine(const std::vector<Value> &args) {
+    if (args.size() != 2 || !args[0] || !args[1] || !(args[0].IsSymbol() || args[0].IsCell())) {
+        throw SyntaxError("Неверные аргументы для define");
+    }
+    if (args[0].IsCell()) {
+        auto head = AsCell(args[0]);
+        if (!head->GetFirst() || !head->GetFirst().IsSymbol()) {
+            throw SyntaxError("Неверные аргументы для define lambda-sugar");
+        }
+        CompileLambdaForm(ParseVariables(head->GetSecond()), {args[1]});
+        EmitVariable(AsSymbol(head->GetFirst())->GetName(), kDefineOps);
+        return;
+    }
+    CompileExpression(args[1]);
+    EmitVariable(AsSymbol(args[0])->GetName(), kDefineOps);
+}
+
+void Compiler::CompileSet(const std::vector<Value> &args) {
+    if (args.size() != 2 || !args[0] || !args[1] || !args[0].IsSymbol()) {
+        throw SyntaxError("Неверные аргументы для set!");
+    }
+    CompileExpression(args[1]);
+    EmitVariable(AsSymbol(args[0])->GetName(), {OpCode::SET_VAR, OpCode::SET_LOCAL,
+                                                 OpCode::SET_ENV, OpCode::SET_GLOBAL});
+}
+
+void Compiler::CompileLambdaForm(std::shared_ptr<const std::vector<std::string>> variables,
+                                 const std::vector<Value> &body) {
+    code_->lambdas_.push_back(CompileLambda(variables, body, scope_, globals_, optimize_));
+    Emit(OpCode::MAKE_LAMBDA, static_cast<int32_t>(code_->lambdas_.size() - 1));
+}
+
+void Compiler::CompileAnd(const std::vector<Value> &args, bool tail) {
+    if (args.empty()) {
+        Emit(OpCode::PUSH_CONST, AddConstant(kTrueSymbol));
+        return;
+    }
+    std::vector<size_t> to_end;
+    for (size_t i = 0; i + 1 < args.size(); ++i) {
+        CompileExpression(args[i]);
+        to_end.push_back(EmitJump(OpCode::JUMP_IF_FALSE_OR_POP));
+    }
+    CompileExpression(args.back(), tail);
+    for (auto jump : to_end) {
+        PatchJump(jump);
+    }
+}
+
+void Compiler::CompileOr(const std::vector<Value> &args, bool tail) {
+    if (args.empty()) {
+        Emit(OpCode::PUSH_CONST, AddConstant(kFalseSymbol));
+        return;
+    }
+    std::vector<size_t> to_end;
+    for (size_t i = 0; i + 1 < args.size(); ++i) {
+        CompileExpression(args[i]);
+        to_end.push_back(EmitJump(OpCode::JUMP_IF_TRUE_OR_POP));
+    }
+    CompileExpression(args.back(), tail);
+    for (auto jump : to_end) {
+        PatchJump(jump);
+    }
+}
+
+void Compiler::CompileCall(const Value &head, const std::vector<Value> &args, bool tail) {
+    if (auto binding = FindBuiltin(head); binding && args.size() <= UINT16_MAX) {
+        for (auto &[name, op] : kPrimitives) {
+            if (AsSymbol(head)->GetName() == name) {
+                for (auto &arg : args) {
+                    CompileExpression(arg);
+                }
+                Emit(op, AddName(name), static_cast<uint16_t>(args.size()));
+                return;
+            }
+        }
+    }
+    CompileExpression(head);
+    for (auto &arg : args) {
+        CompileExpression(arg);
+    }
+    Emit(tail ? OpCode::TAIL_CALL : OpCode::CALL, static_cast<int32_t>(args.size()));
+}
+
+std::shared_ptr<Binding> Compiler::FindBuiltin(const Value &head) {
+    if (!optimize_ || !globals_ || !head || !head.IsSymbol()) {
+        return nullptr;
+    }
+    auto &name = AsSymbol(head)->GetName();
+    for (auto scope = scope_; scope; scope = scope->parent_) {
+        auto &locals = *scope->code_->locals_;
+        if (std::find(locals.begin(), locals.end(), name) != locals.end()) {
+            return nullptr;
+        }
+    }
+    auto binding = globals_->FindBinding(name);
+    return binding && binding->HoldsBuiltin() ? binding : nullptr;
+}
+
+bool Compiler::Fold(const Value &expr, Value *result, std::vector<int32_t> *guards) {
+    if (expr && (expr.IsNumber() || expr == kTrueSymbol || expr == kFalseSymbol)) {
+        *result = expr;
+        return true;
+    }
+    if (!expr || !expr.IsCell()) {
+        return false;
+    }
+    CheckNativeStack();
+    auto head = AsCell(expr)->GetFirst();
+    auto binding = FindBuiltin(head);
+    if (!binding || std::find(std::begin(kFoldable), std::end(kFoldable),
+                              AsSymbol(head)->GetName()) == std::end(kFoldable)) {
+        return false;
+    }
+    auto args = FormToVector(AsCell(expr)->GetSecond());
+    for (auto &arg : args) {
+        if (!Fold(arg, &arg, guards)) {
+            return false;
+        }
+    }
+    try {
+        *result = binding->value_.As<Function>()->Call(args);
+    } catch (const RuntimeError &) {
+        // ошибка должна случиться во время исполнения
+        return false;
+    } catch (const SyntaxError &) {
+        return false;
+    }
+    auto index = AddName(AsSymbol(head)->GetName());
+    if (std::find(guards->begin(), guards->end(), index) == guards->end()) {
+        guards->push_back(index);
+    }
+    return true;
+}
+
+bool Compiler::CompileFolded(const Value &expr, bool tail) {
+    Value result;
+    std::vector<int32_t> guards;
+    if (!fold_ || !Fold(expr, &result, &guards) ||
+        code_->names_.size() > UINT16_MAX) {
+        return false;
+    }
+    std::vector<size_t> to_slow;
+    for (auto index : guards) {
+        Emit(OpCode::GUARD, -1, static_cast<uint16_t>(index));
+        to_slow.push_back(code_->instructions_.size() - 1);
+    }
+    Emit(OpCode::PUSH_CONST, AddConstant(result));
+    auto to_end = EmitJump(OpCode::JUMP);
+    for (auto jump : to_slow) {
+        PatchJump(jump);
+    }
+    // встроенную функцию переопределили: выражение считается как обычно
+    fold_ = false;
+    auto head = AsCell(expr)->GetFirst();
+    CompileCall(head, FormToVector(AsCell(expr)->GetSecond()), tail);
+    fold_ = true;
+    PatchJump(to_end);
+    return true;
+}
+
+void Code::Trace(Heap *heap) {
+    if (!heap->Visit(&gc_epoch_)) {
+        return;
+    }
+    TraceValues(heap);
+    for (auto &binding : bindings_) {
+        if (binding) {
+            heap->Mark(binding->value_);
+        }
+    }
+    for (auto &lambda : lambdas_) {
+        lambda->Trace(heap);
+    }
+}
+
+void Code::TraceValues(Heap *heap) {
+    for (auto &constant : constants_) {
+        heap->Mark(constant);
+    }
+    for (auto &form : body_) {
+        heap->Mark(form);
+    }
+}
+
+std::shared_ptr<Code> Compile(const Value &expr, Scope *globals, bool optimize) {
+    auto code = std::make_shared<Code>();
+    code->globals_ = globals;
+    Compiler(code.get(), nullptr, globals, optimize).CompileBody({expr});
+    return code;
+}
+
+std::shared_ptr<Code> CompileLambda(std::shared_ptr<const std::vector<std::string>> variables,
+                                    const std::vector<Value> &body,
+                                    const LexicalScope *enclosing, Scope *globals,
+                                    bool optimize) {
+    auto code = std::make_shared<Code>();
+    code->globals_ = globals;
+    code->variables_ = variables;
+    code->body_ = body;
+    for (auto &form : body) {
+        Heap::Current()->WriteBarrier(code.get(), form.GetObject());
+    }
+
+    auto locals = std::make_shared<std::vector<std::string>>(*variables);
+    for (auto &form : body) {
+        ScanBody(form, locals.get(), &code->heap_frame_);
+    }
+    code->locals_ = locals;
+
+    LexicalScope scope{enclosing, code.get()};
+    Compiler(code.get(), &scope, globals, optimize).CompileBody(body);
+    return code;
+}
+
+std::shared_ptr<Code> CompileClosure(const Lambda &lambda, bool optimize) {
+    // в кадр обходчика дерева define может добавить переменную, которой
+    // нет в names_: начиная с него имена ищутся во время исполнения
+    std::vector<Scope *> frames;
+    auto scope = lambda.GetScope().get();
+    for (; scope->GetParent() && scope->HasFixedNames(); scope = scope->GetParent()) {
+        frames.push_back(scope);
+    }
+    auto globals = scope->GetParent() ? nullptr : scope;
+
+    std::vector<Code> layouts(frames.size());
+    std::vector<LexicalScope> chain(frames.size());
+    for (size_t i = frames.size(); i-- > 0;) {
+        layouts[i].locals_ = frames[i]->GetNames();
+        layouts[i].heap_frame_ = true;
+        chain[i] = LexicalScope{i + 1 < frames.size() ? &chain[i + 1] : nullptr, &layouts[i]};
+    }
+    return CompileLambda(lambda.GetVariables(), lambda.GetBody(),
+                         chain.empty() ? nullptr : chain.data(), globals, optimize);
+}
@@ -0,0 +1,172 @@
+#pragma once
+
+#include <cstdint>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include "parser.h"
+
+// Переменные адресуются так, как их разрешил компилятор:
+// LOCAL - аргумент на стеке VM, ENV - ячейка кадра в куче (depth шагов вверх),
+// GLOBAL - Binding глобальной области, VAR - поиск по имени в Scope.
+enum class OpCode : uint8_t {
+    PUSH_CONST,            // положить на стек constants_[arg]
+    LOAD_VAR,              // положить на стек значение переменной names_[arg]
+    LOAD_LOCAL,
+    LOAD_ENV,
+    LOAD_GLOBAL,           // положить на стек bindings_[arg]
+    DEFINE_VAR,            // снять значение и определить переменную
+    DEFINE_ENV,
+    DEFINE_GLOBAL,
+    SET_VAR,               // снять значение и изменить переменную
+    SET_LOCAL,
+    SET_ENV,
+    SET_GLOBAL,
+    MAKE_LAMBDA,           // создать замыкание из lambdas_[arg]
+    CALL,                  // вызвать функцию с arg аргументами
+    TAIL_CALL,             // CALL и RETURN; кадр lambda занимает место текущего
+    JUMP,                  // перейти на инструкцию arg
+    JUMP_IF_FALSE,         // снять условие if и перейти, если оно #f
+    JUMP_IF_FALSE_OR_POP,  // для and: перейти, оставив #f на стеке, иначе снять
+    JUMP_IF_TRUE_OR_POP,   // для or: перейти, оставив значение на стеке, иначе снять
+    POP,
+    RETURN,
+    // Встроенные функции, подставленные компилятором: arg - индекс Binding
+    // в bindings_, depth - число аргументов на стеке. Пока Binding держит
+    // свою встроенную функцию, простые случаи вычисляются на месте, иначе
+    // вызывается то, что сейчас лежит в переменной.
+    ADD,
+    SUBTRACT,
+    MULTIPLY,
+    LESS,
+    LESS_EQ,
+    MORE,
+    MORE_EQ,
+    NUM_EQ,
+    NOT,
+    IS_NULL,
+    CONS,
+    // перейти на arg, если bindings_[depth] больше не держит встроенную
+    // функцию: свёрнутая константа устарела
+    GUARD
+};
+
+struct Instruction {
+    OpCode op_;
+    uint16_t depth_;
+    int32_t arg_;
+};
+
+// Скомпилированное выражение верхнего уровня или тело lambda.
+struct Code : public ValueHolder {
+    std::vector<Instruction> instructions_;
+    std::vector<Value> constants_;
+    // имена глобальных переменных и их ячейки (nullptr для поиска по имени
+    // или пока ячейки нет в globals_: она ищется при первом исполнении)
+    std::vector<std::string> names_;
+    std::vector<std::shared_ptr<Binding>> bindings_;
+    Scope *globals_ = nullptr;
+    std::vector<std::shared_ptr<Code>> lambdas_;
+
+    // Параметры и исходное тело, если это код lambda.
+    std::shared_ptr<const std::vector<std::string>> variables_;
+    std::vector<Value> body_;
+    // Раскладка кадра: параметры, затем переменные из define внутри тела.
+    std::shared_ptr<const std::vector<std::string>> locals_;
+    // Тело создаёт замыкания или определяет переменные, поэтому кадр вызова
+    // должен быть Scope в куче. Иначе аргументы остаются на стеке VM.
+    bool heap_frame_ = false;
+
+    // Помечает константы, исходное тело и код вложенных lambda.
+    void Trace(Heap *heap);
+
+    void TraceValues(Heap *heap) override;
+
+    size_t gc_epoch_ = 0;
+};
+
+// Кадры lambda, внутри которых идёт компиляция.
+struct LexicalScope {
+    const LexicalScope *parent_;
+    const Code *code_;
+};
+
+class Compiler {
+public:
+    // globals == nullptr значит, что внешнее окружение неизвестно
+    // и всё, что не нашлось в scope, ищется по имени во время исполнения.
+    // optimize разрешает сворачивать константы и подставлять встроенные функции.
+    Compiler(Code *code, const LexicalScope *scope, Scope *globals, bool optimize = true);
+
+    // tail - выражение в хвостовой позиции: его значение сразу возвращается.
+    void CompileExpression(const Value &expr, bool tail = false);
+
+    // Тело lambda: значения всех форм, кроме последней, выбрасываются.
+    void CompileBody(const std::vector<Value> &body);
+
+private:
+    void Emit(OpCode op, int32_t arg = 0, uint16_t depth = 0);
+
+    size_t EmitJump(OpCode op);
+
+    void PatchJump(size_t jump);
+
+    int32_t AddConstant(const Value &obj);
+
+    int32_t AddName(const std::string &name);
+
+    // Выбирает LOAD/SET/DEFINE для переменной; ops перечислены в порядке
+    // VAR, LOCAL, ENV, GLOBAL.
+    void EmitVariable(const std::string &name, const OpCode (&ops)[4]);
+
+    void CompileQuote(const std::vector<Value> &args);
+
+    void CompileIf(const std::vector<Value> &args, bool tail);
+
+    void CompileDefine(const std::vector<Value> &args);
+
+    void CompileSet(const std::vector<Value> &args);
+
+    void CompileLambdaForm(std::shared_ptr<const std::vector<std::string>> variables,
+                           const std::vector<Value> &body);
+
+    void CompileAnd(const std::vector<Value> &args, bool tail);
+
+    void CompileOr(const std::vector<Value> &args, bool tail);
+
+    void CompileCall(const Value &head, const std::vector<Value> &args, bool tail);
+
+    // Глобальная переменная head, если она держит свою встроенную функцию
+    // и не перекрыта параметром или локальным define.
+    std::shared_ptr<Binding> FindBuiltin(const Value &head);
+
+    // Вычисляет expr во время компиляции, если это константа или вызов
+    // чистой встроенной функции от констант. В guards - индексы Binding,
+    // от которых зависит результат.
+    bool Fold(const Value &expr, Value *result, std::vector<int32_t> *guards);
+
+    // Константа под проверками GUARD; если проверка не прошла,
+    // выполняется обычный код выражения.
+    bool CompileFolded(const Value &expr, bool tail);
+
+    Code *code_;
+    const LexicalScope *scope_;
+    Scope *globals_;
+    bool optimize_;
+    // false внутри запасного кода свёрнутого выражения
+    bool fold_ = true;
+};
+
+std::shared_ptr<Code> Compile(const Value &expr, Scope *globals, bool optimize = true);
+
+std::shared_ptr<Code> CompileLambda(std::shared_ptr<const std::vector<std::string>> variables,
+                                    const std::vector<Value> &body,
+                                    const LexicalScope *enclosing, Scope *globals,
+                                    bool optimize = true);
+
+// Код lambda, созданной без компилятора (обходчиком дерева или из образа),
+// по её настоящей цепочке кадров: переменные кадров VM адресуются по номеру,
+// и если цепочка до глобальной области состоит только из них, глобальные
+// переменные - по ячейкам, а встроенные функции подставляются.
+std::shared_ptr<Code> CompileClosure(const Lambda &lambda, bool optimize = true);
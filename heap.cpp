@@ -0,0 +1,228 @@
+#include <algorithm>
+#include <atomic>
+#include <vector>
+
+#include <heap.h>
+#include <parser.h>
+
+// Нижняя граница порога: столько объектов выделяется до первой сборки.
+const size_t kMinCollectionThreshold = 1 << 16;
+
+// Размер яслей в байтах. Малая сборка начинается, когда занято три четверти:
+// остаток нужен встроенным функциям, которые выделяют между безопасными точками.
+const size_t kNurserySize = 1 << 20;
+
+thread_local Heap *Heap::current_ = nullptr;
+
+// Номера сборок общие для всех куч, так что отметка Visit от одной кучи
+// не спутается с отметкой от другой.
+std::atomic<size_t> collection_counter{0};
+
+ValueHolder::ValueHolder(const ValueHolder &rhs) {
+    (void)rhs;
+}
+
+ValueHolder &ValueHolder::operator=(const ValueHolder &rhs) {
+    (void)rhs;
+    return *this;
+}
+
+ValueHolder::~ValueHolder() {
+    if (gc_heap_) {
+        gc_heap_->Forget(this);
+    }
+}
+
+Heap::Heap() : threshold_(kMinCollectionThreshold), nursery_(new char[kNurserySize]) {
+    nursery_top_ = nursery_.get();
+    nursery_end_ = nursery_top_ + kNurserySize;
+    UpdateLimits();
+}
+
+Heap::~Heap() {
+    for (auto holder : remembered_holders_) {
+        holder->gc_heap_ = nullptr;
+    }
+    remembered_holders_.clear();
+    while (objects_) {
+        auto next = objects_->gc_next_;
+        delete objects_;
+        objects_ = next;
+    }
+}
+
+void Heap::Register(Object *object) {
+    object->gc_next_ = objects_;
+    objects_ = object;
+    ++object_count_;
+    ++allocated_since_collection_;
+}
+
+void Heap::AddOld(Object *object) {
+    Register(object);
+    // объект, созданный сразу в старшем поколении, мог получить
+    // в конструкторе ссылки на молодые
+    if (young_count_) {
+        Remember(object);
+    }
+}
+
+void Heap::Remember(Object *object) {
+    if (!object->gc_remembered_) {
+        object->gc_remembered_ = true;
+        remembered_objects_.push_back(object);
+    }
+}
+
+void Heap::Remember(ValueHolder *holder) {
+    holder->gc_heap_ = this;
+    holder->gc_index_ = remembered_holders_.size();
+    remembered_holders_.push_back(holder);
+}
+
+void Heap::Forget(ValueHolder *holder) {
+    auto last = remembered_holders_.back();
+    remembered_holders_[holder->gc_index_] = last;
+    last->gc_index_ = holder->gc_index_;
+    remembered_holders_.pop_back();
+    holder->gc_heap_ = nullptr;
+}
+
+void Heap::SetPermanent(Object *object) {
+    // постоянный объект всегда помечен, и сборщик его не обходит
+    object->gc_marked_ = true;
+}
+
+void Heap::AddRoots(RootSet *roots) {
+    roots_.push_back(roots);
+}
+
+void Heap::RemoveRoots(RootSet *roots) {
+    roots_.erase(std::remove(roots_.begin(), roots_.end(), roots), roots_.end());
+}
+
+void Heap::UpdateLimits() {
+    threshold_ = stress_ ? 1 : std::max(kMinCollectionThreshold, object_count_);
+    nursery_limit_ = stress_ ? nursery_.get() + 1 : nursery_.get() + kNurserySize / 4 * 3;
+}
+
+void Heap::SetStressMode(bool enabled) {
+    stress_ = enabled;
+    UpdateLimits();
+}
+
+Object *Heap::Promote(Object *object) {
+    auto copy = object->Promote();
+    copy->gc_marked_ = false;
+    copy->gc_remembered_ = false;
+    Register(copy);
+    // у молодого объекта вместо ссылки на следующий хранится адрес копии
+    object->gc_marked_ = true;
+    object->gc_next_ = copy;
+    return copy;
+}
+
+void Heap::Mark(Value &value) {
+    auto object = value.GetObject();
+    if (!object) {
+        return;
+    }
+    if (IsYoung(object)) {
+        if (!object->gc_marked_) {
+            auto copy = Promote(object);
+            // в малой сборке пометки старшего поколения не используются
+            copy->gc_marked_ = !minor_;
+            gray_.push_back(copy);
+        }
+        value = object->gc_next_;
+        return;
+    }
+    if (minor_ || object->gc_marked_) {
+        return;
+    }
+    object->gc_marked_ = true;
+    gray_.push_back(object);
+}
+
+bool Heap::Visit(size_t *epoch) {
+    if (minor_ || *epoch == epoch_) {
+        return false;
+    }
+    *epoch = epoch_;
+    return true;
+}
+
+void Heap::TraceRoots() {
+    for (auto roots : roots_) {
+        roots->TraceRoots(this);
+    }
+    // явный стек вместо рекурсии: длинный список не переполнит стек C++
+    while (!gray_.empty()) {
+        auto object = gray_.back();
+        gray_.pop_back();
+        object->Trace(this);
+    }
+}
+
+void Heap::ResetNursery() {
+    // выжившие уже скопированы, а у объектов в яслях нет ресурсов,
+    // так что деструкторы не нужны
+    nursery_top_ = nursery_.get();
+    young_count_ = 0;
+    for (auto object : remembered_objects_) {
+        object->gc_remembered_ = false;
+    }
+    remembered_objects_.clear();
+    for (auto holder : remembered_holders_) {
+        holder->gc_heap_ = nullptr;
+    }
+    remembered_holders_.clear();
+}
+
+void Heap::CollectYoung() {
+    minor_ = true;
+    for (auto object : remembered_objects_) {
+        object->Trace(this);
+    }
+    for (auto holder : remembered_holders_) {
+        holder->TraceValues(this);
+    }
+    TraceRoots();
+    minor_ = false;
+    ResetNursery();
+}
+
+void Heap::Collect() {
+    epoch_ = ++collection_counter;
+    TraceRoots();
+    // до удаления: запомненные объекты могут оказаться мусором
+    ResetNursery();
+
+    auto link = &objects_;
+    while (*link) {
+        auto object = *link;
+        if (object->gc_marked_) {
+            object->gc_marked_ = false;
+            link = &object->gc_next_;
+        } else {
+            *link = object->gc_next_;
+            delete object;
+            --object_count_;
+        }
+    }
+
+    allocated_since_collection_ = 0;
+    UpdateLimits();
+}
+
+size_t Heap::GetObjectCount() const {
+    return object_count_ + young_count_;
+}
+
+HeapContext::HeapContext(Heap *heap) : previous_(Heap::current_) {
+    Heap::current_ = heap;
+}
+
+HeapContext::~HeapContext() {
+    Heap::current_ = previous_;
+}
@@ -0,0 +1,221 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <new>
+#include <utility>
+#include <vector>
+
+class Object;
+
+class Value;
+
+class Heap;
+
+// Всё, до чего интерпретатор дотягивается не через кучу: глобальная область
+// видимости, стек VM. Регистрируется в Heap через AddRoots.
+class RootSet {
+public:
+    virtual ~RootSet() = default;
+
+    virtual void TraceRoots(Heap *heap) = 0;
+};
+
+// Значения, которые лежат вне кучи: ячейки областей видимости, глобальные
+// Binding, константы байткода. Если в такое место записан молодой объект,
+// WriteBarrier запоминает его, и малая сборка обходит его как корень.
+class ValueHolder {
+public:
+    ValueHolder() = default;
+
+    // копия ещё ни разу не запоминалась
+    ValueHolder(const ValueHolder &rhs);
+
+    ValueHolder &operator=(const ValueHolder &rhs);
+
+    virtual ~ValueHolder();
+
+    // Помечает только собственные значения: без родительских областей
+    // и вложенного байткода, у них свои барьеры.
+    virtual void TraceValues(Heap *heap) = 0;
+
+private:
+    friend class Heap;
+
+    Heap *gc_heap_ = nullptr;
+    size_t gc_index_ = 0;
+};
+
+// Куча объектов одного интерпретатора из двух поколений.
+// Объекты с kNursery (ячейки, списки, числа) выделяются сдвигом указателя
+// в яслях; малая сборка копирует выживших в старшее поколение и очищает ясли
+// целиком. Корни малой сборки - стеки VM и всё, что запомнил барьер записи,
+// поэтому каждая запись молодого объекта в старый объект или в ValueHolder
+// должна проходить через WriteBarrier. Старшее поколение - список объектов,
+// который собирается mark-and-sweep.
+// Сборка идёт лишь в безопасных точках (между инструкциями VM и между
+// формами верхнего уровня), поэтому указатели в локальных переменных C++
+// внутри встроенных функций и обходчика дерева регистрировать не нужно.
+class Heap {
+public:
+    Heap();
+
+    Heap(const Heap &) = delete;
+
+    Heap &operator=(const Heap &) = delete;
+
+    ~Heap();
+
+    // Куча, в которой выделяют Make; её выставляет HeapContext.
+    static Heap *Current() {
+        return current_;
+    }
+
+    template <class T, class... Args>
+    T *Make(Args &&...args) {
+        if constexpr (T::kNursery) {
+            if (auto memory = AllocateYoung(sizeof(T), alignof(T))) {
+                return new (memory) T(std::forward<Args>(args)...);
+            }
+        }
+        T *object = new T(std::forward<Args>(args)...);
+        AddOld(object);
+        return object;
+    }
+
+    // Объект, который живёт вне кучи (например, интернированный символ)
+    // и никогда не собирается.
+    template <class T>
+    static T *MakePermanent(T *object) {
+        SetPermanent(object);
+        return object;
+    }
+
+    // owner теперь ссылается на value.
+    void WriteBarrier(Object *owner, Object *value) {
+        if (IsYoung(value) && !IsYoung(owner)) {
+            Remember(owner);
+        }
+    }
+
+    void WriteBarrier(ValueHolder *owner, Object *value) {
+        if (IsYoung(value) && !owner->gc_heap_) {
+            Remember(owner);
+        }
+    }
+
+    bool IsYoung(const void *object) const {
+        auto address = reinterpret_cast<uintptr_t>(object);
+        return address >= reinterpret_cast<uintptr_t>(nursery_.get()) &&
+               address < reinterpret_cast<uintptr_t>(nursery_end_);
+    }
+
+    void AddRoots(RootSet *roots);
+
+    void RemoveRoots(RootSet *roots);
+
+    // Безопасная точка: полная сборка, если старшее поколение выросло,
+    // иначе малая, если заполнились ясли.
+    void Safepoint() {
+        if (allocated_since_collection_ >= threshold_) {
+            Collect();
+        } else if (nursery_top_ >= nursery_limit_) {
+            CollectYoung();
+        }
+    }
+
+    // Полная сборка; ясли при этом тоже очищаются.
+    void Collect();
+
+    void CollectYoung();
+
+    // Собирать в каждой безопасной точке после любого выделения.
+    void SetStressMode(bool enabled);
+
+    // Помечает объект и откладывает обход его полей. Молодой объект
+    // копируется в старшее поколение, и value переписывается на копию.
+    void Mark(Value &value);
+
+    // Для областей видимости и байткода, которые живут вне кучи: true,
+    // если в этой сборке их ещё не обходили. В малой сборке всегда false:
+    // нужные из них уже запомнил барьер.
+    bool Visit(size_t *epoch);
+
+    size_t GetObjectCount() const;
+
+private:
+    void *AllocateYoung(size_t size, size_t align) {
+        auto top = reinterpret_cast<uintptr_t>(nursery_top_);
+        top = (top + align - 1) & ~(align - 1);
+        if (top + size > reinterpret_cast<uintptr_t>(nursery_end_)) {
+            return nullptr;
+        }
+        nursery_top_ = reinterpret_cast<char *>(top + size);
+        ++young_count_;
+        return reinterpret_cast<void *>(top);
+    }
+
+    void Register(Object *object);
+
+    void AddOld(Object *object);
+
+    void Remember(Object *object);
+
+    void Remember(ValueHolder *holder);
+
+    void Forget(ValueHolder *holder);
+
+    Object *Promote(Object *object);
+
+    void TraceRoots();
+
+    void ResetNursery();
+
+    void UpdateLimits();
+
+    static void SetPermanent(Object *object);
+
+    static thread_local Heap *current_;
+
+    friend class HeapContext;
+    friend class ValueHolder;
+
+    Object *objects_ = nullptr;
+    size_t object_count_ = 0;
+    size_t allocated_since_collection_ = 0;
+    size_t threshold_;
+    bool stress_ = false;
+    bool minor_ = false;
+    size_t epoch_ = 0;
+    std::vector<Object *> gray_;
+    std::vector<RootSet *> roots_;
+
+    std::unique_ptr<char[]> nursery_;
+    char *nursery_top_;
+    char *nursery_limit_;
+    char *nursery_end_;
+    size_t young_count_ = 0;
+    std::vector<Object *> remembered_objects_;
+    std::vector<ValueHolder *> remembered_holders_;
+};
+
+// Делает heap текущей кучей потока на время жизни объекта.
+class HeapContext {
+public:
+    explicit HeapContext(Heap *heap);
+
+    HeapContext(const HeapContext &) = delete;
+
+    HeapContext &operator=(const HeapContext &) = delete;
+
+    ~HeapContext();
+
+private:
+    Heap *previous_;
+};
+
+template <class T, class... Args>
+T *Make(Args &&...args) {
+    return Heap::Current()->Make<T>(std::forward<Args>(args)...);
+}
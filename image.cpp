@@ -0,0 +1,504 @@
+#include <algorithm>
+#include <cstdint>
+#include <cstring>
+#include <memory>
+#include <string>
+#include <string_view>
+#include <utility>
+#include <vector>
+
+#include <image.h>
+
+const char kImageMagic[8] = {'S', 'C', 'M', 'I', 'M', 'A', 'G', 'E'};
+// сигнатура, версия, пустое поле, размер данных, контрольная сумма
+const size_t kImageHeaderSize = 32;
+
+enum class ImageTag : uint8_t {
+    NUMBER,     // целое вне Fixnum
+    SYMBOL,     // имя
+    BUILTIN,    // имя встроенной функции
+    CELL,       // первое и второе значения
+    LIST,       // голова
+    LAMBDA,     // параметры, кадр, тело
+    UNBOUND     // Scope::Unbound() в ячейке кадра
+};
+
+void PutVarint(std::string *out, uint64_t value) {
+    while (value >= 0x80) {
+        out->push_back(static_cast<char>(value | 0x80));
+        value >>= 7;
+    }
+    out->push_back(static_cast<char>(value));
+}
+
+void PutFixed(std::string *out, uint64_t value, size_t size) {
+    for (size_t i = 0; i < size; ++i) {
+        out->push_back(static_cast<char>(value >> (8 * i)));
+    }
+}
+
+uint64_t GetFixed(std::string_view data, size_t position, size_t size) {
+    uint64_t value = 0;
+    for (size_t i = 0; i < size; ++i) {
+        value |= static_cast<uint64_t>(static_cast<unsigned char>(data[position + i])) << (8 * i);
+    }
+    return value;
+}
+
+uint64_t ImageChecksum(std::string_view data) {
+    // FNV-1a
+    uint64_t hash = 14695981039346656037ull;
+    for (char c : data) {
+        hash = (hash ^ static_cast<unsigned char>(c)) * 1099511628211ull;
+    }
+    return hash;
+}
+
+// Отрицательные числа малы по модулю чаще, чем велики.
+uint64_t Zigzag(int64_t value) {
+    return (static_cast<uint64_t>(value) << 1) ^ static_cast<uint64_t>(value >> 63);
+}
+
+int64_t Unzigzag(uint64_t value) {
+    return static_cast<int64_t>(value >> 1) ^ -static_cast<int64_t>(value & 1);
+}
+
+// Значение в образе: 0 - пустой список, нечётное - целое,
+// чётное - номер объекта плюс один.
+uint64_t EncodeFixnum(int64_t value) {
+    return (Zigzag(value) << 1) | 1;
+}
+
+int64_t DecodeFixnum(uint64_t bits) {
+    return Unzigzag(bits >> 1);
+}
+
+[[noreturn]] void ThrowBadImage() {
+    throw RuntimeError("Образ повреждён");
+}
+
+ImageWriter::ImageWriter(Scope *global) : global_(global) {
+}
+
+std::string ImageWriter::Write() {
+    // по имени, чтобы одно окружение давало один и тот же образ
+    std::vector<std::pair<const std::string *, Binding *>> variables;
+    for (auto &variable : global_->variables_) {
+        auto binding = variable.second.get();
+        if (binding->defined_ && !binding->HoldsBuiltin()) {
+            variables.emplace_back(&variable.first, binding);
+        }
+    }
+    std::sort(variables.begin(), variables.end(),
+              [](const auto &lhs, const auto &rhs) { return *lhs.first < *rhs.first; });
+
+    std::string globals;
+    PutVarint(&globals, variables.size());
+    for (auto &variable : variables) {
+        PutVarint(&globals, StringRef(*variable.first));
+        PutVarint(&globals, ValueRef(variable.second->value_));
+    }
+
+    // обход в ширину: записи добавляют в очередь то, на что ссылаются
+    std::string objects;
+    std::string scopes;
+    for (size_t object = 0, scope = 0; object < objects_.size() || scope < scopes_.size();) {
+        if (object < objects_.size()) {
+            WriteObject(objects_[object++], &objects);
+        } else {
+            WriteScope(scopes_[scope++], &scopes);
+        }
+    }
+
+    std::string payload;
+    PutVarint(&payload, strings_.size());
+    for (auto &str : strings_) {
+        PutVarint(&payload, str.size());
+        payload += str;
+    }
+    PutVarint(&payload, names_.size());
+    for (auto &names : names_) {
+        PutVarint(&payload, names->size());
+        for (auto &name : *names) {
+            PutVarint(&payload, string_ids_.at(name));
+        }
+    }
+    PutVarint(&payload, objects_.size());
+    PutVarint(&payload, scopes_.size());
+    payload += objects;
+    payload += scopes;
+    payload += globals;
+
+    std::string image(kImageMagic, sizeof(kImageMagic));
+    PutFixed(&image, kImageVersion, 4);
+    PutFixed(&image, 0, 4);
+    PutFixed(&image, payload.size(), 8);
+    PutFixed(&image, ImageChecksum(payload), 8);
+    image += payload;
+    return image;
+}
+
+uint64_t ImageWriter::ValueRef(Value value) {
+    if (!value) {
+        return 0;
+    }
+    if (value.IsFixnum()) {
+        return EncodeFixnum(value.GetFixnum());
+    }
+    auto object = value.GetObject();
+    auto [it, inserted] = object_ids_.emplace(object, objects_.size());
+    if (inserted) {
+        objects_.push_back(object);
+    }
+    return (it->second + 1) << 1;
+}
+
+uint64_t ImageWriter::ScopeRef(Scope *scope) {
+    if (scope == global_) {
+        return 0;
+    }
+    if (scope->builtins_) {
+        throw RuntimeError("Lambda из другого интерпретатора нельзя сохранить в образ");
+    }
+    auto [it, inserted] = scope_ids_.emplace(scope, scopes_.size());
+    if (inserted) {
+        scopes_.push_back(scope);
+    }
+    return it->second + 1;
+}
+
+uint64_t ImageWriter::StringRef(const std::string &str) {
+    auto [it, inserted] = string_ids_.emplace(str, strings_.size());
+    if (inserted) {
+        strings_.push_back(str);
+    }
+    return it->second;
+}
+
+uint64_t ImageWriter::NamesRef(const std::shared_ptr<const std::vector<std::string>> &names) {
+    if (!names) {
+        return 0;
+    }
+    auto [it, inserted] = names_ids_.emplace(names.get(), names_.size());
+    if (inserted) {
+        names_.push_back(names);
+        for (auto &name : *names) {
+            StringRef(name);
+        }
+    }
+    return it->second + 1;
+}
+
+void ImageWriter::WriteObject(Object *object, std::string *out) {
+    auto put_tag = [out](ImageTag tag) { out->push_back(static_cast<char>(tag)); };
+    // это тоже символ, но не интернированный
+    if (object == Scope::Unbound().GetObject()) {
+        put_tag(ImageTag::UNBOUND);
+        return;
+    }
+    switch (object->GetType()) {
+        case ObjectType::NUMBER:
+            put_tag(ImageTag::NUMBER);
+            PutVarint(out, Zigzag(static_cast<Number *>(object)->GetValue()));
+            return;
+        case ObjectType::SYMBOL:
+            put_tag(ImageTag::SYMBOL);
+            PutVarint(out, StringRef(static_cast<Symbol *>(object)->GetName()));
+            return;
+        case ObjectType::CELL: {
+            auto cell = static_cast<Cell *>(object);
+            put_tag(ImageTag::CELL);
+            PutVarint(out, ValueRef(cell->GetFirst()));
+            PutVarint(out, ValueRef(cell->GetSecond()));
+            return;
+        }
+        case ObjectType::LIST:
+            put_tag(ImageTag::LIST);
+            PutVarint(out, ValueRef(static_cast<List *>(object)->Head()));
+            return;
+        case ObjectType::LAMBDA: {
+            auto lambda = static_cast<Lambda *>(object);
+            put_tag(ImageTag::LAMBDA);
+            PutVarint(out, NamesRef(lambda->GetVariables()));
+            PutVarint(out, ScopeRef(lambda->GetScope().get()));
+            PutVarint(out, lambda->GetBody().size());
+            for (auto &step : lambda->GetBody()) {
+                PutVarint(out, ValueRef(step));
+            }
+            return;
+        }
+        default:
+            break;
+    }
+    auto name = BuiltinTable::Get().NameOf(object);
+    if (name.empty()) {
+        throw RuntimeError("Этот объект нельзя сохранить в образ");
+    }
+    put_tag(ImageTag::BUILTIN);
+    PutVarint(out, StringRef(std::string(name)));
+}
+
+void ImageWriter::WriteScope(Scope *scope, std::string *out) {
+    PutVarint(out, ScopeRef(scope->parent_.get()));
+    PutVarint(out, NamesRef(scope->names_));
+    PutVarint(out, scope->fixed_names_);
+    PutVarint(out, scope->slots_.size());
+    for (auto &slot : scope->slots_) {
+        PutVarint(out, ValueRef(slot));
+    }
+    std::vector<std::pair<const std::string *, Binding *>> variables;
+    for (auto &variable : scope->variables_) {
+        if (variable.second->defined_) {
+            variables.emplace_back(&variable.first, variable.second.get());
+        }
+    }
+    std::sort(variables.begin(), variables.end(),
+              [](const auto &lhs, const auto &rhs) { return *lhs.first < *rhs.first; });
+    PutVarint(out, variables.size());
+    for (auto &variable : variables) {
+        PutVarint(out, StringRef(*variable.first));
+        PutVarint(out, ValueRef(variable.second->value_));
+    }
+}
+
+ImageReader::ImageReader(std::string_view data, std::shared_ptr<Scope> global)
+        : data_(data), global_(std::move(global)) {
+}
+
+void ImageReader::Read() {
+    if (data_.size() < kImageHeaderSize ||
+        std::memcmp(data_.data(), kImageMagic, sizeof(kImageMagic)) != 0) {
+        throw RuntimeError("Это не образ интерпретатора");
+    }
+    if (GetFixed(data_, 8, 4) != kImageVersion) {
+        throw RuntimeError("Образ записан другой версией интерпретатора");
+    }
+    auto payload = data_.substr(kImageHeaderSize);
+    if (GetFixed(data_, 16, 8) != payload.size() ||
+        GetFixed(data_, 24, 8) != ImageChecksum(payload)) {
+        ThrowBadImage();
+    }
+    data_ = payload;
+    position_ = 0;
+
+    strings_.resize(GetIndex(data_.size() + 1));
+    for (auto &str : strings_) {
+        auto size = GetIndex(data_.size() - position_ + 1);
+        str = data_.substr(position_, size);
+        position_ += size;
+    }
+    names_.resize(GetIndex(data_.size() + 1));
+    for (auto &names : names_) {
+        std::vector<std::string> list(GetIndex(data_.size() + 1));
+        for (auto &name : list) {
+            name = strings_[GetIndex(strings_.size())];
+        }
+        names = std::make_shared<const std::vector<std::string>>(std::move(list));
+    }
+    objects_.resize(GetIndex(data_.size() + 1));
+    scopes_.resize(GetIndex(data_.size() + 1));
+    for (auto &scope : scopes_) {
+        scope = std::make_shared<Scope>(nullptr, nullptr, std::vector<Value>());
+    }
+
+    auto objects_start = position_;
+    for (size_t i = 0; i < objects_.size(); ++i) {
+        ReadObject(i, false);
+    }
+    position_ = objects_start;
+    for (size_t i = 0; i < objects_.size(); ++i) {
+        ReadObject(i, true);
+    }
+    for (size_t i = 0; i < scopes_.size(); ++i) {
+        ReadScope(i);
+    }
+    // кадры записаны в порядке обхода, а не от родителя к потомку, поэтому
+    // замкнутую цепочку видно только после того, как связаны все
+    for (auto &scope : scopes_) {
+        auto steps = scopes_.size();
+        auto parent = scope->parent_.get();
+        for (; parent && parent != global_.get() && steps; --steps) {
+            parent = parent->parent_.get();
+        }
+        if (parent != global_.get()) {
+            // иначе кадры цикла держали бы друг друга вечно
+            for (auto &frame : scopes_) {
+                frame->parent_.reset();
+            }
+            ThrowBadImage();
+        }
+    }
+
+    std::vector<std::pair<std::string_view, Value>> variables(GetIndex(data_.size() + 1));
+    for (auto &variable : variables) {
+        variable.first = strings_[GetIndex(strings_.size())];
+        variable.second = GetValue();
+    }
+    if (position_ != data_.size()) {
+        ThrowBadImage();
+    }
+    // только когда образ прочитан целиком
+    for (auto &variable : variables) {
+        global_->OverrideVariable(std::string(variable.first), variable.second);
+    }
+}
+
+uint8_t ImageReader::GetByte() {
+    if (position_ == data_.size()) {
+        ThrowBadImage();
+    }
+    return static_cast<uint8_t>(data_[position_++]);
+}
+
+uint64_t ImageReader::GetVarint() {
+    uint64_t value = 0;
+    for (int shift = 0; shift < 64; shift += 7) {
+        auto byte = GetByte();
+        value |= static_cast<uint64_t>(byte & 0x7F) << shift;
+        if (!(byte & 0x80)) {
+            return value;
+        }
+    }
+    ThrowBadImage();
+}
+
+size_t ImageReader::GetIndex(size_t limit) {
+    auto index = GetVarint();
+    if (index >= limit) {
+        ThrowBadImage();
+    }
+    return index;
+}
+
+Value ImageReader::GetValue() {
+    auto bits = GetVarint();
+    if (!bits) {
+        return nullptr;
+    }
+    if (bits & 1) {
+        return Value::Fixnum(DecodeFixnum(bits));
+    }
+    auto index = (bits >> 1) - 1;
+    if (index >= objects_.size()) {
+        ThrowBadImage();
+    }
+    return objects_[index];
+}
+
+std::shared_ptr<Scope> ImageReader::GetScope() {
+    auto index = GetIndex(scopes_.size() + 1);
+    return index ? scopes_[index - 1] : global_;
+}
+
+std::shared_ptr<const std::vector<std::string>> ImageReader::GetNames() {
+    auto index = GetIndex(names_.size() + 1);
+    return index ? names_[index - 1] : nullptr;
+}
+
+void ImageReader::ReadObject(size_t index, bool fill) {
+    auto tag = GetByte();
+    if (!fill) {
+        switch (static_cast<ImageTag>(tag)) {
+            case ImageTag::NUMBER:
+                objects_[index] = Make<Number>(Unzigzag(GetVarint()));
+                return;
+            case ImageTag::SYMBOL:
+                objects_[index] = Symbol::Intern(strings_[GetIndex(strings_.size())]);
+                return;
+            case ImageTag::BUILTIN:
+                objects_[index] = BuiltinTable::Get().Find(strings_[GetIndex(strings_.size())]);
+                if (!objects_[index]) {
+                    throw RuntimeError("В образе неизвестная встроенная функция");
+                }
+                return;
+            case ImageTag::CELL:
+                objects_[index] = Make<Cell>();
+                GetVarint();
+                GetVarint();
+                return;
+            case ImageTag::LIST:
+                objects_[index] = Make<List>(nullptr);
+                GetVarint();
+                return;
+            case ImageTag::LAMBDA: {
+                // кадр до второго прохода - global_, чтобы сборщику было что обходить
+                objects_[index] = Make<Lambda>(nullptr, std::vector<Value>(), global_);
+                GetVarint();
+                GetVarint();
+                for (auto size = GetIndex(data_.size()); size; --size) {
+                    GetVarint();
+                }
+                return;
+            }
+            case ImageTag::UNBOUND:
+                objects_[index] = Scope::Unbound();
+                return;
+        }
+        ThrowBadImage();
+    }
+
+    auto object = objects_[index].GetObject();
+    switch (static_cast<ImageTag>(tag)) {
+        case ImageTag::UNBOUND:
+            return;
+        case ImageTag::NUMBER:
+        case ImageTag::SYMBOL:
+        case ImageTag::BUILTIN:
+            GetVarint();
+            return;
+        case ImageTag::CELL: {
+            auto cell = static_cast<Cell *>(object);
+            cell->SetFirst(GetValue());
+            cell->SetSecond(GetValue());
+            return;
+        }
+        case ImageTag::LIST: {
+            auto list = static_cast<List *>(object);
+            list->head_ = GetValue();
+            Heap::Current()->WriteBarrier(list, list->head_.GetObject());
+            return;
+        }
+        case ImageTag::LAMBDA: {
+            auto lambda = static_cast<Lambda *>(object);
+            lambda->defined_variables_ = GetNames();
+            if (!lambda->defined_variables_) {
+                ThrowBadImage();
+            }
+            lambda->my_scope_ = GetScope();
+            auto size = GetIndex(data_.size());
+            lambda->body_of_function_.reserve(size);
+            for (; size; --size) {
+                auto step = GetValue();
+                Heap::Current()->WriteBarrier(lambda, step.GetObject());
+                lambda->body_of_function_.push_back(step);
+            }
+            return;
+        }
+    }
+}
+
+void ImageReader::ReadScope(size_t index) {
+    auto &scope = scopes_[index];
+    auto parent = GetIndex(scopes_.size() + 1);
+    scope->parent_ = parent ? scopes_[parent - 1] : global_;
+    scope->journal_ = global_->journal_;
+    scope->global_ = global_.get();
+    scope->names_ = GetNames();
+    scope->fixed_names_ = GetIndex(2);
+    scope->slots_.resize(GetIndex(data_.size()));
+    for (auto &slot : scope->slots_) {
+        slot = GetValue();
+        Heap::Current()->WriteBarrier(scope.get(), slot.GetObject());
+    }
+    if (scope->names_ && scope->names_->size() > scope->slots_.size()) {
+        ThrowBadImage();
+    }
+    // по номерам из names_ к ячейкам обращается скомпилированный код
+    if (scope->fixed_names_ && (!scope->names_ || scope->names_->size() != scope->slots_.size())) {
+        ThrowBadImage();
+    }
+    for (auto size = GetIndex(data_.size()); size; --size) {
+        auto name = strings_[GetIndex(strings_.size())];
+        scope->GetBinding(std::string(name))->Assign(GetValue());
+    }
+}
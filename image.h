@@ -0,0 +1,90 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+#include <vector>
+
+#include "parser.h"
+
+// Образ глобального окружения: переменные и всё, на что они ссылаются
+// (ячейки, числа, символы, lambda с телами и захваченными кадрами).
+// Заголовок - сигнатура, версия формата, размер и контрольная сумма данных.
+// Данные - таблица строк, списки имён параметров, объекты, кадры и сами
+// переменные; числа и ссылки записаны переменной длиной (LEB128).
+// Встроенные функции и символы сохраняются по имени. Байткод не сохраняется:
+// lambda из образа компилируются заново при первом вызове.
+const uint32_t kImageVersion = 2;
+
+// Собирает образ глобальной области global.
+class ImageWriter {
+public:
+    explicit ImageWriter(Scope *global);
+
+    // Образ целиком, вместе с заголовком.
+    std::string Write();
+
+private:
+    uint64_t ValueRef(Value value);
+
+    uint64_t ScopeRef(Scope *scope);
+
+    uint64_t StringRef(const std::string &str);
+
+    uint64_t NamesRef(const std::shared_ptr<const std::vector<std::string>> &names);
+
+    void WriteObject(Object *object, std::string *out);
+
+    void WriteScope(Scope *scope, std::string *out);
+
+    Scope *global_;
+    std::unordered_map<Object *, size_t> object_ids_;
+    std::vector<Object *> objects_;
+    std::unordered_map<Scope *, size_t> scope_ids_;
+    std::vector<Scope *> scopes_;
+    std::unordered_map<std::string, size_t> string_ids_;
+    std::vector<std::string> strings_;
+    std::unordered_map<const std::vector<std::string> *, size_t> names_ids_;
+    std::vector<std::shared_ptr<const std::vector<std::string>>> names_;
+};
+
+// Определяет в global переменные из образа ImageWriter. Данные не копируются
+// и должны жить, пока идёт чтение. RuntimeError, если образ повреждён
+// или записан другой версией формата; объекты при этом не попадают в global.
+class ImageReader {
+public:
+    ImageReader(std::string_view data, std::shared_ptr<Scope> global);
+
+    void Read();
+
+private:
+    uint8_t GetByte();
+
+    uint64_t GetVarint();
+
+    // Номер из [0, limit).
+    size_t GetIndex(size_t limit);
+
+    Value GetValue();
+
+    std::shared_ptr<Scope> GetScope();
+
+    std::shared_ptr<const std::vector<std::string>> GetNames();
+
+    // Первый проход создаёт объекты и пропускает ссылки, второй
+    // заполняет ссылки: объекты могут ссылаться друг на друга по кругу.
+    void ReadObject(size_t index, bool fill);
+
+    void ReadScope(size_t index);
+
+    std::string_view data_;
+    size_t position_ = 0;
+    std::shared_ptr<Scope> global_;
+    std::vector<std::string_view> strings_;
+    std::vector<std::shared_ptr<const std::vector<std::string>>> names_;
+    std::vector<Value> objects_;
+    std::vector<std::shared_ptr<Scope>> scopes_;
+};
@@ -1,353 +1,390 @@
 #include <vector>
+#include <algorithm>
+#include <atomic>
+#include <charconv>
+#include <ostream>
 #include <string>
+#include <string_view>
 #include <memory>
+#include <mutex>
 #include <unordered_map>
 #include <variant>
 
+#include <pthread.h>
+
 #include <parser.h>
 
-std::shared_ptr<Object> Object::Apply(std::vector<std::shared_ptr<Object>> &args,
-                                      std::shared_ptr<Scope> scope) {
+Value Object::Apply(ValueSpan args, const std::shared_ptr<Scope> &scope) {
     (void)args;
     (void)scope;
     throw SyntaxError("Нельзя применить к аргументам");
 }
 
-bool Object::IsSymbol() {
-    return false;
+Value Object::Eval(const std::shared_ptr<Scope> &scope) {
+    (void)scope;
+    throw SyntaxError("Нельзя звать Eval");
 }
 
-bool Object::IsNumber() {
-    return false;
+void Object::Trace(Heap *heap) {
+    (void)heap;
 }
 
-bool Object::IsCell() {
-    return false;
+Object *Object::Promote() const {
+    throw RuntimeError("Объект не переносится между поколениями");
 }
 
-bool Object::IsFunction() {
-    return false;
-}
+/***********************************************************
+ ***********************************************************
+ ***********************************************************/
 
-bool Object::IsSyntax() {
-    return false;
+void Cell::SetSecond(Value second) {
+    Heap::Current()->WriteBarrier(this, second.GetObject());
+    second_ptr_ = second;
 }
 
-bool Object::IsList() {
-    return false;
+void Cell::SetFirst(Value first) {
+    Heap::Current()->WriteBarrier(this, first.GetObject());
+    first_ptr_ = first;
 }
 
-bool Object::IsPair() {
-    return false;
+Cell::Cell(Value first, Value second)
+        : Object(ObjectType::CELL), first_ptr_(first), second_ptr_(second) {
 }
 
-bool Object::IsFalse() {
-    return false;
+Value Cell::GetFirst() const {
+    return first_ptr_;
 }
 
-bool Object::IsLambda() {
-    return false;
+Value Cell::GetSecond() const {
+    return second_ptr_;
 }
 
-std::shared_ptr<Object> Object::Eval(std::shared_ptr<Scope> scope) {
-    (void)scope;
-    throw SyntaxError("Нельзя звать Eval");
+void Cell::Trace(Heap *heap) {
+    heap->Mark(first_ptr_);
+    heap->Mark(second_ptr_);
+    heap->Mark(call_cache_);
 }
 
-/***********************************************************
- ***********************************************************
- ***********************************************************/
+Object *Cell::Promote() const {
+    return new Cell(*this);
+}
 
-bool Cell::IsCell() {
-    return true;
+Number::Number(int64_t val) : Object(ObjectType::NUMBER), value_(val) {
 }
 
-void Cell::SetSecond(std::shared_ptr<Object> second) {
-    second_ptr_ = second;
+int64_t Number::GetValue() {
+    return value_;
 }
 
-void Cell::SetFirst(std::shared_ptr<Object> first) {
-    first_ptr_ = first;
+Value Number::Eval(const std::shared_ptr<Scope> &scope) {
+    (void)scope;
+    return this;
 }
 
-Cell::Cell(std::shared_ptr<Object> first, std::shared_ptr<Object> second)
-        : first_ptr_(first), second_ptr_(second) {
+Object *Number::Promote() const {
+    return new Number(*this);
 }
 
-std::shared_ptr<Object> Cell::GetFirst() const {
-    return first_ptr_;
+Symbol::Symbol(std::string str) : Object(ObjectType::SYMBOL), name_(str) {
 }
 
-std::shared_ptr<Object> Cell::GetSecond() const {
-    return second_ptr_;
+// Ключ смотрит в имя самого символа, так что поиск по string_view
+// из буфера reader не создаёт строку; она создаётся только для нового имени.
+struct InternTable {
+    std::mutex mutex_;
+    std::unordered_map<std::string_view, std::unique_ptr<Symbol>> symbols_;
+};
+
+// Общая на процесс; создаётся при первом обращении, чтобы не зависеть
+// от порядка инициализации глобальных символов ниже.
+InternTable &GetInternTable() {
+    static InternTable table;
+    return table;
 }
 
-bool Number::IsNumber() {
-    return true;
+Symbol *Symbol::Intern(std::string_view name) {
+    auto &table = GetInternTable();
+    std::lock_guard<std::mutex> lock(table.mutex_);
+    auto it = table.symbols_.find(name);
+    if (it != table.symbols_.end()) {
+        return it->second.get();
+    }
+    std::unique_ptr<Symbol> symbol(Heap::MakePermanent(new Symbol(std::string(name))));
+    auto result = symbol.get();
+    table.symbols_.emplace(result->GetName(), std::move(symbol));
+    return result;
 }
 
-Number::Number(int64_t val) : value_(val) {
+size_t Symbol::InternTableSize() {
+    auto &table = GetInternTable();
+    std::lock_guard<std::mutex> lock(table.mutex_);
+    return table.symbols_.size();
 }
 
-int64_t Number::GetValue() {
-    return value_;
+Symbol *const kQuoteSymbol = Symbol::Intern("quote");
+Symbol *const kTrueSymbol = Symbol::Intern("#t");
+Symbol *const kFalseSymbol = Symbol::Intern("#f");
+Symbol *const kCloseBracketSymbol = Symbol::Intern(")");
+Symbol *const kDotSymbol = Symbol::Intern(".");
+
+Value ToBoolean(bool value) {
+    return value ? kTrueSymbol : kFalseSymbol;
 }
 
-std::shared_ptr<Object> Number::Eval(std::shared_ptr<Scope> scope) {
-    (void)scope;
-    return shared_from_this();
+const std::string &Symbol::GetName() const {
+    return name_;
 }
 
-Symbol::Symbol(std::string str) : name_(str) {
+bool Symbol::IsFalse() const {
+    return this == kFalseSymbol;
 }
 
-bool Symbol::IsSymbol() {
-    return true;
+bool Value::IsList() const {
+    return IsObject() && As<Object>()->GetType() == ObjectType::LIST && As<List>()->IsList();
 }
 
-std::string Symbol::GetName() {
-    return name_;
+bool Value::IsPair() const {
+    return IsObject() && As<Object>()->GetType() == ObjectType::LIST && As<List>()->IsPair();
 }
 
-bool Symbol::IsFalse() {
-    return name_ == "#f";
+bool Value::IsFalse() const {
+    return *this == kFalseSymbol;
 }
 
-List::List(std::shared_ptr<Object> head) : head_(head) {
+List::List(Value head) : Object(ObjectType::LIST), head_(head) {
 }
 
-std::shared_ptr<Cell> List::Head() {
-    return std::dynamic_pointer_cast<Cell>(head_);
+Cell *List::Head() {
+    return DynamicCast<Cell>(head_);
 }
 
-std::shared_ptr<Object> List::Eval(std::shared_ptr<Scope> scope) {
+Value List::Eval(const std::shared_ptr<Scope> &scope) {
     (void)scope;
     throw RuntimeError("Нельзя звать eval от list");
 }
 
-std::shared_ptr<Object> List::SetCdr(std::shared_ptr<Object> new_tail) {
+Value List::SetCdr(Value new_tail) {
     // cdr
     if (!head_) {
         throw SyntaxError("Редактируемый список пусть");
     }
-    std::dynamic_pointer_cast<Cell>(head_)->SetSecond(new_tail);
-    return shared_from_this();
+    DynamicCast<Cell>(head_)->SetSecond(new_tail);
+    return this;
 }
 
-std::shared_ptr<Object> List::SetCar(std::shared_ptr<Object> new_first) {
+Value List::SetCar(Value new_first) {
     // car
     if (!head_) {
         throw SyntaxError("Редактируемый список пусть");
     }
-    std::dynamic_pointer_cast<Cell>(head_)->SetFirst(new_first);
-    return shared_from_this();
+    DynamicCast<Cell>(head_)->SetFirst(new_first);
+    return this;
 }
 
-std::shared_ptr<Object> List::Car() {
+Value List::Car() {
     if (!head_) {
         throw SyntaxError("Список пусть");
     }
-    return std::dynamic_pointer_cast<Cell>(head_)->GetFirst();
+    return DynamicCast<Cell>(head_)->GetFirst();
 }
 
-std::shared_ptr<Object> List::Cdr() {
+Value List::Cdr() {
     if (!head_) {
         throw SyntaxError("Список пусть");
     }
-    return std::dynamic_pointer_cast<Cell>(head_)->GetSecond();
+    return DynamicCast<Cell>(head_)->GetSecond();
 }
 
-bool List::IsList() {
-    auto temp = head_;
-    while (temp && temp->IsCell()) {
-        temp = std::dynamic_pointer_cast<Cell>(temp)->GetSecond();
+// Цепочка ячеек от head заканчивается пустым списком.
+bool IsProperList(Value head) {
+    while (head.IsCell()) {
+        head = head.As<Cell>()->GetSecond();
     }
-    return temp == nullptr;
+    return head == nullptr;
 }
 
-bool List::IsPair() {
+bool List::IsList() const {
+    return IsProperList(head_);
+}
+
+bool List::IsPair() const {
     if (!head_) {
         return false;
     }
+    auto second = head_.As<Cell>()->GetSecond();
     // лист из двух штук
     if (IsList()) {
-        auto cell = std::dynamic_pointer_cast<Cell>(
-                std::dynamic_pointer_cast<Cell>(head_)->GetSecond());
+        auto cell = DynamicCast<Cell>(second);
         return (cell && !cell->GetSecond());
     }
     // пара
-    return (!std::dynamic_pointer_cast<Cell>(head_)->GetSecond()->IsCell());
+    return !second.IsCell();
+}
+
+void List::Trace(Heap *heap) {
+    heap->Mark(head_);
+}
+
+Object *List::Promote() const {
+    return new List(*this);
 }
 
 /***********************************************************
  ***********************************************************
  ***********************************************************/
 
-bool Function::IsFunction() {
-    return true;
+Function::Function(ObjectType type) : Object(type) {
 }
 
-void Function::EvalArgs(std::vector<std::shared_ptr<Object>> &args, std::shared_ptr<Scope> scope) {
+void Function::EvalArgs(ValueSpan args, const std::shared_ptr<Scope> &scope) {
     for (auto &arg : args) {
-        if (!arg) {
-            throw RuntimeError("Аргументом функции не может быть nullptr");
+        // пустой список вычисляется сам в себя
+        if (arg) {
+            arg = arg.Eval(scope);
         }
-        arg = arg->Eval(scope);
     }
 }
 
-std::shared_ptr<Object> Quote::Apply(std::vector<std::shared_ptr<Object>> &args,
-                              std::shared_ptr<Scope> scope) {
+Value Function::Apply(ValueSpan args, const std::shared_ptr<Scope> &scope) {
+    EvalArgs(args, scope);
+    return Call(args);
+}
+
+Value Quote::Apply(ValueSpan args, const std::shared_ptr<Scope> &scope) {
     (void)scope;
     if (args.size() != 1) {
         throw SyntaxError("Недостаточно аргументов для quote");
     }
-    if (!args[0] || args[0]->IsSymbol() || args[0]->IsList() ||args[0]->IsCell()) {
+    if (!args[0] || args[0].IsSymbol() || args[0].IsList() ||args[0].IsCell()) {
         return args[0];
     }
     throw SyntaxError("?? at quote");
 }
 
-std::shared_ptr<Object> Max::Apply(std::vector<std::shared_ptr<Object>> &args,
-                                   std::shared_ptr<Scope> scope) {
+Value Quote::Call(ValueSpan args) {
+    if (args.size() != 1) {
+        throw SyntaxError("Недостаточно аргументов для quote");
+    }
+    return args[0];
+}
+
+Value Max::Call(ValueSpan args) {
     if (args.size() < 1) {
         throw RuntimeError("Недостаточно аргументов для максимума");
     }
 
-    EvalArgs(args, scope);
-    if (!args[0]->IsNumber()) {
+    if (!args[0].IsNumber()) {
         throw RuntimeError("Неверный аргумент у максимума");
     }
-    int64_t max = std::dynamic_pointer_cast<Number>(args[0])->GetValue();
+    int64_t max = AsNumber(args[0]);
 
     for (size_t i = 1; i < args.size(); ++i) {
-        args[i] = args[i]->Eval(scope);
-        if (!args[i]->IsNumber()) {
+        if (!args[i].IsNumber()) {
             throw RuntimeError("Неверный аргумент у максимума");
         }
-        max = std::max(max, std::dynamic_pointer_cast<Number>(args[i])->GetValue());
+        max = std::max(max, AsNumber(args[i]));
     }
-    return std::make_shared<Number>(max);
+    return MakeNumber(max);
 }
 
 
-std::shared_ptr<Object> Min::Apply(std::vector<std::shared_ptr<Object>> &args,
-                                   std::shared_ptr<Scope> scope) {
+Value Min::Call(ValueSpan args) {
     if (args.size() < 1) {
         throw RuntimeError("Недостаточно аргументов для минимума");
     }
 
-    EvalArgs(args, scope);
-    if (!args[0]->IsNumber()) {
+    if (!args[0].IsNumber()) {
         throw RuntimeError("Неверный аргумент у минимума");
     }
-    int64_t min = std::dynamic_pointer_cast<Number>(args[0])->GetValue();
+    int64_t min = AsNumber(args[0]);
 
     for (size_t i = 1; i < args.size(); ++i) {
-        args[i] = args[i]->Eval(scope);
-        if (!args[i]->IsNumber()) {
+        if (!args[i].IsNumber()) {
             throw RuntimeError("Неверный аргумент у минимума");
         }
-        min = std::min(min, std::dynamic_pointer_cast<Number>(args[i])->GetValue());
+        min = std::min(min, AsNumber(args[i]));
     }
-    return std::make_shared<Number>(min);
+    return MakeNumber(min);
 }
 
-std::shared_ptr<Object> Abs::Apply(std::vector<std::shared_ptr<Object>> &args,
-                                   std::shared_ptr<Scope> scope) {
+Value Abs::Call(ValueSpan args) {
     if (args.size() != 1) {
         throw RuntimeError("Недостаточно аргументов для максимума");
     }
 
-    EvalArgs(args, scope);
-    if (!args[0]->IsNumber()) {
+    if (!args[0].IsNumber()) {
         throw RuntimeError("Неверный аргумент у деления");
     }
-    return std::make_shared<Number>(
-            std::abs(std::dynamic_pointer_cast<Number>(args[0])->GetValue()));
+    return MakeNumber(std::abs(AsNumber(args[0])));
 }
 
-std::shared_ptr<Object> Add::Apply(std::vector<std::shared_ptr<Object>> &args,
-                                   std::shared_ptr<Scope> scope) {
+Value Add::Call(ValueSpan args) {
     int64_t result = 0;
-    EvalArgs(args, scope);
     for (auto &arg : args) {
-        if (!arg->IsNumber()) {
+        if (!arg.IsNumber()) {
             throw RuntimeError("Неверный аргумент у сложения");
         }
-        result += std::dynamic_pointer_cast<Number>(arg)->GetValue();
+        result += AsNumber(arg);
     }
-    return std::make_shared<Number>(result);
+    return MakeNumber(result);
 }
 
-std::shared_ptr<Object> Multiply::Apply(std::vector<std::shared_ptr<Object>> &args,
-                                        std::shared_ptr<Scope> scope) {
+Value Multiply::Call(ValueSpan args) {
     int64_t result = 1;
-    EvalArgs(args, scope);
     for (auto &arg : args) {
-        if (!arg->IsNumber()) {
+        if (!arg.IsNumber()) {
             throw RuntimeError("Неверный аргумент у произведения");
         }
-        result *= std::dynamic_pointer_cast<Number>(arg)->GetValue();
+        result *= AsNumber(arg);
     }
-    return std::make_shared<Number>(result);
+    return MakeNumber(result);
 }
 
-std::shared_ptr<Object> Subtract::Apply(std::vector<std::shared_ptr<Object>> &args,
-                                        std::shared_ptr<Scope> scope) {
+Value Subtract::Call(ValueSpan args) {
     if (args.size() < 2) {
         throw RuntimeError("Недостаточно аргументов для вычитания");
     }
 
-    EvalArgs(args, scope);
-    if (!args[0]->IsNumber()) {
+    if (!args[0].IsNumber()) {
         throw RuntimeError("Неверный аргумент у вычитания");
     }
-    int64_t result = std::dynamic_pointer_cast<Number>(args[0])->GetValue();
+    int64_t result = AsNumber(args[0]);
 
     for (size_t i = 1; i < args.size(); ++i) {
-        if (!args[i]->IsNumber()) {
+        if (!args[i].IsNumber()) {
             throw RuntimeError("Неверный аргумент у вычитания");
         }
-        result -= std::dynamic_pointer_cast<Number>(args[i])->GetValue();
+        result -= AsNumber(args[i]);
     }
-    return std::make_shared<Number>(result);
+    return MakeNumber(result);
 }
 
-std::shared_ptr<Object> Divide::Apply(std::vector<std::shared_ptr<Object>> &args,
-                                      std::shared_ptr<Scope> scope) {
+Value Divide::Call(ValueSpan args) {
     if (args.size() < 2) {
         throw RuntimeError("Недостаточно аргументов для деления");
     }
 
-    EvalArgs(args, scope);
-    if (!args[0]->IsNumber()) {
+    if (!args[0].IsNumber()) {
         throw RuntimeError("Неверный аргумент у деления");
     }
 
-    int64_t result = std::dynamic_pointer_cast<Number>(args[0])->GetValue();
+    int64_t result = AsNumber(args[0]);
 
     for (size_t i = 1; i < args.size(); ++i) {
-        args[i] = args[i]->Eval(scope);
-        if (!args[i]->IsNumber()) {
+        if (!args[i].IsNumber()) {
             throw RuntimeError("Неверный аргумент у деления");
         }
-        result /= std::dynamic_pointer_cast<Number>(args[i])->GetValue();
+        result /= AsNumber(args[i]);
     }
-    return std::make_shared<Number>(result);
+    return MakeNumber(result);
 }
 
-std::shared_ptr<Object> Not::Apply(std::vector<std::shared_ptr<Object>> &args,
-                                   std::shared_ptr<Scope> scope) {
+Value Not::Call(ValueSpan args) {
     if (args.size() != 1) {
         throw RuntimeError("Неверное количество аргументов");
     }
 
-    EvalArgs(args, scope);
-    if (args[0] && args[0]->IsFalse()) {
-        return std::make_shared<Symbol>("#t");
-    }
-    return std::make_shared<Symbol>("#f");
+    return ToBoolean(args[0] && args[0].IsFalse());
 }
 
 
@@ -357,135 +394,78 @@ std::shared_ptr<Object> Not::Apply(std::vector<std::shared_ptr<Object>> &args,
  ***********************************************************
  ***********************************************************/
 
-std::shared_ptr<Object> QNull::Apply(std::vector<std::shared_ptr<Object>> &args,
-                                     std::shared_ptr<Scope> scope) {
+Value QNull::Call(ValueSpan args) {
     if (args.size() != 1) {
         throw SyntaxError("Неверное количество аргументов");
     }
 
-    if (args[0]) {
-        args[0] = args[0]->Eval(scope);
-    }
-    if (!args[0]) {
-        return std::make_shared<Symbol>("#t");
-    }
-    return std::make_shared<Symbol>("#f");
+    return ToBoolean(!args[0]);
 }
 
-std::shared_ptr<Object> QPair::Apply(std::vector<std::shared_ptr<Object>> &args,
-                                     std::shared_ptr<Scope> scope) {
+Value QPair::Call(ValueSpan args) {
     if (args.size() != 1) {
         throw SyntaxError("Неверное количество аргументов");
     }
-    // не пустой
+    // пустой список
     if (!args[0]) {
-        return std::make_shared<Symbol>("#f");
-    }
-    // переменная/выражение
-    if (!args[0]->IsList()) {
-        args[0] = args[0]->Eval(scope);
-        // became null
-        if (!args[0]) {
-            return std::make_shared<Symbol>("#f");
-        }
+        return kFalseSymbol;
     }
 
     // cell/list
-    if (!args[0]->IsCell() && !args[0]->IsList()) {
-        return std::make_shared<Symbol>("#f");
+    if (!args[0].IsCell() && !args[0].IsList()) {
+        return kFalseSymbol;
     }
 
     // list
-    if (args[0]->IsCell()) {
-        args[0] = std::make_shared<List>(args[0]);
-    }
-
-    if (args[0]->IsPair()) {
-        return std::make_shared<Symbol>("#t");
+    if (args[0].IsCell()) {
+        return ToBoolean(List(args[0]).IsPair());
     }
-    return std::make_shared<Symbol>("#f");
+    return ToBoolean(args[0].IsPair());
 }
 
-std::shared_ptr<Object> QList::Apply(std::vector<std::shared_ptr<Object>> &args,
-                                     std::shared_ptr<Scope> scope) {
-
+Value QList::Call(ValueSpan args) {
     if (args.size() != 1) {
         throw SyntaxError("Неверное количество аргументов");
     }
-    // не пустой
+    // пустой список
     if (!args[0]) {
-        return std::make_shared<Symbol>("#f");
-    }
-    // переменная/выражение
-    if (!args[0]->IsList()) {
-        args[0] = args[0]->Eval(scope);
-        //became null
-        if (!args[0]) {
-            return std::make_shared<Symbol>("#t");
-        }
+        return kTrueSymbol;
     }
 
-    if (!args[0]->IsCell() && !args[0]->IsList()) {
-        return std::make_shared<Symbol>("#f");
+    if (!args[0].IsCell() && !args[0].IsList()) {
+        return kFalseSymbol;
     }
 
     // list
-    if (args[0]->IsCell()) {
-        args[0] = std::make_shared<List>(args[0]);
+    if (args[0].IsCell()) {
+        return ToBoolean(List(args[0]).IsList());
     }
-    if (args[0]->IsList()) {
-        return std::make_shared<Symbol>("#t");
-    }
-    return std::make_shared<Symbol>("#f");
+    return ToBoolean(args[0].IsList());
 }
 
-std::shared_ptr<Object> QNumber::Apply(std::vector<std::shared_ptr<Object>> &args,
-                                       std::shared_ptr<Scope> scope) {
+Value QNumber::Call(ValueSpan args) {
     if (args.size() != 1) {
         throw SyntaxError("Неверное количество аргументов");
     }
 
-    if (args[0]) {
-        args[0] = args[0]->Eval(scope);
-        if (args[0]->IsNumber()) {
-            return std::make_shared<Symbol>("#t");
-        }
-    }
-    return std::make_shared<Symbol>("#f");
+    return ToBoolean(args[0] && args[0].IsNumber());
 }
 
-std::shared_ptr<Object> QBoolean::Apply(std::vector<std::shared_ptr<Object>> &args,
-                                        std::shared_ptr<Scope> scope) {
+Value QBoolean::Call(ValueSpan args) {
     if (args.size() != 1) {
         throw SyntaxError("Неверное количество аргументов");
     }
 
-    if (args[0]) {
-        args[0] = args[0]->Eval(scope);
-        if (args[0] && args[0]->IsSymbol()) {
-            auto name = std::dynamic_pointer_cast<Symbol>(args[0])->GetName();
-            if (name == "#t" || name == "#f") {
-                return std::make_shared<Symbol>("#t");
-            }
-        }
-    }
-    return std::make_shared<Symbol>("#f");
+    return ToBoolean(args[0] == kTrueSymbol || args[0] == kFalseSymbol);
 }
 
 
-std::shared_ptr<Object> QSymbol::Apply(std::vector<std::shared_ptr<Object>> &args,
-                                       std::shared_ptr<Scope> scope) {
+Value QSymbol::Call(ValueSpan args) {
     if (args.size() != 1) {
         throw SyntaxError("Неверное количество аргументов");
     }
 
-    if (args[0]) {
-        args[0] = args[0]->Eval(scope);
-        if (args[0] && args[0]->IsSymbol()) {
-            return std::make_shared<Symbol>("#t");
-        }
-    }
-    return std::make_shared<Symbol>("#f");
+    return ToBoolean(args[0] && args[0].IsSymbol());
 }
 
 
@@ -493,533 +473,1218 @@ std::shared_ptr<Object> QSymbol::Apply(std::vector<std::shared_ptr<Object>> &arg
  ***********************************************************
  ***********************************************************/
 
-std::shared_ptr<Object> Less::Apply(std::vector<std::shared_ptr<Object>> &args,
-                                    std::shared_ptr<Scope> scope) {
+Value Less::Call(ValueSpan args) {
     if (args.size() < 2) {
-        return std::make_shared<Symbol>("#t");
+        return kTrueSymbol;
     }
 
-    EvalArgs(args, scope);
-    if (!args[0]->IsNumber()) {
+    if (!args[0].IsNumber()) {
         throw RuntimeError("Неверный аргумент у сравнения");
     }
     for (size_t i = 1; i < args.size(); ++i) {
-        if (!args[i]->IsNumber()) {
+        if (!args[i].IsNumber()) {
             throw RuntimeError("Неверный аргумент у сравнения");
         }
-        if (!(std::dynamic_pointer_cast<Number>(args[i - 1])->GetValue() <
-              std::dynamic_pointer_cast<Number>(args[i])->GetValue())) {
-            return std::make_shared<Symbol>("#f");
+        if (!(AsNumber(args[i - 1]) < AsNumber(args[i]))) {
+            return kFalseSymbol;
         }
     }
-    return std::make_shared<Symbol>("#t");
+    return kTrueSymbol;
 }
 
-std::shared_ptr<Object> LessEq::Apply(std::vector<std::shared_ptr<Object>> &args,
-                                      std::shared_ptr<Scope> scope) {
+Value LessEq::Call(ValueSpan args) {
     if (args.size() < 2) {
-        return std::make_shared<Symbol>("#t");
+        return kTrueSymbol;
     }
 
-    EvalArgs(args, scope);
-    if (!args[0]->IsNumber()) {
+    if (!args[0].IsNumber()) {
         throw RuntimeError("Неверный аргумент у сравнения");
     }
     for (size_t i = 1; i < args.size(); ++i) {
-        if (!args[i]->IsNumber()) {
+        if (!args[i].IsNumber()) {
             throw RuntimeError("Неверный аргумент у сравнения");
         }
-        if (!(std::dynamic_pointer_cast<Number>(args[i - 1])->GetValue() <=
-              std::dynamic_pointer_cast<Number>(args[i])->GetValue())) {
-            return std::make_shared<Symbol>("#f");
+        if (!(AsNumber(args[i - 1]) <= AsNumber(args[i]))) {
+            return kFalseSymbol;
         }
     }
-    return std::make_shared<Symbol>("#t");
+    return kTrueSymbol;
 }
 
-std::shared_ptr <Object> More::Apply(std::vector<std::shared_ptr<Object>> &args,
-                                    std::shared_ptr<Scope> scope) {
+Value More::Call(ValueSpan args) {
     if (args.size() < 2) {
-        return std::make_shared<Symbol>("#t");
+        return kTrueSymbol;
     }
 
-    EvalArgs(args, scope);
-    if (!args[0]->IsNumber()) {
+    if (!args[0].IsNumber()) {
         throw RuntimeError("Неверный аргумент у сравнения");
     }
     for (size_t i = 1; i < args.size(); ++i) {
-        if (!args[i]->IsNumber()) {
+        if (!args[i].IsNumber()) {
             throw RuntimeError("Неверный аргумент у сравнения");
         }
-        if (!(std::dynamic_pointer_cast<Number>(args[i - 1])->GetValue() >
-              std::dynamic_pointer_cast<Number>(args[i])->GetValue())) {
-            return std::make_shared<Symbol>("#f");
+        if (!(AsNumber(args[i - 1]) > AsNumber(args[i]))) {
+            return kFalseSymbol;
         }
     }
-    return std::make_shared<Symbol>("#t");
+    return kTrueSymbol;
 }
 
 
-std::shared_ptr<Object> MoreEq::Apply(std::vector<std::shared_ptr<Object>> &args,
-                                      std::shared_ptr<Scope> scope) {
+Value MoreEq::Call(ValueSpan args) {
     if (args.size() < 2) {
-        return std::make_shared<Symbol>("#t");
+        return kTrueSymbol;
     }
 
-    EvalArgs(args, scope);
-    if (!args[0]->IsNumber()) {
+    if (!args[0].IsNumber()) {
         throw RuntimeError("Неверный аргумент у сравнения");
     }
     for (size_t i = 1; i < args.size(); ++i) {
-        if (!args[i]->IsNumber()) {
+        if (!args[i].IsNumber()) {
             throw RuntimeError("Неверный аргумент у сравнения");
         }
-        if (!(std::dynamic_pointer_cast<Number>(args[i - 1])->GetValue() >=
-              std::dynamic_pointer_cast<Number>(args[i])->GetValue())) {
-            return std::make_shared<Symbol>("#f");
+        if (!(AsNumber(args[i - 1]) >= AsNumber(args[i]))) {
+            return kFalseSymbol;
         }
     }
-    return std::make_shared<Symbol>("#t");
+    return kTrueSymbol;
 }
 
-std::shared_ptr<Object> Eq::Apply(std::vector<std::shared_ptr<Object>> &args,
-                                  std::shared_ptr<Scope> scope) {
+Value Eq::Call(ValueSpan args) {
     if (args.size() < 2) {
-        return std::make_shared<Symbol>("#t");
+        return kTrueSymbol;
     }
 
-    EvalArgs(args, scope);
-    if (!args[0]->IsNumber()) {
+    if (!args[0].IsNumber()) {
         throw RuntimeError("Неверный аргумент у сравнения");
     }
     for (size_t i = 1; i < args.size(); ++i) {
-        if (!args[i]->IsNumber()) {
+        if (!args[i].IsNumber()) {
             throw RuntimeError("Неверный аргумент у сравнения");
         }
-        if (!(std::dynamic_pointer_cast<Number>(args[i - 1])->GetValue() ==
-              std::dynamic_pointer_cast<Number>(args[i])->GetValue())) {
-            return std::make_shared<Symbol>("#f");
+        if (!(AsNumber(args[i - 1]) == AsNumber(args[i]))) {
+            return kFalseSymbol;
         }
     }
-    return std::make_shared<Symbol>("#t");
+    return kTrueSymbol;
 }
 
 /***********************************************************
  ***********************************************************
  ***********************************************************/
 
-std::shared_ptr<Object> And::Apply(std::vector<std::shared_ptr<Object>> &args,
-                                   std::shared_ptr<Scope> scope) {
+And::And() : Function(ObjectType::AND) {
+}
+
+Value And::Apply(ValueSpan args, const std::shared_ptr<Scope> &scope) {
+    Value result;
+    if (EvalPrefix(args, scope, &result)) {
+        return result;
+    }
+    return args.back().Eval(scope);
+}
+
+bool And::EvalPrefix(ValueSpan args, const std::shared_ptr<Scope> &scope, Value *result) {
+    if (args.empty()) {
+        *result = kTrueSymbol;
+        return true;
+    }
+    for (size_t i = 0; i + 1 < args.size(); ++i) {
+        auto value = args[i].Eval(scope);
+        if (value && value.IsFalse()) {
+            *result = value;
+            return true;
+        }
+    }
+    return false;
+}
+
+Value And::Call(ValueSpan args) {
     for (auto &arg : args) {
-        if (arg) {
-            arg = arg->Eval(scope);
-            if (arg && arg->IsFalse()) {
-                return arg;
-            }
+        if (arg && arg.IsFalse()) {
+            return arg;
         }
     }
     if (args.empty()) {
-        return std::make_shared<Symbol>("#t");
-    } else {
-        return args[args.size() - 1];
+        return kTrueSymbol;
     }
+    return args.back();
 }
 
-std::shared_ptr<Object> Or::Apply(std::vector<std::shared_ptr<Object>> &args,
-                                  std::shared_ptr<Scope> scope) {
+Or::Or() : Function(ObjectType::OR) {
+}
+
+Value Or::Apply(ValueSpan args, const std::shared_ptr<Scope> &scope) {
+    Value result;
+    if (EvalPrefix(args, scope, &result)) {
+        return result;
+    }
+    return args.back().Eval(scope);
+}
+
+bool Or::EvalPrefix(ValueSpan args, const std::shared_ptr<Scope> &scope, Value *result) {
+    if (args.empty()) {
+        *result = kFalseSymbol;
+        return true;
+    }
+    for (size_t i = 0; i + 1 < args.size(); ++i) {
+        auto value = args[i].Eval(scope);
+        if (!value || !value.IsFalse()) {
+            *result = value;
+            return true;
+        }
+    }
+    return false;
+}
+
+Value Or::Call(ValueSpan args) {
     for (auto &arg : args) {
-        if (arg) {
-            arg = arg->Eval(scope);
-            if (!arg || !arg->IsFalse()) {
-                return arg;
-            }
+        if (!arg || !arg.IsFalse()) {
+            return arg;
         }
     }
     if (args.empty()) {
-        return std::make_shared<Symbol>("#f");
-    } else {
-        return args[args.size() - 1];
+        return kFalseSymbol;
     }
+    return args.back();
 }
 
 
-bool Syntax::IsSyntax() {
-    return true;
+Syntax::Syntax(ObjectType type) : Object(type) {
 }
 
 /***********************************************************
  ***********************************************************
  ***********************************************************/
 
-bool IsNumber(const std::shared_ptr<Object> &obj) {
-    return obj->IsNumber();
+bool IsNumber(const Value &obj) {
+    return obj.IsNumber();
 }
 
-std::shared_ptr<Number> AsNumber(const std::shared_ptr<Object> &obj) {
-    return std::static_pointer_cast<Number>(obj);
+int64_t AsNumber(const Value &obj) {
+    if (obj.IsFixnum()) {
+        return obj.GetFixnum();
+    }
+    return obj.As<Number>()->GetValue();
 }
 
-bool IsCell(const std::shared_ptr<Object> &obj) {
-    return obj->IsCell();
+Value MakeNumber(int64_t value) {
+    if (Value::FitsFixnum(value)) {
+        return Value::Fixnum(value);
+    }
+    return Make<Number>(value);
 }
 
-std::shared_ptr<Cell> AsCell(const std::shared_ptr<Object> &obj) {
-    return std::static_pointer_cast<Cell>(obj);
+bool IsCell(const Value &obj) {
+    return obj.IsCell();
 }
 
-bool IsSymbol(const std::shared_ptr<Object> &obj) {
-    return obj->IsSymbol();
+Cell *AsCell(const Value &obj) {
+    return obj.As<Cell>();
 }
 
-std::shared_ptr<Symbol> AsSymbol(const std::shared_ptr<Object> &obj) {
-    return std::static_pointer_cast<Symbol>(obj);
+bool IsSymbol(const Value &obj) {
+    return obj.IsSymbol();
 }
 
-std::shared_ptr<Object> ReadList(Tokenizer *tokenizer);
+Symbol *AsSymbol(const Value &obj) {
+    return obj.As<Symbol>();
+}
 
-std::shared_ptr<Object> Read(Tokenizer *tokenizer) {
-    if (tokenizer->IsEnd()) {
-        return nullptr;
-    }
+// Список, который reader ещё не дочитал.
+struct PendingList {
+    Cell *head_ = nullptr;
+    Cell *last_ = nullptr;
+    // (quote x) из 'x: закрывается сразу после одного элемента
+    bool quote_ = false;
+    // 0 - точки не было, 1 - ждём хвост после точки, 2 - ждём ')'
+    int dot_state_ = 0;
+};
 
-    auto token = tokenizer->GetToken();
-    tokenizer->Next();
+template <class Tokens>
+Value ReadTokens(Tokens *tokenizer, size_t max_depth) {
+    std::vector<PendingList> pending;
+    while (true) {
+        if (tokenizer->IsEnd()) {
+            if (pending.empty()) {
+                return nullptr;
+            }
+            throw SyntaxError("Преждевременный конец!");
+        }
+        // копия: Next перезаписывает текущую лексему, а text_ по-прежнему
+        // смотрит в буфер
+        TokenView token = tokenizer->GetToken();
+        tokenizer->Next();
+
+        Value value;
+        if (token.kind_ == TokenKind::OPEN || token.kind_ == TokenKind::QUOTE) {
+            if (pending.size() >= max_depth) {
+                throw RuntimeError("Слишком глубокая вложенность списков");
+            }
+            pending.emplace_back();
+            pending.back().quote_ = token.kind_ == TokenKind::QUOTE;
+            continue;
+        } else if (token.kind_ == TokenKind::SYMBOL) {
+            value = Symbol::Intern(token.text_);
+        } else if (token.kind_ == TokenKind::CONSTANT) {
+            value = MakeNumber(token.value_);
+        } else if (token.kind_ == TokenKind::CLOSE) {
+            // вне списка скобку разбирает вызывающий
+            if (pending.empty()) {
+                return kCloseBracketSymbol;
+            }
+            auto &list = pending.back();
+            if (list.quote_ || list.dot_state_ == 1) {
+                throw SyntaxError("Преждевременная скобка");
+            }
+            value = list.head_;
+            pending.pop_back();
+        } else if (token.kind_ == TokenKind::DOT) {
+            if (pending.empty()) {
+                return kDotSymbol;
+            }
+            auto &list = pending.back();
+            if (list.quote_ || !list.head_) {
+                throw SyntaxError("Точка может идти только после другого элемента");
+            }
+            if (list.dot_state_ != 0) {
+                throw SyntaxError("Должна быть скобка");
+            }
+            list.dot_state_ = 1;
+            continue;
+        }
 
-    if (token == Token{BracketToken::OPEN}) {
-        return ReadList(tokenizer);
+        // готовое значение дописывается в незаконченный список
+        while (true) {
+            if (pending.empty()) {
+                return value;
+            }
+            auto &list = pending.back();
+            if (list.quote_) {
+                value = Make<Cell>(kQuoteSymbol, Make<Cell>(value));
+                pending.pop_back();
+                continue;
+            }
+            if (list.dot_state_ == 2) {
+                throw SyntaxError("Должна быть скобка");
+            }
+            if (list.dot_state_ == 1) {
+                list.last_->SetSecond(value);
+                list.dot_state_ = 2;
+                break;
+            }
+            auto cell = Make<Cell>(value);
+            if (list.last_) {
+                list.last_->SetSecond(cell);
+            } else {
+                list.head_ = cell;
+            }
+            list.last_ = cell;
+            break;
+        }
     }
+}
 
-    if (std::holds_alternative<SymbolToken>(token)) {
-        return std::make_shared<Symbol>(std::get<SymbolToken>(token).name_);
-    }
+StreamTokens::StreamTokens(Tokenizer *tokenizer, bool lazy)
+        : tokenizer_(tokenizer), lazy_(lazy) {
+}
 
-    if (std::holds_alternative<ConstantToken>(token)) {
-        return std::make_shared<Number>(std::get<ConstantToken>(token).value_);
-    }
+bool StreamTokens::IsEnd() {
+    Advance();
+    return tokenizer_->IsEnd();
+}
 
-    // иначе не разобрать с концом
-    if (token == Token{BracketToken::CLOSE}) {
-        return std::make_shared<Symbol>(")");
+void StreamTokens::Next() {
+    if (lazy_) {
+        pending_next_ = true;
+    } else {
+        tokenizer_->Next();
     }
+}
 
-    if (std::holds_alternative<QuoteToken>(token)) {
-        if (tokenizer->IsEnd()) {
-            throw SyntaxError{"Преждевременный конец!"};
-        }
-        auto head = std::make_shared<Cell>(std::make_shared<Symbol>("quote"),
-                std::make_shared<Cell>(Read(tokenizer)));
-        return head;
+void StreamTokens::Advance() {
+    if (pending_next_) {
+        pending_next_ = false;
+        tokenizer_->Next();
     }
+}
 
-    // иначе как в листе понять где было точка?
-    if (std::holds_alternative<DotToken>(token)) {
-        return std::make_shared<Symbol>(".");
+TokenView StreamTokens::GetToken() {
+    Advance();
+    auto token = tokenizer_->GetToken();
+    TokenView view;
+    if (std::holds_alternative<SymbolToken>(token)) {
+        name_ = std::get<SymbolToken>(token).name_;
+        view.kind_ = TokenKind::SYMBOL;
+        view.text_ = name_;
+    } else if (std::holds_alternative<ConstantToken>(token)) {
+        view.kind_ = TokenKind::CONSTANT;
+        view.value_ = std::get<ConstantToken>(token).value_;
+    } else if (std::holds_alternative<QuoteToken>(token)) {
+        view.kind_ = TokenKind::QUOTE;
+    } else if (std::holds_alternative<DotToken>(token)) {
+        view.kind_ = TokenKind::DOT;
+    } else if (token == Token{BracketToken::OPEN}) {
+        view.kind_ = TokenKind::OPEN;
+    } else {
+        view.kind_ = TokenKind::CLOSE;
     }
+    return view;
+}
 
-    return nullptr;
+Value Read(Tokenizer *tokenizer, size_t max_depth) {
+    StreamTokens tokens(tokenizer);
+    return ReadTokens(&tokens, max_depth);
 }
 
-std::shared_ptr<Object> ReadList(Tokenizer *tokenizer) {
-    if (tokenizer->IsEnd()) {
-        throw SyntaxError{"Преждевременный конец списка! Не получена \')\' "};
-    }
+Value Read(BufferTokenizer *tokenizer, size_t max_depth) {
+    return ReadTokens(tokenizer, max_depth);
+}
 
-    auto token = Read(tokenizer);
+FormReader::FormReader(std::istream *in) : tokenizer_(in), tokens_(&tokenizer_, true) {
+}
 
-    // пустой список
-    if (token != nullptr && token->IsSymbol() && AsSymbol(token)->GetName() == ")") {
-        return nullptr;
+bool FormReader::IsEnd() {
+    return tokens_.IsEnd();
+}
+
+Value FormReader::Read(size_t max_depth) {
+    return ReadTokens(&tokens_, max_depth);
+}
+
+// Встроенные функции и синтаксис, общие для всех интерпретаторов процесса.
+// Объекты постоянные, без состояния, и таблица после построения только
+// читается, так что её можно делить между потоками. Хеш подбирается
+// при построении так, чтобы у всех имён были разные ячейки.
+class BuiltinTable {
+public:
+    static const BuiltinTable &Get() {
+        static const BuiltinTable table;
+        return table;
     }
-    std::shared_ptr<Cell> head = std::make_shared<Cell>();
 
-    if (token != nullptr && token->IsSymbol() && AsSymbol(token)->GetName() == ".") {
-        throw SyntaxError{"Точка может идти только после другого элемента"};
+    // Пустое значение, если такой встроенной функции нет.
+    Value Find(std::string_view name) const {
+        auto &entry = entries_[Hash(name, seed_) & mask_];
+        return entry.first == name ? entry.second : nullptr;
     }
 
-    head->SetFirst(token);
-    auto current = head;
+    // Имя встроенной функции; пустое, если object не из таблицы.
+    std::string_view NameOf(const Object *object) const {
+        for (auto &entry : entries_) {
+            if (entry.second && entry.second.GetObject() == object) {
+                return entry.first;
+            }
+        }
+        return {};
+    }
+
+private:
+    BuiltinTable() {
+        std::vector<std::pair<std::string_view, Value>> builtins = {
+            {"+", Make<Add>()},
+            {"-", Make<Subtract>()},
+            {"/", Make<Divide>()},
+            {"*", Make<Multiply>()},
+
+            {"and", Make<And>()},
+            {"or", Make<Or>()},
+            {"if", Make<If>()},
+            {"define", Make<Define>()},
+
+            {"list-tail", Make<ListTail>()},
+            {"list-ref", Make<ListRef>()},
+            {"list", Make<NewList>()},
+            {"cons", Make<Cons>()},
+
+            {"cdr", Make<Cdr>()},
+            {"car", Make<Car>()},
+            {"set-cdr!", Make<SetCdr>()},
+            {"set-car!", Make<SetCar>()},
+
+            {"lambda", Make<CreateLambda>()},
+            {"set!", Make<Set>()},
+            {"not", Make<Not>()},
+            {"max", Make<Max>()},
+            {"min", Make<Min>()},
+            {"abs", Make<Abs>()},
+
+            {"<", Make<Less>()},
+            {"<=", Make<LessEq>()},
+            {">=", Make<MoreEq>()},
+            {">", Make<More>()},
+            {"=", Make<Eq>()},
+
+            {"null?", Make<QNull>()},
+            {"pair?", Make<QPair>()},
+            {"list?", Make<QList>()},
+            {"boolean?", Make<QBoolean>()},
+            {"symbol?", Make<QSymbol>()},
+            {"number?", Make<QNumber>()},
+            {"quote", Make<Quote>()},
+        };
+        size_t size = 1;
+        while (size < builtins.size() * 2) {
+            size *= 2;
+        }
+        while (!Place(builtins, size)) {
+            size *= 2;
+        }
+    }
 
-    while (!tokenizer->IsEnd()) {
-        token = Read(tokenizer);
-        if (token && token->IsSymbol() && AsSymbol(token)->GetName() == ".") {
-            if (tokenizer->IsEnd()) {
-                throw SyntaxError("Преждевременный конец!");
+    template <class T>
+    T *Make() {
+        objects_.push_back(std::make_unique<T>());
+        return Heap::MakePermanent(static_cast<T *>(objects_.back().get()));
+    }
+
+    static uint64_t Hash(std::string_view name, uint64_t seed) {
+        // FNV-1a
+        uint64_t hash = 14695981039346656037ull ^ seed;
+        for (char c : name) {
+            hash = (hash ^ static_cast<unsigned char>(c)) * 1099511628211ull;
+        }
+        return hash ^ (hash >> 29);
+    }
+
+    // Ищет seed_ без совпадений ячеек среди size ячеек.
+    bool Place(const std::vector<std::pair<std::string_view, Value>> &builtins, size_t size) {
+        for (uint64_t seed = 0; seed < 1000; ++seed) {
+            entries_.assign(size, {});
+            bool collision = false;
+            for (auto &builtin : builtins) {
+                auto &entry = entries_[Hash(builtin.first, seed) & (size - 1)];
+                if (entry.second) {
+                    collision = true;
+                    break;
+                }
+                entry = builtin;
             }
-            token = Read(tokenizer);
-            AsCell(current)->SetSecond(token);
-            if (tokenizer->IsEnd()) {
-                throw SyntaxError("Преждевременный конец!");
+            if (!collision) {
+                seed_ = seed;
+                mask_ = size - 1;
+                return true;
             }
-            token = Read(tokenizer);
-            if (token == nullptr || !token->IsSymbol() || AsSymbol(token)->GetName() != ")") {
-                throw SyntaxError("Должна быть скобка");
+        }
+        return false;
+    }
+
+    std::vector<std::unique_ptr<Object>> objects_;
+    std::vector<std::pair<std::string_view, Value>> entries_;
+    uint64_t seed_ = 0;
+    size_t mask_ = 0;
+};
+
+Value *Scope::FindVariable(const std::string &var, ValueHolder **holder, Binding **binding,
+                           Scope **owner) {
+    for (auto scope = this; scope; scope = scope->parent_.get()) {
+        if (scope->names_) {
+            auto &names = *scope->names_;
+            for (size_t i = 0; i < names.size(); ++i) {
+                if (names[i] == var) {
+                    if (holder) {
+                        *holder = scope;
+                    }
+                    if (owner) {
+                        *owner = scope;
+                    }
+                    return scope->slots_[i] == Unbound() ? nullptr : &scope->slots_[i];
+                }
             }
-            return head;
         }
-        if (token != nullptr && token->IsSymbol() && AsSymbol(token)->GetName() == ")") {
-            return head;
+        if (!scope->variables_.empty() || scope->builtins_) {
+            auto v_iter = scope->variables_.find(var);
+            if (v_iter == scope->variables_.end() && scope->builtins_ &&
+                BuiltinTable::Get().Find(var)) {
+                // встроенная функция получает свою ячейку при первом обращении
+                scope->GetBinding(var);
+                v_iter = scope->variables_.find(var);
+            }
+            if (v_iter != scope->variables_.end() && v_iter->second->defined_) {
+                if (holder) {
+                    *holder = v_iter->second.get();
+                }
+                if (binding) {
+                    *binding = v_iter->second.get();
+                }
+                if (owner) {
+                    *owner = scope;
+                }
+                return &v_iter->second->value_;
+            }
         }
-        auto next = std::make_shared<Cell>(token);
-        AsCell(current)->SetSecond(next);
-        current = next;
     }
-    if (tokenizer->IsEnd()) {
-        throw SyntaxError("Преждевременный конец!");
-    }
-    return head;
+    return nullptr;
 }
 
-void Scope::ChangeVariable(const std::string &x, std::shared_ptr<Object> &val) {
-    if (variables_.find(x) == variables_.end()) {
+void Scope::ChangeVariable(const std::string &x, Value &val) {
+    ValueHolder *holder;
+    Binding *binding = nullptr;
+    Scope *owner;
+    auto variable = FindVariable(x, &holder, &binding, &owner);
+    if (!variable) {
         throw NameError("Использование необъявленной переменной");
     }
-    variables_[x] = val;
+    owner->RecordFrame();
+    if (binding) {
+        binding->Assign(val);
+        return;
+    }
+    Heap::Current()->WriteBarrier(holder, val.GetObject());
+    *variable = val;
 }
 
-void Scope::OverrideVariable(const std::string &x, const std::shared_ptr<Object> &val) {
-    variables_[x] = val;
+void Scope::OverrideVariable(const std::string &x, const Value &val) {
+    RecordFrame();
+    if (names_) {
+        for (size_t i = 0; i < names_->size(); ++i) {
+            if ((*names_)[i] == x) {
+                Heap::Current()->WriteBarrier(this, val.GetObject());
+                slots_[i] = val;
+                return;
+            }
+        }
+    }
+    GetBinding(x)->Assign(val);
+}
+
+std::shared_ptr<Binding> Scope::GetBinding(const std::string &var) {
+    auto &binding = variables_[var];
+    if (!binding) {
+        binding = std::make_shared<Binding>();
+        // ячейки кадра журнал сохраняет вместе с кадром
+        binding->journal_ = parent_ ? nullptr : journal_;
+        binding->global_ = global_;
+        if (builtins_) {
+            if (auto builtin = BuiltinTable::Get().Find(var)) {
+                binding->value_ = builtin;
+                binding->builtin_ = builtin;
+                binding->defined_ = true;
+            }
+        }
+        InvalidateCallSites();
+    }
+    return binding;
 }
 
-std::shared_ptr<Object> Scope::LookUp(const std::string &var) {
+std::shared_ptr<Binding> Scope::FindBinding(const std::string &var) {
     auto v_iter = variables_.find(var);
     if (v_iter != variables_.end()) {
         return v_iter->second;
     }
+    if (builtins_ && BuiltinTable::Get().Find(var)) {
+        return GetBinding(var);
+    }
+    return nullptr;
+}
+
+Scope *Scope::GetParent() const {
+    return parent_.get();
+}
+
+const std::shared_ptr<const std::vector<std::string>> &Scope::GetNames() const {
+    return names_;
+}
+
+bool Scope::HasFixedNames() const {
+    return fixed_names_;
+}
+
+Value &Scope::GetSlot(size_t depth, size_t index) {
+    auto scope = this;
+    for (size_t i = 0; i < depth; ++i) {
+        scope = scope->parent_.get();
+    }
+    return scope->slots_[index];
+}
+
+void Scope::SetSlot(size_t depth, size_t index, const Value &value) {
+    auto scope = this;
+    for (size_t i = 0; i < depth; ++i) {
+        scope = scope->parent_.get();
+    }
+    scope->RecordFrame();
+    Heap::Current()->WriteBarrier(scope, value.GetObject());
+    scope->slots_[index] = value;
+}
+
+void Scope::RecordFrame() {
+    if (journal_ && parent_) {
+        journal_->Record(this);
+    }
+}
+
+const Value &Scope::Unbound() {
+    // не интернируется, чтобы не совпасть ни с одним символом программы
+    static const Value unbound = Heap::MakePermanent(new Symbol("#<unbound>"));
+    return unbound;
+}
+
+Value Scope::LookUp(const std::string &var) {
+    auto variable = FindVariable(var);
+    if (variable) {
+        return *variable;
+    }
     throw NameError("Использование необъявленной переменной");
 }
 
+thread_local CallSiteStats call_site_stats;
+
+CallSiteStats &GetCallSiteStats() {
+    return call_site_stats;
+}
+
+void CallSiteCache::Trace(Heap *heap) {
+    heap->Mark(callee_);
+}
+
+// Версия меняется, когда в области появляется или определяется ячейка:
+// тогда поиск по имени мог бы найти уже не то, что запомнил кэш вызова.
+void Scope::InvalidateCallSites() {
+    ++global_->bindings_version_;
+}
+
+Value Scope::LookUpCallee(const std::string &var, CallSiteCache *cache) {
+    // кадр lambda без своих define: поиск после его параметров идёт так же,
+    // как из родителя, поэтому ключ - родитель и список параметров
+    auto anchor = this;
+    const std::shared_ptr<const std::vector<std::string>> *frame_names = nullptr;
+    if (names_ && variables_.empty() && parent_) {
+        anchor = parent_.get();
+        frame_names = &names_;
+    }
+    auto version = global_->bindings_version_;
+    if (cache && cache->version_ == version && cache->scope_id_ == anchor->id_ &&
+        cache->frame_names_.get() == (frame_names ? frame_names->get() : nullptr) &&
+        cache->binding_->value_ == cache->callee_) {
+        ++call_site_stats.hits_;
+        return cache->callee_;
+    }
+    ++call_site_stats.misses_;
+
+    Binding *binding = nullptr;
+    auto variable = FindVariable(var, nullptr, &binding);
+    if (!variable) {
+        throw NameError("Использование необъявленной переменной");
+    }
+    auto callee = *variable;
+    if (!callee || !(callee.IsFunction() || callee.IsSyntax())) {
+        throw RuntimeError("Первый элемент должен быть функцией или синтаксисом");
+    }
+    if (cache && binding) {
+        cache->version_ = version;
+        cache->scope_id_ = anchor->id_;
+        cache->frame_names_ = frame_names ? *frame_names : nullptr;
+        cache->binding_ = binding;
+        Heap::Current()->WriteBarrier(cache, callee.GetObject());
+        cache->callee_ = callee;
+    }
+    return callee;
+}
+
+// Номера областей раздаются потокам блоками, чтобы не делить один счётчик
+// на каждом вызове lambda.
+const uint64_t kScopeIdBlock = 1024;
+
+std::atomic<uint64_t> next_scope_id_block{1};
+
+uint64_t NextScopeId() {
+    thread_local uint64_t next = 0;
+    thread_local uint64_t end = 0;
+    if (next == end) {
+        next = next_scope_id_block.fetch_add(kScopeIdBlock, std::memory_order_relaxed);
+        end = next + kScopeIdBlock;
+    }
+    return next++;
+}
+
+void Scope::Trace(Heap *heap) {
+    // кадры в куче часто делят одного родителя: каждый обходится один раз
+    for (auto scope = this; scope && heap->Visit(&scope->gc_epoch_);
+         scope = scope->parent_.get()) {
+        for (auto &variable : scope->variables_) {
+            variable.second->TraceValues(heap);
+        }
+        scope->TraceValues(heap);
+    }
+}
+
+void Scope::TraceValues(Heap *heap) {
+    for (auto &slot : slots_) {
+        heap->Mark(slot);
+    }
+}
+
+void Binding::TraceValues(Heap *heap) {
+    heap->Mark(value_);
+    // удерживается, чтобы на её адресе не оказался другой объект
+    heap->Mark(builtin_);
+}
+
+void Binding::Assign(const Value &value) {
+    if (journal_) {
+        journal_->Record(this);
+    }
+    Heap::Current()->WriteBarrier(this, value.GetObject());
+    value_ = value;
+    if (!defined_) {
+        defined_ = true;
+        if (global_) {
+            global_->InvalidateCallSites();
+        }
+    }
+}
+
+size_t BindingJournal::TakeSnapshot() {
+    snapshots_.emplace_back(++snapshot_counter_, entries_.size());
+    epoch_ = ++epoch_counter_;
+    return snapshot_counter_;
+}
+
+bool BindingJournal::RollBack(size_t snapshot) {
+    auto it = std::find_if(snapshots_.begin(), snapshots_.end(),
+                           [snapshot](const auto &entry) { return entry.first == snapshot; });
+    if (it == snapshots_.end()) {
+        return false;
+    }
+    auto position = it->second;
+    snapshots_.erase(it + 1, snapshots_.end());
+    while (entries_.size() > position) {
+        auto &entry = entries_.back();
+        if (auto frame = entry.frame_.get()) {
+            for (auto &slot : entry.slots_) {
+                Heap::Current()->WriteBarrier(frame, slot.GetObject());
+            }
+            frame->slots_ = std::move(entry.slots_);
+        } else {
+            auto binding = entry.binding_;
+            Heap::Current()->WriteBarrier(binding, entry.value_.GetObject());
+            binding->value_ = entry.value_;
+            binding->defined_ = entry.defined_;
+        }
+        entries_.pop_back();
+    }
+    // ячейки снова пишутся в журнал при первом изменении
+    epoch_ = ++epoch_counter_;
+    return true;
+}
+
+void BindingJournal::Record(Binding *binding) {
+    if (!epoch_ || binding->journal_epoch_ == epoch_) {
+        return;
+    }
+    binding->journal_epoch_ = epoch_;
+    entries_.push_back({binding, binding->value_, binding->defined_, nullptr, {}});
+}
+
+void BindingJournal::Record(Scope *frame) {
+    if (!epoch_ || frame->journal_epoch_ == epoch_) {
+        return;
+    }
+    frame->journal_epoch_ = epoch_;
+    // ячейки кадра из variables_ идут в журнале за ним: пока их
+    // откатывают, кадр ещё удерживает запись о нём
+    entries_.push_back({nullptr, nullptr, false, frame->shared_from_this(), frame->slots_});
+    for (auto &variable : frame->variables_) {
+        auto binding = variable.second.get();
+        entries_.push_back({binding, binding->value_, binding->defined_, nullptr, {}});
+    }
+}
+
+void BindingJournal::Trace(Heap *heap) {
+    for (auto &entry : entries_) {
+        heap->Mark(entry.value_);
+        for (auto &slot : entry.slots_) {
+            heap->Mark(slot);
+        }
+    }
+}
+
+void BindingJournal::Clear() {
+    entries_.clear();
+    snapshots_.clear();
+    epoch_ = 0;
+}
+
 Scope::~Scope() {
     variables_.clear();
 }
 
 void Scope::Clear() {
-    for (auto &func : variables_) {
-        if (func.second->IsLambda()) {
-            std::shared_ptr<Lambda> lambda = std::dynamic_pointer_cast<Lambda>(func.second);
-            lambda->
-        }
+    // скомпилированный код может пережить область вместе с ячейками
+    for (auto &variable : variables_) {
+        variable.second->journal_ = nullptr;
+        variable.second->global_ = nullptr;
     }
     variables_.clear();
+    slots_.clear();
+    names_ = nullptr;
+    parent_ = nullptr;
+    builtins_ = false;
+    if (journal_) {
+        journal_->Clear();
+    }
+    InvalidateCallSites();
+}
+
+
+thread_local size_t EvalDepthGuard::depth_ = 0;
+thread_local size_t EvalDepthGuard::limit_ = kDefaultMaxDepth;
+
+// Нижняя граница стека потока плюс запас; 0, если границу узнать не удалось.
+uintptr_t NativeStackLimit() {
+    uintptr_t limit = 0;
+    pthread_attr_t attr;
+    if (pthread_getattr_np(pthread_self(), &attr) == 0) {
+        void *stack;
+        size_t size;
+        if (pthread_attr_getstack(&attr, &stack, &size) == 0 && size > 2 * kNativeStackReserve) {
+            limit = reinterpret_cast<uintptr_t>(stack) + kNativeStackReserve;
+        }
+        pthread_attr_destroy(&attr);
+    }
+    return limit;
+}
+
+void CheckNativeStack() {
+    thread_local const uintptr_t limit = NativeStackLimit();
+    // адрес кадра, а не локальной переменной: её ASan может держать не на стеке
+    if (reinterpret_cast<uintptr_t>(__builtin_frame_address(0)) < limit) {
+        throw RuntimeError("Превышена глубина рекурсии");
+    }
+}
+
+EvalDepthGuard::EvalDepthGuard() {
+    if (depth_ >= limit_) {
+        throw RuntimeError("Превышена глубина рекурсии");
+    }
+    CheckNativeStack();
+    ++depth_;
 }
 
+EvalDepthGuard::~EvalDepthGuard() {
+    --depth_;
+}
+
+void EvalDepthGuard::SetLimit(size_t limit) {
+    limit_ = limit;
+}
 
-std::shared_ptr<Object> Cell::Eval(std::shared_ptr<Scope> scope) {
-    auto p = first_ptr_->Eval(scope);
+Value Cell::EvalCallee(const std::shared_ptr<Scope> &scope) {
+    auto symbol = DynamicCast<Symbol>(first_ptr_);
+    if (symbol && symbol != kTrueSymbol && symbol != kFalseSymbol &&
+        (symbol->GetName().empty() || symbol->GetName()[0] != '\'')) {
+        CallSiteCache *cache = nullptr;
+        if (!call_cache_) {
+            call_cache_ = Value::Fixnum(0);
+        } else {
+            if (call_cache_.IsFixnum()) {
+                auto new_cache = Make<CallSiteCache>();
+                Heap::Current()->WriteBarrier(this, new_cache);
+                call_cache_ = new_cache;
+            }
+            cache = call_cache_.As<CallSiteCache>();
+        }
+        return scope->LookUpCallee(symbol->GetName(), cache);
+    }
 
-    if (!p || !(p->IsFunction() || p->IsSyntax())) {
+    auto callee = first_ptr_.Eval(scope);
+    if (!callee || !(callee.IsFunction() || callee.IsSyntax())) {
         throw RuntimeError("Первый элемент должен быть функцией или синтаксисом");
     }
+    return callee;
+}
+
+Value Cell::Eval(const std::shared_ptr<Scope> &scope) {
+    EvalDepthGuard guard;
+    auto p = EvalCallee(scope);
 
-    auto args = ToVector(second_ptr_);
+    ArgumentFrame args(second_ptr_);
     // не вычисляем аргументы так как не от всех функций надо вычислять аргументы,
     // они там сами разберутся
-    return p->Apply(args, scope);
+    return p->Apply(args.Get(), scope);
 }
 
-std::vector<std::shared_ptr<Object>> ToVector(std::shared_ptr<Object> head) {
-    std::vector<std::shared_ptr<Object>> vect;
+thread_local EvalStack *EvalStack::current_ = nullptr;
+
+// Блоки меньше этого не выделяются: обычно весь стек помещается в один.
+const size_t kEvalStackBlock = 4096;
+
+EvalStack::Block EvalStack::MakeBlock(size_t capacity) {
+    return Block{std::make_unique<Value[]>(capacity), capacity, 0};
+}
+
+ValueSpan EvalStack::Push(size_t count) {
+    if (!count) {
+        return ValueSpan();
+    }
+    if (blocks_.empty()) {
+        blocks_.push_back(MakeBlock(std::max(kEvalStackBlock, count)));
+    }
+    auto block = &blocks_[current_block_];
+    if (block->top_ + count > block->capacity_) {
+        // в текущий блок не влезает: аргументы одного вызова не разрываются
+        ++current_block_;
+        if (current_block_ == blocks_.size()) {
+            blocks_.push_back(MakeBlock(std::max(kEvalStackBlock, count)));
+        } else if (blocks_[current_block_].capacity_ < count) {
+            blocks_[current_block_] = MakeBlock(count);
+        }
+        block = &blocks_[current_block_];
+    }
+    auto values = block->values_.get() + block->top_;
+    std::fill(values, values + count, Value());
+    block->top_ += count;
+    return ValueSpan(values, count);
+}
+
+void EvalStack::Pop(size_t count) {
+    if (!count) {
+        return;
+    }
+    // блоки, которые пропустил Push, пусты
+    while (!blocks_[current_block_].top_) {
+        --current_block_;
+    }
+    blocks_[current_block_].top_ -= count;
+}
+
+size_t EvalStack::GetSize() const {
+    size_t size = 0;
+    for (auto &block : blocks_) {
+        size += block.top_;
+    }
+    return size;
+}
+
+void EvalStack::Trace(Heap *heap) {
+    for (auto &block : blocks_) {
+        for (size_t i = 0; i < block.top_; ++i) {
+            heap->Mark(block.values_[i]);
+        }
+    }
+}
+
+EvalStackContext::EvalStackContext(EvalStack *stack) : previous_(EvalStack::current_) {
+    EvalStack::current_ = stack;
+}
+
+EvalStackContext::~EvalStackContext() {
+    EvalStack::current_ = previous_;
+}
+
+// Число аргументов формы вызова: quote с последующим значением - один.
+size_t CountArguments(Value head) {
+    size_t count = 0;
     while (head) {
-        if (std::dynamic_pointer_cast<Cell>(head)->GetFirst() &&
-            std::dynamic_pointer_cast<Cell>(head)->GetFirst()->IsSymbol() &&
-            std::dynamic_pointer_cast<Symbol>(std::dynamic_pointer_cast<Cell>(head)->GetFirst())
-                    ->GetName() == "quote") {
-            head = std::dynamic_pointer_cast<Cell>(head)->GetSecond();
-            if (!head) {
+        auto cell = AsCell(head);
+        if (cell->GetFirst() == kQuoteSymbol && cell->GetSecond()) {
+            cell = AsCell(cell->GetSecond());
+        }
+        head = cell->GetSecond();
+        ++count;
+    }
+    return count;
+}
+
+void ReadArguments(Value head, ValueSpan args) {
+    for (auto &arg : args) {
+        auto cell = AsCell(head);
+        if (cell->GetFirst() == kQuoteSymbol) {
+            if (!cell->GetSecond()) {
                 throw SyntaxError("Ничего после quote");
             }
-            if (std::dynamic_pointer_cast<Cell>(head)->GetFirst() &&
-                std::dynamic_pointer_cast<Cell>(head)->GetFirst()->IsSymbol()) {
-                vect.push_back(std::make_shared<Symbol>("\'" + std::dynamic_pointer_cast<Symbol>
-                        (std::dynamic_pointer_cast<Cell>(head)->GetFirst())->GetName()));
-            } else if (!std::dynamic_pointer_cast<Cell>(head)->GetFirst() ||
-                       std::dynamic_pointer_cast<Cell>(head)->GetFirst()->IsCell()) {
-                vect.push_back(std::make_shared<List>(std::dynamic_pointer_cast<Cell>(head)
-                                                              ->GetFirst()));
+            cell = AsCell(cell->GetSecond());
+            auto quoted = cell->GetFirst();
+            if (quoted.IsSymbol()) {
+                arg = Symbol::Intern("\'" + AsSymbol(quoted)->GetName());
+            } else if (!quoted || quoted.IsCell()) {
+                arg = Make<List>(quoted);
             } else {
                 throw SyntaxError("Что-то не то после quote");
             }
-            head = std::dynamic_pointer_cast<Cell>(head)->GetSecond();
         } else {
-            vect.push_back(std::dynamic_pointer_cast<Cell>(head)->GetFirst());
-            head = std::dynamic_pointer_cast<Cell>(head)->GetSecond();
+            arg = cell->GetFirst();
         }
+        head = cell->GetSecond();
     }
-    return vect;
+}
+
+ArgumentFrame::ArgumentFrame(Value head)
+        : args_(EvalStack::Current()->Push(CountArguments(head))) {
+    try {
+        ReadArguments(head, args_);
+    } catch (...) {
+        EvalStack::Current()->Pop(args_.size());
+        throw;
+    }
+}
+
+ArgumentFrame::~ArgumentFrame() {
+    EvalStack::Current()->Pop(args_.size());
 }
 
 /***********************************************************
  ***********************************************************
  ***********************************************************/
 
-std::shared_ptr<Object> SetCar::Apply(std::vector<std::shared_ptr<Object>> &args,
-                                      std::shared_ptr<Scope> scope) {
-    if (args.size() != 2 || !args[0] || !args[0]->IsSymbol() || !args[1]) {
+// Первая ячейка аргумента car, cdr, set-car! и set-cdr!, который должен быть
+// собственным списком или парой, как у List::IsList и List::IsPair.
+// nullptr - пустой список из quote.
+Cell *ListArgument(const Value &arg, const char *error) {
+    Cell *head;
+    if (auto list = DynamicCast<List>(arg)) {
+        head = list->Head();
+    } else if (!(head = DynamicCast<Cell>(arg))) {
+        throw RuntimeError(error);
+    }
+    if (head && !IsProperList(head) && head->GetSecond().IsCell()) {
+        throw RuntimeError(error);
+    }
+    return head;
+}
+
+Value SetCar::Call(ValueSpan args) {
+    if (args.size() != 2) {
         throw SyntaxError("Аргументы  set-car некорректны");
     }
 
-    EvalArgs(args, scope);
     if (!args[0] ) {
         throw RuntimeError("Первый аргумент set-car пуст");
     }
 
-    if (args[0]->IsCell()) {
-        args[0] = std::make_shared<List>(args[0]);
-    }
-    if (!args[0]->IsList() && !args[0]->IsPair()) {
-        throw RuntimeError("Аргумент set-car не list/pair");
+    auto head = ListArgument(args[0], "Аргумент set-car не list/pair");
+    if (!head) {
+        throw SyntaxError("Редактируемый список пусть");
     }
-
-    std::dynamic_pointer_cast<List>(args[0])->SetCar(args[1]);
+    head->SetFirst(args[1]);
     return nullptr;
 }
 
 
-std::shared_ptr<Object> SetCdr::Apply(std::vector<std::shared_ptr<Object>> &args,
-                                      std::shared_ptr<Scope> scope) {
-    if (args.size() != 2 || !args[0] || !args[0]->IsSymbol() || !args[1]) {
+Value SetCdr::Call(ValueSpan args) {
+    if (args.size() != 2) {
         throw SyntaxError("Аргументы  set-car некорректны");
     }
 
-    EvalArgs(args, scope);
     if (!args[0] ) {
         throw RuntimeError("Первый аргумент set-car пуст");
     }
 
-    if (args[0]->IsCell()) {
-        args[0] = std::make_shared<List>(args[0]);
-    }
-    if (!args[0]->IsList() && !args[0]->IsPair()) {
-        throw RuntimeError("Аргумент set-car не list/pair");
+    auto head = ListArgument(args[0], "Аргумент set-car не list/pair");
+    if (!head) {
+        throw SyntaxError("Редактируемый список пусть");
     }
-
-    std::dynamic_pointer_cast<List>(args[0])->SetCdr(args[1]);
+    head->SetSecond(args[1]);
     return nullptr;
 }
 
-std::shared_ptr<Object> Car::Apply(std::vector<std::shared_ptr<Object>> &args,
-                                   std::shared_ptr<Scope> scope) {
-    if (args.size() != 1 || !args[0]) {
+Value Car::Call(ValueSpan args) {
+    if (args.size() != 1) {
         throw SyntaxError("Аргумент car некорректен");
     }
-    EvalArgs(args, scope);
     if (!args[0]) {
         throw RuntimeError("Аргумент car пуст");
     }
-    if (args[0]->IsCell()) {
-        args[0] = std::make_shared<List>(args[0]);
-    }
-    if (!args[0]->IsList() && !args[0]->IsPair()) {
-        throw RuntimeError("Аргумент car не list/pair");
+    auto head = ListArgument(args[0], "Аргумент car не list/pair");
+    if (!head) {
+        throw SyntaxError("Список пусть");
     }
-    return std::dynamic_pointer_cast<List>(args[0])->Car();
+    return head->GetFirst();
 }
 
-std::shared_ptr<Object> Cdr::Apply(std::vector<std::shared_ptr<Object>> &args,
-                                   std::shared_ptr<Scope> scope) {
-    if (args.size() != 1 || !args[0]) {
+Value Cdr::Call(ValueSpan args) {
+    if (args.size() != 1) {
         throw SyntaxError("Аргумент car некорректен");
     }
-    EvalArgs(args, scope);
     if (!args[0]) {
         throw RuntimeError("Аргумент cdr пуст");
     }
-    if (args[0]->IsCell()) {
-        args[0] = std::make_shared<List>(args[0]);
-    }
-    if (!args[0]->IsList() && !args[0]->IsPair()) {
-        throw RuntimeError("Аргумент cdr не list/pair");
+    auto head = ListArgument(args[0], "Аргумент cdr не list/pair");
+    if (!head) {
+        throw SyntaxError("Список пусть");
     }
-    return std::dynamic_pointer_cast<List>(args[0])->Cdr();
+    return head->GetSecond();
 }
 
-std::shared_ptr<Object> Cons::Apply(std::vector<std::shared_ptr<Object>> &args,
-                                    std::shared_ptr<Scope> scope) {
+Value Cons::Call(ValueSpan args) {
     if (args.size() != 2) {
         throw SyntaxError("");
     }
-    EvalArgs(args, scope);
-    auto cell = std::make_shared<Cell>(args[0], args[1]);
+    auto cell = Make<Cell>(args[0], args[1]);
     return cell;
 }
 
-std::shared_ptr<Object> NewList::Apply(std::vector<std::shared_ptr<Object>> &args,
-                                       std::shared_ptr<Scope> scope) {
+Value NewList::Call(ValueSpan args) {
     if (args.empty()) {
         return nullptr;
     }
-    EvalArgs(args, scope);
-    std::shared_ptr<Cell> head = std::make_shared<Cell>();
-    std::shared_ptr<Cell> current = head;
+    auto head = Make<Cell>();
+    auto current = head;
 
     for (size_t i = 0; i < args.size(); ++i) {
         current->SetFirst(args[i]);
         if (i + 1 != args.size()) {
-            current->SetSecond(std::make_shared<Cell>());
-            current = std::dynamic_pointer_cast<Cell>(current->GetSecond());
+            current->SetSecond(Make<Cell>());
+            current = DynamicCast<Cell>(current->GetSecond());
         }
     }
 
     return head;
 }
 
-std::shared_ptr<Object> ListTail::Apply(std::vector<std::shared_ptr<Object>> &args,
-                                        std::shared_ptr<Scope> scope) {
+Value ListTail::Call(ValueSpan args) {
     if (args.size() != 2) {
         throw RuntimeError("Неверное число аргументов list-tail");
     }
-    EvalArgs(args, scope);
 
-    if (!std::dynamic_pointer_cast<Number>(args[1])) {
+    if (!args[1].IsNumber()) {
         throw RuntimeError("Второй аргумент у list-ref должен быть индексом");
     }
-    auto number = std::dynamic_pointer_cast<Number>(args[1])->GetValue();
+    auto number = AsNumber(args[1]);
 
-    if (!args[0]->IsCell() && !args[0]->IsList() && !args[0]->IsPair()) {
-        throw RuntimeError("Неверные аргументы у list-tail");
-    }
-    std::shared_ptr<Cell> cur;
-    if (args[0]->IsList() || args[0]->IsPair()) {
-        cur = std::dynamic_pointer_cast<List>(args[0])->Head();
-    } else {
-        cur = std::dynamic_pointer_cast<Cell>(args[0]);
+    Cell *cur = DynamicCast<Cell>(args[0]);
+    if (!cur) {
+        auto list = DynamicCast<List>(args[0]);
+        if (!list || (!list->IsList() && !list->IsPair())) {
+            throw RuntimeError("Неверные аргументы у list-tail");
+        }
+        cur = list->Head();
     }
 
     for (int i = 0; i < number; ++i) {
         if (!cur) {
             throw RuntimeError("Index out of range");
         }
-        cur = std::dynamic_pointer_cast<Cell>(cur->GetSecond());
+        cur = DynamicCast<Cell>(cur->GetSecond());
     }
     return cur;
 }
 
-std::shared_ptr<Object> ListRef::Apply(std::vector<std::shared_ptr<Object>> &args,
-                                       std::shared_ptr<Scope> scope) {
+Value ListRef::Call(ValueSpan args) {
     if (args.size() != 2) {
         throw RuntimeError("Неверное число аргументов list-tail");
     }
-    EvalArgs(args, scope);
 
-    if (!std::dynamic_pointer_cast<Number>(args[1])) {
+    if (!args[1].IsNumber()) {
         throw RuntimeError("Второй аргумент у list-ref должен быть индексом");
     }
-    auto number = std::dynamic_pointer_cast<Number>(args[1])->GetValue();
+    auto number = AsNumber(args[1]);
 
-    if (!args[0]->IsCell() && !args[0]->IsList() && !args[0]->IsPair()) {
-        throw RuntimeError("Неверные аргументы у list-tail");
-    }
-    std::shared_ptr<Cell> cur;
-    if (args[0]->IsList() || args[0]->IsPair()) {
-        cur = std::dynamic_pointer_cast<List>(args[0])->Head();
-    } else {
-        cur = std::dynamic_pointer_cast<Cell>(args[0]);
+    Cell *cur = DynamicCast<Cell>(args[0]);
+    if (!cur) {
+        auto list = DynamicCast<List>(args[0]);
+        if (!list || (!list->IsList() && !list->IsPair())) {
+            throw RuntimeError("Неверные аргументы у list-tail");
+        }
+        cur = list->Head();
     }
 
     for (int i = 0; i < number; ++i) {
         if (!cur) {
             throw RuntimeError("Index out of range");
         }
-        cur = std::dynamic_pointer_cast<Cell>(cur->GetSecond());
+        cur = DynamicCast<Cell>(cur->GetSecond());
     }
     if (!cur) {
         throw RuntimeError("Index out of range");
@@ -1027,231 +1692,335 @@ std::shared_ptr<Object> ListRef::Apply(std::vector<std::shared_ptr<Object>> &arg
     return cur->GetFirst();
 }
 
-Lambda::Lambda(const std::vector<std::string> &variables,
-               const std::vector<std::shared_ptr<Object>> &body,
-               std::shared_ptr<Scope> old_scope) {
+Lambda::Lambda(std::shared_ptr<const std::vector<std::string>> variables,
+               const std::vector<Value> &body,
+               std::shared_ptr<Scope> old_scope)
+        : Function(ObjectType::LAMBDA), my_scope_(std::move(old_scope)) {
     defined_variables_ = variables;
     body_of_function_ = body;
-    my_scope_ = std::make_shared<Scope>(*old_scope);
-}
-
-void Lambda::InsertMeToScope(const std::string &var) {
-    my_scope_->OverrideVariable(var, shared_from_this());
 }
 
-bool Lambda::IsLambda() {
-    return true;
+void Lambda::Trace(Heap *heap) {
+    for (auto &step : body_of_function_) {
+        heap->Mark(step);
+    }
+    my_scope_->Trace(heap);
+    if (code_) {
+        code_->Trace(heap);
+    }
 }
 
-std::shared_ptr<Object> Lambda::Apply(std::vector<std::shared_ptr<Object>> &args,
-                                      std::shared_ptr<Scope> scope) {
-    if (args.size() != defined_variables_.size()) {
+std::shared_ptr<Scope> Lambda::BindArguments(ValueSpan args) {
+    if (args.size() != defined_variables_->size()) {
         throw SyntaxError("Неверное число аргументов у lambda функции");
     }
-    EvalArgs(args, scope);
-    int i = 0;
-    for (auto &var : defined_variables_) {
-        my_scope_->OverrideVariable(var, args[i++]);
-    }
-    std::shared_ptr<Object> result = nullptr;
-    for (auto &step : body_of_function_) {
-        result = step->Eval(my_scope_);
+    return std::make_shared<Scope>(my_scope_, defined_variables_,
+                                   std::vector<Value>(args.begin(), args.end()));
+}
+
+Value Lambda::Call(ValueSpan args) {
+    Lambda *lambda = this;
+    auto scope = BindArguments(args);
+    while (true) {
+        auto &body = lambda->body_of_function_;
+        if (body.empty()) {
+            return nullptr;
+        }
+        for (size_t i = 0; i + 1 < body.size(); ++i) {
+            body[i].Eval(scope);
+        }
+
+        // хвостовая форма разбирается здесь же, как в Cell::Eval, но if, and, or
+        // и вызов lambda продолжают цикл вместо рекурсии
+        auto expr = body.back();
+        while (true) {
+            if (!expr || !expr.IsCell()) {
+                return expr.Eval(scope);
+            }
+            auto head = AsCell(expr)->EvalCallee(scope);
+            ArgumentFrame frame(AsCell(expr)->GetSecond());
+            auto tail_args = frame.Get();
+
+            if (auto branch = DynamicCast<If>(head)) {
+                expr = branch->Branch(tail_args, scope);
+                continue;
+            }
+            Value result;
+            if (auto conjunction = DynamicCast<And>(head)) {
+                if (conjunction->EvalPrefix(tail_args, scope, &result)) {
+                    return result;
+                }
+                expr = tail_args.back();
+                continue;
+            }
+            if (auto disjunction = DynamicCast<Or>(head)) {
+                if (disjunction->EvalPrefix(tail_args, scope, &result)) {
+                    return result;
+                }
+                expr = tail_args.back();
+                continue;
+            }
+            if (!head.IsLambda()) {
+                return head->Apply(tail_args, scope);
+            }
+            lambda = head.As<Lambda>();
+            lambda->EvalArgs(tail_args, scope);
+            scope = lambda->BindArguments(tail_args);
+            break;
+        }
     }
-    return result;
 }
 
+const std::shared_ptr<const std::vector<std::string>> &Lambda::GetVariables() const {
+    return defined_variables_;
+}
 
-std::shared_ptr<Object> CreateLambda::Apply(std::vector<std::shared_ptr<Object>> &args,
-                                            std::shared_ptr<Scope> scope) {
+std::shared_ptr<Scope> Lambda::GetScope() const {
+    return my_scope_;
+}
+
+const std::vector<Value> &Lambda::GetBody() const {
+    return body_of_function_;
+}
+
+std::shared_ptr<Code> Lambda::GetCode() const {
+    return code_;
+}
+
+void Lambda::SetCode(std::shared_ptr<Code> code) {
+    code_ = code;
+}
+
+
+Value CreateLambda::Apply(ValueSpan args, const std::shared_ptr<Scope> &scope) {
     if (args.size() < 2) {
         throw SyntaxError("Недостаточно аргументов у lambda");
     }
     std::vector<std::string> defined_variables;
-    std::vector<std::shared_ptr<Object>> body_of_function;
+    std::vector<Value> body_of_function;
 
     auto head = args[0];
     while (head) {
-        if (!std::dynamic_pointer_cast<Cell>(head)->GetFirst()->IsSymbol()) {
+        if (!DynamicCast<Cell>(head)->GetFirst().IsSymbol()) {
             throw RuntimeError("После lambda должен быть список переменных");
         }
-        auto first = std::dynamic_pointer_cast<Cell>(head)->GetFirst();
-        defined_variables.push_back(std::dynamic_pointer_cast<Symbol>(first)->GetName());
-        head = std::dynamic_pointer_cast<Cell>(head)->GetSecond();
+        auto first = DynamicCast<Cell>(head)->GetFirst();
+        defined_variables.push_back(DynamicCast<Symbol>(first)->GetName());
+        head = DynamicCast<Cell>(head)->GetSecond();
     }
     for (size_t i = 1; i < args.size(); ++i) {
         body_of_function.push_back(args[i]);
     }
-    return std::make_shared<Lambda>(defined_variables, body_of_function, scope);
+    return Make<Lambda>(
+            std::make_shared<const std::vector<std::string>>(defined_variables),
+            body_of_function, scope);
 }
 
-std::shared_ptr<Object> Define::Apply(std::vector<std::shared_ptr<Object>> &args,
-                                      std::shared_ptr<Scope> scope) {
-    if (args.size() != 2 || !args[0] || !args[1] || !(args[0]->IsSymbol() || args[0]->IsCell())) {
+Value Define::Apply(ValueSpan args, const std::shared_ptr<Scope> &scope) {
+    if (args.size() != 2 || !args[0] || !args[1] || !(args[0].IsSymbol() || args[0].IsCell())) {
         throw SyntaxError("Неверные аргументы для define");
     }
-    if (args[0]->IsCell()) {
-        auto head = std::dynamic_pointer_cast<Cell>(args[0]);
-        if (!head->GetFirst() || !head->GetFirst()->IsSymbol()) {
+    if (args[0].IsCell()) {
+        auto head = DynamicCast<Cell>(args[0]);
+        if (!head->GetFirst() || !head->GetFirst().IsSymbol()) {
             throw SyntaxError("Неверные аргументы для define lambda-sugar");
         }
 
-        std::string name = std::dynamic_pointer_cast<Symbol>(head->GetFirst())->GetName();
+        std::string name = DynamicCast<Symbol>(head->GetFirst())->GetName();
 
-        head = std::dynamic_pointer_cast<Cell>(head->GetSecond());
+        head = DynamicCast<Cell>(head->GetSecond());
 
         std::vector<std::string> defined_variables;
-        std::vector<std::shared_ptr<Object>> body_of_function;
+        std::vector<Value> body_of_function;
 
         while (head) {
-            if (!std::dynamic_pointer_cast<Cell>(head)->GetFirst()->IsSymbol()) {
+            if (!DynamicCast<Cell>(head)->GetFirst().IsSymbol()) {
                 throw RuntimeError("После lambda должен быть список переменных");
             }
-            auto first = std::dynamic_pointer_cast<Cell>(head)->GetFirst();
-            defined_variables.push_back(std::dynamic_pointer_cast<Symbol>(first)->GetName());
-            head = std::dynamic_pointer_cast<Cell>(std::dynamic_pointer_cast<Cell>(head)->
+            auto first = DynamicCast<Cell>(head)->GetFirst();
+            defined_variables.push_back(DynamicCast<Symbol>(first)->GetName());
+            head = DynamicCast<Cell>(DynamicCast<Cell>(head)->
                     GetSecond());
         }
         for (size_t i = 1; i < args.size(); ++i) {
             body_of_function.push_back(args[i]);
         }
-        std::shared_ptr<Object> lambda = std::make_shared<Lambda>(defined_variables,
+        Value lambda = Make<Lambda>(
+                std::make_shared<const std::vector<std::string>>(defined_variables),
                 body_of_function, scope);
-        std::dynamic_pointer_cast<Lambda>(lambda)->InsertMeToScope(name);
         scope->OverrideVariable(name, lambda);
         return nullptr;
     }
-    args[1] = args[1]->Eval(scope);
-    std::string name = std::dynamic_pointer_cast<Symbol>(args[0])->GetName();
-    if (args[1]->IsLambda()) {
-        std::dynamic_pointer_cast<Lambda>(args[1])->InsertMeToScope(name);
-    }
-    scope->OverrideVariable(name, args[1]);
+    args[1] = args[1].Eval(scope);
+    scope->OverrideVariable(DynamicCast<Symbol>(args[0])->GetName(), args[1]);
     return nullptr;
 }
 
-std::shared_ptr<Object> If::Apply(std::vector<std::shared_ptr<Object>> &args,
-                                  std::shared_ptr<Scope> scope) {
+If::If() : Syntax(ObjectType::IF) {
+}
+
+Value If::Apply(ValueSpan args, const std::shared_ptr<Scope> &scope) {
+    return Branch(args, scope).Eval(scope);
+}
+
+Value If::Branch(ValueSpan args, const std::shared_ptr<Scope> &scope) {
     if (args.size() < 2 || args.size() > 3 || !args[0]) {
         throw SyntaxError("");
     }
-    args[0] = args[0]->Eval(scope);
-    if (!args[0]->IsSymbol() || !(std::dynamic_pointer_cast<Symbol>(args[0])->GetName() == "#t"
-                                  || std::dynamic_pointer_cast<Symbol>(args[0])->GetName() ==
-                                     "#f")) {
+    args[0] = args[0].Eval(scope);
+    if (args[0] != kTrueSymbol && args[0] != kFalseSymbol) {
         throw SyntaxError("");
     }
-    if (std::dynamic_pointer_cast<Symbol>(args[0])->GetName() == "#t") {
-        return args[1]->Eval(scope);
+    if (args[0] == kTrueSymbol) {
+        return args[1];
     }
     if (args.size() == 3) {
-        return args[2]->Eval(scope);
+        return args[2];
     }
-    return std::shared_ptr<List>(nullptr);
+    return nullptr;
 }
 
-std::shared_ptr<Object> Set::Apply(std::vector<std::shared_ptr<Object>> &args,
-                                   std::shared_ptr<Scope> scope) {
-    if (args.size() != 2 || !args[0] || !args[1] || !args[0]->IsSymbol()) {
+Value Set::Apply(ValueSpan args, const std::shared_ptr<Scope> &scope) {
+    if (args.size() != 2 || !args[0] || !args[1] || !args[0].IsSymbol()) {
         throw SyntaxError("");
     }
-    args[1] = args[1]->Eval(scope);
-    scope->ChangeVariable(std::dynamic_pointer_cast<Symbol>(args[0])->GetName(),
+    args[1] = args[1].Eval(scope);
+    scope->ChangeVariable(DynamicCast<Symbol>(args[0])->GetName(),
                           args[1]);
     return nullptr;
 }
 
-Scope::Scope() : variables_(std::unordered_map<std::string, std::shared_ptr<Object>>()) {
-    variables_["+"] = std::make_shared<Add>();
-    variables_["-"] = std::make_shared<Subtract>();
-    variables_["/"] = std::make_shared<Divide>();
-    variables_["*"] = std::make_shared<Multiply>();
-
-    variables_["and"] = std::make_shared<And>();
-    variables_["or"] = std::make_shared<Or>();
-    variables_["if"] = std::make_shared<If>();
-    variables_["define"] = std::make_shared<Define>();
-
-    variables_["list-tail"] = std::make_shared<ListTail>();
-    variables_["list-ref"] = std::make_shared<ListRef>();
-    variables_["list"] = std::make_shared<NewList>();
-    variables_["cons"] = std::make_shared<Cons>();
-
-    variables_["cdr"] = std::make_shared<Cdr>();
-    variables_["car"] = std::make_shared<Car>();
-    variables_["set-cdr!"] = std::make_shared<SetCdr>();
-    variables_["set-car!"] = std::make_shared<SetCar>();
-
-    variables_["+"] = std::make_shared<Add>();
-    variables_["-"] = std::make_shared<Subtract>();
-    variables_["/"] = std::make_shared<Divide>();
-    variables_["*"] = std::make_shared<Multiply>();
-
-    variables_["lambda"] = std::make_shared<CreateLambda>();
-    variables_["set!"] = std::make_shared<Set>();
-    variables_["not"] = std::make_shared<Not>();
-    variables_["max"] = std::make_shared<Max>();
-    variables_["min"] = std::make_shared<Min>();
-    variables_["abs"] = std::make_shared<Abs>();
-
-    variables_["<"] = std::make_shared<Less>();
-    variables_["<="] = std::make_shared<LessEq>();
-    variables_[">="] = std::make_shared<MoreEq>();
-    variables_[">"] = std::make_shared<More>();
-    variables_["="] = std::make_shared<Eq>();
-
-    variables_["null?"] = std::make_shared<QNull>();
-    variables_["pair?"] = std::make_shared<QPair>();
-    variables_["list?"] = std::make_shared<QList>();
-    variables_["boolean?"] = std::make_shared<QBoolean>();
-    variables_["symbol?"] = std::make_shared<QSymbol>();
-    variables_["number?"] = std::make_shared<QNumber>();
-    variables_["quote"] = std::make_shared<Quote>();
-}
-
-Scope::Scope(const Scope &rhs) {
+Scope::Scope(BindingJournal *journal)
+        : id_(NextScopeId()), builtins_(true), journal_(journal), global_(this) {
+}
+
+Scope::Scope(std::shared_ptr<Scope> parent, std::shared_ptr<const std::vector<std::string>> names,
+             std::vector<Value> slots, bool fixed)
+        : parent_(parent), names_(names), slots_(std::move(slots)), id_(NextScopeId()),
+          fixed_names_(fixed), global_(this) {
+    if (parent_) {
+        global_ = parent_->global_;
+        journal_ = parent_->journal_;
+        journal_epoch_ = journal_ ? journal_->GetEpoch() : 0;
+    }
+    for (auto &slot : slots_) {
+        Heap::Current()->WriteBarrier(this, slot.GetObject());
+    }
+}
+
+Scope::Scope(const Scope &rhs)
+        : ValueHolder(rhs), enable_shared_from_this(rhs), id_(NextScopeId()),
+          builtins_(rhs.builtins_), fixed_names_(rhs.fixed_names_),
+          global_(rhs.parent_ ? rhs.global_ : this) {
     variables_ = rhs.variables_;
+    parent_ = rhs.parent_;
+    names_ = rhs.names_;
+    slots_ = rhs.slots_;
+    for (auto &slot : slots_) {
+        Heap::Current()->WriteBarrier(this, slot.GetObject());
+    }
 }
 
-std::shared_ptr<Object> Symbol::Eval(std::shared_ptr<Scope> scope) {
-    if (name_ == "#f" || name_ == "#t") {
-        return std::make_shared<Symbol>(name_);
+Value Symbol::Eval(const std::shared_ptr<Scope> &scope) {
+    if (this == kFalseSymbol || this == kTrueSymbol) {
+        return this;
     }
     if (!name_.empty() && name_[0] == '\'') {
-        return std::make_shared<Symbol>(name_.substr(1));
+        return Intern(name_.substr(1));
     }
     return scope->LookUp(name_);
 }
 
-std::string PrintTo(const std::shared_ptr<Object> &obj) {
+// Сколько печать в поток копит в буфере, прежде чем отдать потоку.
+const size_t kPrintChunkSize = 1 << 16;
+
+void PrintAtom(const Value &obj, std::string *out) {
     if (!obj) {
-        return "()";
-    }
-    if (obj->IsSymbol()) {
-        return std::dynamic_pointer_cast<Symbol>(obj)->GetName();
-    }
-    if (obj->IsNumber()) {
-        return std::to_string(std::dynamic_pointer_cast<Number>(obj)->GetValue());
-    }
-    std::string result;
-    if (obj->IsList() || obj->IsCell()) {
-        std::shared_ptr<Cell> cell;
-        if (obj->IsList()) {
-            cell = std::dynamic_pointer_cast<Cell>(std::dynamic_pointer_cast<List>(obj)->Head());
+        *out += "()";
+    } else if (obj.IsSymbol()) {
+        *out += DynamicCast<Symbol>(obj)->GetName();
+    } else if (obj.IsNumber()) {
+        char digits[24];
+        auto end = std::to_chars(digits, digits + sizeof(digits), AsNumber(obj)).ptr;
+        out->append(digits, end);
+    }
+}
+
+// Печать без рекурсии: для каждого незакрытого списка в стеке лежит ячейка,
+// на которой печать остановилась. Если задан stream, накопленное сбрасывается
+// в него кусками.
+void PrintTo(const Value &obj, std::string *out, std::ostream *stream) {
+    // nullptr - хвост после точки напечатан, осталось закрыть скобку
+    std::vector<Cell *> open;
+    Value value = obj;
+    while (true) {
+        if (value.IsList() || value.IsCell()) {
+            Cell *cell;
+            if (value.IsList()) {
+                cell = DynamicCast<Cell>(DynamicCast<List>(value)->Head());
+            } else {
+                cell = DynamicCast<Cell>(value);
+            }
+            *out += '(';
+            if (cell) {
+                open.push_back(cell);
+                value = cell->GetFirst();
+                continue;
+            }
+            *out += ')';
         } else {
-            cell = std::dynamic_pointer_cast<Cell>(obj);
+            PrintAtom(value, out);
         }
-        while (cell) {
-            if (!result.empty()) {
-                result += " ";
+        if (stream && out->size() >= kPrintChunkSize) {
+            *stream << *out;
+            out->clear();
+        }
+
+        // элемент напечатан: переходим к следующему, закрывая готовые списки
+        while (!open.empty()) {
+            auto cell = open.back();
+            if (!cell) {
+                *out += ')';
+                open.pop_back();
+                continue;
             }
-            result += PrintTo(cell->GetFirst());
-            if (cell->GetSecond() && !cell->GetSecond()->IsCell()) {
-                result += " . " + PrintTo(cell->GetSecond());
-                return "(" + result + ")";
+            auto rest = cell->GetSecond();
+            if (rest.IsCell()) {
+                *out += ' ';
+                open.back() = DynamicCast<Cell>(rest);
+                value = open.back()->GetFirst();
+                break;
             }
-            cell = std::dynamic_pointer_cast<Cell>(cell->GetSecond());
+            if (rest) {
+                *out += " . ";
+                open.back() = nullptr;
+                value = rest;
+                break;
+            }
+            *out += ')';
+            open.pop_back();
+        }
+        if (open.empty()) {
+            break;
         }
-        return "(" + result + ")";
     }
+    if (stream) {
+        *stream << *out;
+        out->clear();
+    }
+}
+
+void PrintTo(const Value &obj, std::string *out) {
+    PrintTo(obj, out, nullptr);
+}
+
+void PrintTo(const Value &obj, std::ostream *out) {
+    std::string buffer;
+    PrintTo(obj, &buffer, out);
+}
+
+std::string PrintTo(const Value &obj) {
+    std::string result;
+    PrintTo(obj, &result, nullptr);
     return result;
-}
\ No newline at end of file
+}
@@ -1,109 +1,649 @@
 #pragma once
 
 #include "tokenizer.h"
+#include "buffer_tokenizer.h"
+#include "heap.h"
+#include <cstdint>
+#include <istream>
+#include <ostream>
 #include <vector>
 #include <string>
+#include <string_view>
 #include <memory>
+#include <type_traits>
 #include <unordered_map>
 #include <variant>
 
+class Object;
+
 class Scope;
 
-class Object : public std::enable_shared_from_this<Object> {
+struct Code;
+
+// Значение Scheme: пустой список (0), целое прямо внутри Value
+// или указатель на объект в куче. Целое хранится со сдвигом и младшим
+// битом 1, поэтому копирование Value - это копирование одного слова.
+// Объектами владеет Heap, Value их не удерживает. Целые, которые
+// не влезают в 63 бита, лежат в Number.
+class Value {
+public:
+    Value() = default;
+
+    Value(std::nullptr_t) {
+    }
+
+    template <class T, class = std::enable_if_t<std::is_base_of<Object, T>::value>>
+    Value(T *object) : bits_(reinterpret_cast<uintptr_t>(static_cast<Object *>(object))) {
+    }
+
+    static Value Fixnum(int64_t value);
+
+    static bool FitsFixnum(int64_t value);
+
+    bool IsFixnum() const;
+
+    int64_t GetFixnum() const;
+
+    // Проверки типа безопасны для любого значения, в том числе пустого списка.
+    bool IsNumber() const;
+
+    bool IsSymbol() const;
+
+    bool IsCell() const;
+
+    bool IsFunction() const;
+
+    bool IsSyntax() const;
+
+    bool IsList() const;
+
+    bool IsPair() const;
+
+    bool IsFalse() const;
+
+    bool IsLambda() const;
+
+    Value Eval(const std::shared_ptr<Scope> &scope) const;
+
+    // Объект в куче; для целых и пустого списка - nullptr.
+    Object *GetObject() const;
+
+    // Вызывающий сам проверяет, что это не целое и не nullptr.
+    Object *operator->() const;
+
+    template <class T>
+    T *As() const {
+        return static_cast<T *>(reinterpret_cast<Object *>(bits_));
+    }
+
+    explicit operator bool() const {
+        return bits_ != 0;
+    }
+
+    bool operator==(const Value &rhs) const {
+        return bits_ == rhs.bits_;
+    }
+
+    bool operator!=(const Value &rhs) const {
+        return bits_ != rhs.bits_;
+    }
+
+    bool operator==(std::nullptr_t) const {
+        return bits_ == 0;
+    }
+
+    bool operator!=(std::nullptr_t) const {
+        return bits_ != 0;
+    }
+
+private:
+    bool IsObject() const;
+
+    uintptr_t bits_ = 0;
+};
+
+// Значения подряд в чужой памяти: аргументы вызова на стеке вычисления
+// или на стеке VM. Встроенные функции могут переписывать их на месте.
+class ValueSpan {
+public:
+    ValueSpan() = default;
+
+    ValueSpan(Value *data, size_t size) : data_(data), size_(size) {
+    }
+
+    ValueSpan(std::vector<Value> &values) : data_(values.data()), size_(values.size()) {
+    }
+
+    size_t size() const {
+        return size_;
+    }
+
+    bool empty() const {
+        return size_ == 0;
+    }
+
+    Value &operator[](size_t index) const {
+        return data_[index];
+    }
+
+    Value &back() const {
+        return data_[size_ - 1];
+    }
+
+    Value *begin() const {
+        return data_;
+    }
+
+    Value *end() const {
+        return data_ + size_;
+    }
+
+private:
+    Value *data_ = nullptr;
+    size_t size_ = 0;
+};
+
+// Класс объекта. Проверки типа и DynamicCast сравнивают тег вместо
+// виртуальных вызовов и RTTI. Функции и синтаксис идут отрезками,
+// чтобы IsFunction и IsSyntax были одним сравнением диапазона.
+enum class ObjectType : uint8_t {
+    OTHER,
+    CELL,
+    NUMBER,
+    SYMBOL,
+    LIST,
+    FUNCTION,
+    AND,
+    OR,
+    LAMBDA,
+    SYNTAX,
+    IF
+};
+
+// Объекты создаются через Make и живут, пока до них можно дотянуться
+// из корней кучи (см. heap.h).
+class Object {
 public:
-    virtual std::shared_ptr<Object> Apply(std::vector<std::shared_ptr<Object>> &args,
-                                  std::shared_ptr<Scope> scope);
+    // Выделять в яслях. Такой объект копируется при переносе в старшее
+    // поколение, а его деструктор не вызывается.
+    static constexpr bool kNursery = false;
+
+    explicit Object(ObjectType type = ObjectType::OTHER) : type_(type) {
+    }
+
+    virtual Value Apply(ValueSpan args, const std::shared_ptr<Scope> &scope);
 
     virtual ~Object() = default;
 
-    virtual bool IsSymbol();
+    ObjectType GetType() const {
+        return type_;
+    }
+
+    virtual Value Eval(const std::shared_ptr<Scope> &scope);
+
+    // Помечает через heap->Mark всё, на что объект ссылается.
+    virtual void Trace(Heap *heap);
+
+    // Копия в старшем поколении; нужна только объектам с kNursery.
+    virtual Object *Promote() const;
+
+private:
+    friend class Heap;
+
+    Object *gc_next_ = nullptr;
+    bool gc_marked_ = false;
+    bool gc_remembered_ = false;
+    ObjectType type_;
+};
 
-    virtual bool IsNumber();
+inline Value Value::Fixnum(int64_t value) {
+    Value result;
+    result.bits_ = (static_cast<uintptr_t>(value) << 1) | 1;
+    return result;
+}
+
+inline bool Value::FitsFixnum(int64_t value) {
+    return value >= (INT64_MIN >> 1) && value <= (INT64_MAX >> 1);
+}
+
+inline bool Value::IsFixnum() const {
+    return bits_ & 1;
+}
+
+inline int64_t Value::GetFixnum() const {
+    return static_cast<int64_t>(bits_) >> 1;
+}
+
+inline bool Value::IsObject() const {
+    return bits_ && !IsFixnum();
+}
+
+inline bool Value::IsNumber() const {
+    return IsFixnum() || (bits_ && As<Object>()->GetType() == ObjectType::NUMBER);
+}
+
+inline bool Value::IsSymbol() const {
+    return IsObject() && As<Object>()->GetType() == ObjectType::SYMBOL;
+}
+
+inline bool Value::IsCell() const {
+    return IsObject() && As<Object>()->GetType() == ObjectType::CELL;
+}
+
+inline bool Value::IsFunction() const {
+    return IsObject() && As<Object>()->GetType() >= ObjectType::FUNCTION &&
+           As<Object>()->GetType() <= ObjectType::LAMBDA;
+}
+
+inline bool Value::IsSyntax() const {
+    return IsObject() && As<Object>()->GetType() >= ObjectType::SYNTAX &&
+           As<Object>()->GetType() <= ObjectType::IF;
+}
+
+inline bool Value::IsLambda() const {
+    return IsObject() && As<Object>()->GetType() == ObjectType::LAMBDA;
+}
+
+inline Value Value::Eval(const std::shared_ptr<Scope> &scope) const {
+    // пустой список и числа вычисляются сами в себя
+    if (!IsObject()) {
+        return *this;
+    }
+    return As<Object>()->Eval(std::move(scope));
+}
+
+inline Object *Value::GetObject() const {
+    return IsObject() ? As<Object>() : nullptr;
+}
+
+inline Object *Value::operator->() const {
+    return As<Object>();
+}
+
+class BindingJournal;
+
+// Ячейка переменной области видимости. Скомпилированный код держит указатель
+// на неё и читает значение без поиска по имени.
+struct Binding : public ValueHolder {
+    Value value_;
+    bool defined_ = false;
+    // Встроенная функция, которую сюда положила глобальная область. Пока
+    // value_ равно ей, компилятор может подставлять её вместо вызова.
+    Value builtin_;
+    // журнал глобальной области, которой принадлежит ячейка
+    BindingJournal *journal_ = nullptr;
+    // глобальная область, чьи кэши вызовов сбрасывает define этой ячейки
+    Scope *global_ = nullptr;
+    // снимок, после которого прежнее значение уже в журнале
+    size_t journal_epoch_ = 0;
+
+    bool HoldsBuiltin() const {
+        return builtin_ && value_ == builtin_;
+    }
+
+    // Запись через define или set!: барьер записи и журнал снимков.
+    void Assign(const Value &value);
+
+    void TraceValues(Heap *heap) override;
+};
+
+// Журнал изменений глобальных ячеек для снимков окружения. Пока есть хотя бы
+// один снимок, первое изменение ячейки после него сохраняет прежнее значение;
+// откат возвращает сохранённые значения в обратном порядке. Снимок ничего
+// не копирует, откат стоит столько, сколько ячеек изменилось. Так же
+// пишутся кадры lambda, созданные до снимка: их переменные меняет set!
+// из замыканий, и первая запись сохраняет кадр целиком.
+class BindingJournal {
+public:
+    BindingJournal() = default;
 
-    virtual bool IsCell();
+    BindingJournal(const BindingJournal &) = delete;
 
-    virtual bool IsFunction();
+    BindingJournal &operator=(const BindingJournal &) = delete;
 
-    virtual bool IsSyntax();
+    // Номер нового снимка.
+    size_t TakeSnapshot();
 
-    virtual bool IsList();
+    // Откатывает ячейки к снимку; снимок остаётся, более поздние пропадают.
+    // false, если снимка уже нет.
+    bool RollBack(size_t snapshot);
 
-    virtual bool IsPair();
+    void Record(Binding *binding);
 
-    virtual bool IsFalse();
+    void Record(Scope *frame);
 
-    virtual  bool IsLambda();
+    // Номер, который получает кадр, созданный сейчас: до следующего
+    // снимка или отката его не нужно сохранять.
+    size_t GetEpoch() const {
+        return epoch_;
+    }
 
-    virtual std::shared_ptr<Object> Eval(std::shared_ptr<Scope> scope);
+    // Сохранённые значения - корни и для малой сборки.
+    void Trace(Heap *heap);
+
+    // Ячейки удалены вместе с областью: все снимки пропадают.
+    void Clear();
+
+private:
+    struct Entry {
+        Binding *binding_;
+        Value value_;
+        bool defined_;
+        // запись кадра: binding_ пуст, slots_ - прежние значения
+        std::shared_ptr<Scope> frame_;
+        std::vector<Value> slots_;
+    };
+
+    std::vector<Entry> entries_;
+    // номер снимка и число записей журнала на момент снимка
+    std::vector<std::pair<size_t, size_t>> snapshots_;
+    // 0 - снимков нет, и журнал ничего не пишет
+    size_t epoch_ = 0;
+    size_t epoch_counter_ = 0;
+    size_t snapshot_counter_ = 0;
 };
 
-class Scope {
+class CallSiteCache;
+
+// Глобальная область видимости хранит переменные в variables_; встроенные
+// функции общие на процесс, и ячейка им заводится при первом обращении.
+// Кадр вызова lambda хранит аргументы подряд в slots_ (имена в names_)
+// и ссылается на область видимости, в которой lambda была создана.
+class Scope : public ValueHolder, public std::enable_shared_from_this<Scope> {
 public:
-    Scope();
+    // Глобальная область; изменения её ячеек пишутся в journal.
+    explicit Scope(BindingJournal *journal = nullptr);
+
+    // fixed - names перечисляют все переменные кадра, и define в нём новых
+    // не заводит (кадр VM): компилятор может адресовать их по номеру.
+    Scope(std::shared_ptr<Scope> parent, std::shared_ptr<const std::vector<std::string>> names,
+          std::vector<Value> slots, bool fixed = false);
 
     Scope(const Scope &rhs);
 
+    Scope &operator=(const Scope &) = delete;
+
     void Clear();
 
-    void ChangeVariable(const std::string &x, std::shared_ptr<Object> &val);
+    void ChangeVariable(const std::string &x, Value &val);
+
+    void OverrideVariable(const std::string &x, const Value &val);
+
+    Value LookUp(const std::string &var);
+
+    // LookUp для головы вызова в обходчике дерева: значение должно быть
+    // функцией или синтаксисом. Найденную глобальную ячейку запоминает cache,
+    // и повторный вызов из той же области или из кадра той же lambda
+    // обходится без поиска по имени и проверки типа.
+    Value LookUpCallee(const std::string &var, CallSiteCache *cache);
+
+    // Появилась или определилась ячейка, которая может перекрыть
+    // запомненную в кэшах вызовов. Кэши у каждой глобальной области
+    // свои: сбрасываются только вызовы из неё и её кадров.
+    void InvalidateCallSites();
 
-    void OverrideVariable(const std::string &x, const std::shared_ptr<Object> &val);
+    // Ячейка переменной из variables_; если её нет, создаётся неопределённая.
+    std::shared_ptr<Binding> GetBinding(const std::string &var);
 
-    std::shared_ptr<Object> LookUp(const std::string &var);
+    // Ячейка из variables_ или встроенной функции; nullptr, если её нет.
+    std::shared_ptr<Binding> FindBinding(const std::string &var);
+
+    Scope *GetParent() const;
+
+    const std::shared_ptr<const std::vector<std::string>> &GetNames() const;
+
+    bool HasFixedNames() const;
+
+    // Ячейка кадра, отстоящего на depth шагов вверх по цепочке.
+    Value &GetSlot(size_t depth, size_t index);
+
+    void SetSlot(size_t depth, size_t index, const Value &value);
+
+    // Значение ячейки кадра, чей define ещё не выполнен.
+    static const Value &Unbound();
+
+    // Помечает значения этой области и всех объемлющих.
+    void Trace(Heap *heap);
+
+    void TraceValues(Heap *heap) override;
 
     ~Scope();
 private:
-    std::unordered_map<std::string, std::shared_ptr<Object>> variables_;
+    friend class ImageWriter;
+    friend class ImageReader;
+    friend class BindingJournal;
+
+    // holder - где лежит найденное значение, для барьера записи;
+    // binding - ячейка из variables_, если значение нашлось в ней;
+    // owner - область, где нашлась переменная.
+    Value *FindVariable(const std::string &var, ValueHolder **holder = nullptr,
+                        Binding **binding = nullptr, Scope **owner = nullptr);
+
+    // Перед записью в кадр: кадр, созданный до снимка, попадает в журнал.
+    void RecordFrame();
+
+    std::unordered_map<std::string, std::shared_ptr<Binding>> variables_;
+    std::shared_ptr<Scope> parent_;
+    std::shared_ptr<const std::vector<std::string>> names_;
+    std::vector<Value> slots_;
+    // не повторяется, пока работает процесс, в отличие от адреса
+    uint64_t id_;
+    // глобальная область: имена, которых нет в variables_, ищутся
+    // среди встроенных функций
+    bool builtins_ = false;
+    bool fixed_names_ = false;
+    // у кадра - журнал глобальной области, в которой он создан
+    BindingJournal *journal_ = nullptr;
+    // для глобальной области - она сама; кадр держит её через parent_
+    Scope *global_;
+    // меняется с каждой новой или определённой ячейкой этой области
+    // и её кадров; действует только у глобальной области
+    uint64_t bindings_version_ = 1;
+    // снимок, после которого кадр уже в журнале или создан
+    size_t journal_epoch_ = 0;
+    size_t gc_epoch_ = 0;
+};
+
+// Рекурсивные обходы (обходчик дерева, компилятор) зовут её на каждом уровне:
+// RuntimeError, если до конца стека C++ текущего потока осталось меньше
+// kNativeStackReserve. Так предел глубины, выставленный больше, чем
+// помещается в стек потока, не приводит к его переполнению.
+void CheckNativeStack();
+
+const size_t kNativeStackReserve = 256 * 1024;
+
+// Глубина вложенных Cell::Eval в обходчике дерева. Лимит выставляет Scheme;
+// при превышении или нехватке стека C++ - RuntimeError вместо его переполнения.
+class EvalDepthGuard {
+public:
+    EvalDepthGuard();
+
+    EvalDepthGuard(const EvalDepthGuard &) = delete;
+
+    EvalDepthGuard &operator=(const EvalDepthGuard &) = delete;
+
+    ~EvalDepthGuard();
+
+    static void SetLimit(size_t limit);
+
+private:
+    static thread_local size_t depth_;
+    static thread_local size_t limit_;
+};
+
+// Стек вычисления обходчика дерева: аргументы каждого вызова лежат на нём
+// подряд, и вызов не выделяет под них память. Растёт блоками, которые
+// не переезжают, так что ValueSpan на него верен до конца вызова.
+// Свой у каждого интерпретатора; текущий выставляет EvalStackContext.
+class EvalStack {
+public:
+    EvalStack() = default;
+
+    EvalStack(const EvalStack &) = delete;
+
+    EvalStack &operator=(const EvalStack &) = delete;
+
+    static EvalStack *Current() {
+        return current_;
+    }
+
+    // count пустых значений подряд на вершине.
+    ValueSpan Push(size_t count);
+
+    // Снимает последние count значений, положенные одним Push.
+    void Pop(size_t count);
+
+    // Число значений на стеке.
+    size_t GetSize() const;
+
+    void Trace(Heap *heap);
+
+private:
+    struct Block {
+        std::unique_ptr<Value[]> values_;
+        size_t capacity_;
+        size_t top_;
+    };
+
+    static Block MakeBlock(size_t capacity);
+
+    static thread_local EvalStack *current_;
+
+    friend class EvalStackContext;
+
+    std::vector<Block> blocks_;
+    size_t current_block_ = 0;
+};
+
+// Делает stack текущим стеком вычисления потока на время жизни объекта.
+class EvalStackContext {
+public:
+    explicit EvalStackContext(EvalStack *stack);
+
+    EvalStackContext(const EvalStackContext &) = delete;
+
+    EvalStackContext &operator=(const EvalStackContext &) = delete;
+
+    ~EvalStackContext();
+
+private:
+    EvalStack *previous_;
 };
 
-std::vector<std::shared_ptr<Object>> ToVector(std::shared_ptr<Object> head);
+// Аргументы формы вызова на текущем стеке вычисления. quote перед
+// аргументом разворачивается: 'x - в символ с кавычкой, '(...) - в List.
+// Снимаются со стека в деструкторе.
+class ArgumentFrame {
+public:
+    explicit ArgumentFrame(Value head);
+
+    ArgumentFrame(const ArgumentFrame &) = delete;
+
+    ArgumentFrame &operator=(const ArgumentFrame &) = delete;
+
+    ~ArgumentFrame();
+
+    ValueSpan Get() const {
+        return args_;
+    }
+
+private:
+    ValueSpan args_;
+};
 
 class Cell : public Object {
 public:
-    bool IsCell();
+    static constexpr bool kNursery = true;
+
+    static constexpr ObjectType kType = ObjectType::CELL;
+
+    void SetSecond(Value second);
 
-    void SetSecond(std::shared_ptr<Object> second);
+    void SetFirst(Value first);
 
-    void SetFirst(std::shared_ptr<Object> first);
+    Cell(Value first = nullptr, Value second = nullptr);
 
-    Cell(std::shared_ptr<Object> first = nullptr, std::shared_ptr<Object> second = nullptr);
+    Value GetFirst() const;
 
-    std::shared_ptr<Object> GetFirst() const;
+    Value GetSecond() const;
 
-    std::shared_ptr<Object> GetSecond() const;
+    Value Eval(const std::shared_ptr<Scope> &scope);
 
-    std::shared_ptr<Object> Eval(std::shared_ptr<Scope> scope);
+    // Вычисляет голову вызова; это должна быть функция или синтаксис.
+    Value EvalCallee(const std::shared_ptr<Scope> &scope);
+
+    void Trace(Heap *heap);
+
+    Object *Promote() const;
 
 private:
-    std::shared_ptr<Object> first_ptr_;
-    std::shared_ptr<Object> second_ptr_;
+    Value first_ptr_;
+    Value second_ptr_;
+    // CallSiteCache вызова, если голова - символ; Fixnum(0) после первого
+    // вычисления, чтобы не заводить кэш для формы, которая выполнится один раз
+    Value call_cache_;
+};
+
+// Мономорфный кэш места вызова в обходчике дерева: глобальная ячейка,
+// в которой нашлась голова вызова, и её значение. Верен, пока вызов идёт
+// из той же области (или из кадра lambda с теми же параметрами поверх неё)
+// и с тех пор не появилось ячеек, которые могли бы перекрыть эту.
+class CallSiteCache : public Object {
+public:
+    void Trace(Heap *heap);
+
+    uint64_t scope_id_ = 0;
+    std::shared_ptr<const std::vector<std::string>> frame_names_;
+    uint64_t version_ = 0;
+    Binding *binding_ = nullptr;
+    Value callee_;
 };
 
+// Попадания и промахи кэшей вызовов, свои у каждого потока.
+struct CallSiteStats {
+    size_t hits_ = 0;
+    size_t misses_ = 0;
+};
+
+CallSiteStats &GetCallSiteStats();
+
 class Number : public Object {
 public:
-    bool IsNumber();
+    static constexpr bool kNursery = true;
+
+    static constexpr ObjectType kType = ObjectType::NUMBER;
 
     Number(int64_t val);
 
     int64_t GetValue();
 
-    std::shared_ptr<Object> Eval(std::shared_ptr<Scope> scope);
+    Value Eval(const std::shared_ptr<Scope> &scope);
+
+    Object *Promote() const;
 
 private:
     int64_t value_;
 };
 
+// Символы интернируются: для каждого имени есть один объект, поэтому
+// символы сравниваются по указателю. Напрямую конструктор не вызывается.
+// Интернированные символы живут вне кучи и не собираются.
 class Symbol : public Object {
 public:
+    static constexpr ObjectType kType = ObjectType::SYMBOL;
+
     Symbol(std::string str);
 
-    bool IsSymbol();
+    static Symbol *Intern(std::string_view name);
 
-    std::string GetName();
+    // Число различных имён в таблице. Символы из неё не удаляются.
+    static size_t InternTableSize();
 
-    std::shared_ptr<Object> Eval(std::shared_ptr<Scope> scope);
+    const std::string &GetName() const;
 
-    bool IsFalse();
+    Value Eval(const std::shared_ptr<Scope> &scope);
+
+    bool IsFalse() const;
 
 private:
     std::string name_;
@@ -111,89 +651,100 @@ private:
 
 class List : public Object {
 public:
-    List(std::shared_ptr<Object> head);
+    static constexpr bool kNursery = true;
+
+    static constexpr ObjectType kType = ObjectType::LIST;
+
+    List(Value head);
+
+    Cell *Head();
+
+    Value Eval(const std::shared_ptr<Scope> &scope);
 
-    std::shared_ptr<Cell> Head();
+    Value SetCdr(Value new_tail);
 
-    std::shared_ptr<Object> Eval(std::shared_ptr<Scope> scope);
+    Value SetCar(Value new_first);
 
-    std::shared_ptr<Object> SetCdr(std::shared_ptr<Object> new_tail);
+    Value Car();
 
-    std::shared_ptr<Object> SetCar(std::shared_ptr<Object> new_first);
+    Value Cdr();
 
-    std::shared_ptr<Object> Car();
+    // Собственный список: цепочка ячеек заканчивается пустым списком.
+    bool IsList() const;
 
-    std::shared_ptr<Object> Cdr();
+    // Пара с точкой или список из двух элементов.
+    bool IsPair() const;
 
-    bool IsList();
+    void Trace(Heap *heap);
 
-    bool IsPair();
+    Object *Promote() const;
 private:
-    std::shared_ptr<Object> head_;
+    friend class ImageReader;
+
+    Value head_;
 };
 
 /***********************************************************
  ***********************************************************
  ***********************************************************/
 
+// Функции получают уже вычисленные аргументы через Call.
+// Apply нужен обходчику дерева: он сам вычисляет аргументы и зовёт Call.
 class Function : public Object {
 public:
-    bool IsFunction();
+    explicit Function(ObjectType type = ObjectType::FUNCTION);
+
+    void EvalArgs(ValueSpan args, const std::shared_ptr<Scope> &scope);
+
+    Value Apply(ValueSpan args, const std::shared_ptr<Scope> &scope);
 
-    void EvalArgs(std::vector<std::shared_ptr<Object>> &args, std::shared_ptr<Scope> scope);
+    virtual Value Call(ValueSpan args) = 0;
 };
 
 class Quote : public Function {
-    std::shared_ptr<Object> Apply(std::vector<std::shared_ptr<Object>> &args,
-                                  std::shared_ptr<Scope> scope);
+    Value Apply(ValueSpan args, const std::shared_ptr<Scope> &scope);
+
+    Value Call(ValueSpan args);
 };
 
 class Max : public Function {
 public:
-    std::shared_ptr<Object> Apply(std::vector<std::shared_ptr<Object>> &args,
-                                  std::shared_ptr<Scope> scope);
+    Value Call(ValueSpan args);
 };
 
 class Min : public Function {
 public:
-    std::shared_ptr<Object> Apply(std::vector<std::shared_ptr<Object>> &args,
-                                  std::shared_ptr<Scope> scope);
+    Value Call(ValueSpan args);
 };
 
 class Abs : public Function {
 public:
-    std::shared_ptr<Object> Apply(std::vector<std::shared_ptr<Object>> &args,
-                                  std::shared_ptr<Scope> scope);
+    Value Call(ValueSpan args);
 };
 
 class Add : public Function {
 public:
-    std::shared_ptr<Object> Apply(std::vector<std::shared_ptr<Object>> &args,
-                                  std::shared_ptr<Scope> scope);
+    Value Call(ValueSpan args);
 };
 
 class Multiply : public Function {
 public:
-    std::shared_ptr<Object> Apply(std::vector<std::shared_ptr<Object>> &args,
-                                  std::shared_ptr<Scope> scope);
+    Value Call(ValueSpan args);
 };
 
 class Subtract : public Function {
 public:
-    std::shared_ptr<Object> Apply(std::vector<std::shared_ptr<Object>> &args,
-                                  std::shared_ptr<Scope> scope);
+    Value Call(ValueSpan args);
 };
 
 class Divide : public Function {
 public:
-    std::shared_ptr<Object> Apply(std::vector<std::shared_ptr<Object>> &args,
-                                  std::shared_ptr<Scope> scope);
+    Value Call(ValueSpan args);
 };
 
 class Not : public Function {
 public:
-    std::shared_ptr<Object> Apply(std::vector<std::shared_ptr<Object>> &args,
-                                  std::shared_ptr<Scope> scope);
+    Value Call(ValueSpan args);
 };
 
 /***********************************************************
@@ -202,38 +753,32 @@ public:
 
 class QNull : public Function {
 public:
-    std::shared_ptr<Object> Apply(std::vector<std::shared_ptr<Object>> &args,
-                                  std::shared_ptr<Scope> scope);
+    Value Call(ValueSpan args);
 };
 
 class QPair : public Function {
 public:
-    std::shared_ptr<Object> Apply(std::vector<std::shared_ptr<Object>> &args,
-                                  std::shared_ptr<Scope> scope);
+    Value Call(ValueSpan args);
 };
 
 class QList : public Function {
 public:
-    std::shared_ptr<Object> Apply(std::vector<std::shared_ptr<Object>> &args,
-                                  std::shared_ptr<Scope> scope);
+    Value Call(ValueSpan args);
 };
 
 class QNumber : public Function {
 public:
-    std::shared_ptr<Object> Apply(std::vector<std::shared_ptr<Object>> &args,
-                                  std::shared_ptr<Scope> scope);
+    Value Call(ValueSpan args);
 };
 
 class QBoolean : public Function {
 public:
-    std::shared_ptr<Object> Apply(std::vector<std::shared_ptr<Object>> &args,
-                                  std::shared_ptr<Scope> scope);
+    Value Call(ValueSpan args);
 };
 
 class QSymbol : public Function {
 public:
-    std::shared_ptr<Object> Apply(std::vector<std::shared_ptr<Object>> &args,
-                                  std::shared_ptr<Scope> scope);
+    Value Call(ValueSpan args);
 };
 
 /***********************************************************
@@ -242,32 +787,27 @@ public:
 
 class Less : public Function {
 public:
-    std::shared_ptr<Object> Apply(std::vector<std::shared_ptr<Object>> &args,
-                                  std::shared_ptr<Scope> scope);
+    Value Call(ValueSpan args);
 };
 
 class LessEq : public Function {
 public:
-    std::shared_ptr<Object> Apply(std::vector<std::shared_ptr<Object>> &args,
-                                  std::shared_ptr<Scope> scope);
+    Value Call(ValueSpan args);
 };
 
 class More : public Function {
 public:
-    std::shared_ptr<Object> Apply(std::vector<std::shared_ptr<Object>> &args,
-                                  std::shared_ptr<Scope> scope);
+    Value Call(ValueSpan args);
 };
 
 class MoreEq : public Function {
 public:
-    std::shared_ptr<Object> Apply(std::vector<std::shared_ptr<Object>> &args,
-                                  std::shared_ptr<Scope> scope);
+    Value Call(ValueSpan args);
 };
 
 class Eq : public Function {
 public:
-    std::shared_ptr<Object> Apply(std::vector<std::shared_ptr<Object>> &args,
-                                  std::shared_ptr<Scope> scope);
+    Value Call(ValueSpan args);
 };
 
 /***********************************************************
@@ -276,47 +816,133 @@ public:
 
 class And : public Function {
 public:
-    std::shared_ptr<Object> Apply(std::vector<std::shared_ptr<Object>> &args,
-                                  std::shared_ptr<Scope> scope);
+    static constexpr ObjectType kType = ObjectType::AND;
+
+    And();
+
+    Value Apply(ValueSpan args, const std::shared_ptr<Scope> &scope);
+
+    // Вычисляет все аргументы, кроме последнего. Если ответ уже известен,
+    // кладёт его в result и возвращает true; иначе ответ - значение args.back().
+    bool EvalPrefix(ValueSpan args, const std::shared_ptr<Scope> &scope, Value *result);
+
+    Value Call(ValueSpan args);
 };
 
 class Or : public Function {
 public:
-    std::shared_ptr<Object> Apply(std::vector<std::shared_ptr<Object>> &args,
-                                  std::shared_ptr<Scope> scope);
+    static constexpr ObjectType kType = ObjectType::OR;
+
+    Or();
+
+    Value Apply(ValueSpan args, const std::shared_ptr<Scope> &scope);
+
+    bool EvalPrefix(ValueSpan args, const std::shared_ptr<Scope> &scope, Value *result);
+
+    Value Call(ValueSpan args);
 };
 
 class Syntax : public Object {
 public:
-    virtual std::shared_ptr<Object> Apply(std::vector<std::shared_ptr<Object>> &args,
-                                          std::shared_ptr<Scope> scope) = 0;
+    explicit Syntax(ObjectType type = ObjectType::SYNTAX);
 
-    bool IsSyntax();
+    virtual Value Apply(ValueSpan args, const std::shared_ptr<Scope> &scope) = 0;
 };
 
 /***********************************************************
  ***********************************************************
  ***********************************************************/
 
-bool IsNumber(const std::shared_ptr<Object> &obj);
+// Приведение Value к классу T по тегу объекта; nullptr для целых,
+// пустого списка и объектов других классов.
+template <class T>
+T *DynamicCast(const Value &value) {
+    auto object = value.GetObject();
+    return object && object->GetType() == T::kType ? static_cast<T *>(object) : nullptr;
+}
+
+bool IsNumber(const Value &obj);
+
+// Целое из Value: и непосредственное, и из Number в куче.
+int64_t AsNumber(const Value &obj);
+
+// Небольшие целые не выделяют память.
+Value MakeNumber(int64_t value);
+
+bool IsCell(const Value &obj);
+
+Cell *AsCell(const Value &obj);
+
+bool IsSymbol(const Value &obj);
+
+Symbol *AsSymbol(const Value &obj);
+
+// Символы, с которыми reader и особые формы сравнивают по указателю.
+// ")" и "." reader возвращает вместо скобки и точки.
+extern Symbol *const kQuoteSymbol;
+extern Symbol *const kTrueSymbol;
+extern Symbol *const kFalseSymbol;
+extern Symbol *const kCloseBracketSymbol;
+extern Symbol *const kDotSymbol;
+
+// #t и #f существуют в единственном экземпляре, пустой список - nullptr,
+// так что предикаты ничего не выделяют.
+Value ToBoolean(bool value);
+
+// Ограничение по умолчанию на вложенность списков в reader, кадров VM
+// и вложенных вычислений обходчика дерева.
+const size_t kDefaultMaxDepth = 10000;
+
+// Читает одну форму. Незаконченные списки лежат в явном стеке, так что
+// глубина вложенности ограничена max_depth (RuntimeError), а не стеком C++.
+Value Read(Tokenizer *tokenizer, size_t max_depth = kDefaultMaxDepth);
 
-std::shared_ptr<Number> AsNumber(const std::shared_ptr<Object> &obj);
+// То же по буферу: лексемы не копируются, строка создаётся только для
+// ещё не интернированного символа.
+Value Read(BufferTokenizer *tokenizer, size_t max_depth = kDefaultMaxDepth);
 
-bool IsCell(const std::shared_ptr<Object> &obj);
+// Лексемы Tokenizer в виде TokenView. Имя символа копируется в name_
+// и живёт до следующей лексемы, чего reader достаточно.
+// В ленивом режиме Next лишь откладывает чтение следующей лексемы
+// до первого обращения к ней.
+class StreamTokens {
+public:
+    StreamTokens(Tokenizer *tokenizer, bool lazy = false);
+
+    bool IsEnd();
+
+    void Next();
+
+    TokenView GetToken();
+
+private:
+    void Advance();
 
-std::shared_ptr<Cell> AsCell(const std::shared_ptr<Object> &obj);
+    Tokenizer *tokenizer_;
+    bool lazy_;
+    bool pending_next_ = false;
+    std::string name_;
+};
 
-bool IsSymbol(const std::shared_ptr<Object> &obj);
+// Читает формы из потока по одной. В отличие от Read(Tokenizer *), не
+// заглядывает за конец формы: из канала это ждало бы прихода следующей.
+class FormReader {
+public:
+    explicit FormReader(std::istream *in);
 
-std::shared_ptr<Symbol> AsSymbol(const std::shared_ptr<Object> &obj);
+    FormReader(const FormReader &) = delete;
 
-std::shared_ptr<Object> ReadList(Tokenizer *tokenizer);
+    FormReader &operator=(const FormReader &) = delete;
 
-std::shared_ptr<Object> Read(Tokenizer *tokenizer);
+    // Ждёт следующую лексему; true, если поток кончился.
+    bool IsEnd();
 
-std::shared_ptr<Object> ReadList(Tokenizer *tokenizer);
+    Value Read(size_t max_depth = kDefaultMaxDepth);
 
-std::vector<std::shared_ptr<Object>> ToVector(std::shared_ptr<Object> head);
+private:
+    Tokenizer tokenizer_;
+    StreamTokens tokens_;
+};
 
 /***********************************************************
  ***********************************************************
@@ -324,90 +950,111 @@ std::vector<std::shared_ptr<Object>> ToVector(std::shared_ptr<Object> head);
 
 class SetCar : public Function {
 public:
-    std::shared_ptr<Object> Apply(std::vector<std::shared_ptr<Object>> &args,
-                                  std::shared_ptr<Scope> scope);
+    Value Call(ValueSpan args);
 };
 
 class SetCdr : public Function {
 public:
-    std::shared_ptr<Object> Apply(std::vector<std::shared_ptr<Object>> &args,
-                                  std::shared_ptr<Scope> scope);
+    Value Call(ValueSpan args);
 };
 
 class Car : public Function {
 public:
-    std::shared_ptr<Object> Apply(std::vector<std::shared_ptr<Object>> &args,
-                                  std::shared_ptr<Scope> scope);
+    Value Call(ValueSpan args);
 };
 
 class Cdr : public Function {
 public:
-    std::shared_ptr<Object> Apply(std::vector<std::shared_ptr<Object>> &args,
-                                  std::shared_ptr<Scope> scope);
+    Value Call(ValueSpan args);
 };
 
 class Cons : public Function {
 public:
-    std::shared_ptr<Object> Apply(std::vector<std::shared_ptr<Object>> &args,
-                                  std::shared_ptr<Scope> scope);
+    Value Call(ValueSpan args);
 };
 
 class NewList : public Function {
 public:
-    std::shared_ptr<Object> Apply(std::vector<std::shared_ptr<Object>> &args,
-                                  std::shared_ptr<Scope> scope);
+    Value Call(ValueSpan args);
 };
 
 class ListTail : public Function {
 public:
-    std::shared_ptr<Object> Apply(std::vector<std::shared_ptr<Object>> &args,
-                                  std::shared_ptr<Scope> scope);
+    Value Call(ValueSpan args);
 };
 
 class ListRef : public Function {
-    std::shared_ptr<Object> Apply(std::vector<std::shared_ptr<Object>> &args,
-                                  std::shared_ptr<Scope> scope);
+    Value Call(ValueSpan args);
 };
 
 class Lambda : public Function {
 public:
-    Lambda(const std::vector<std::string> &variables,
-            const std::vector<std::shared_ptr<Object>> &body,
+    static constexpr ObjectType kType = ObjectType::LAMBDA;
+
+    // Окружение old_scope не копируется, а захватывается целиком: lambda
+    // видит и define, сделанные в нём после её создания, в том числе себя.
+    Lambda(std::shared_ptr<const std::vector<std::string>> variables,
+            const std::vector<Value> &body,
             std::shared_ptr<Scope> old_scope);
 
-    bool IsLambda();
+    // Вызовы в хвостовой позиции тела не растят стек C++.
+    Value Call(ValueSpan args);
 
-    std::shared_ptr<Object> Apply(std::vector<std::shared_ptr<Object>> &args,
-                                  std::shared_ptr<Scope> scope);
+    // Создаёт кадр вызова с вычисленными аргументами.
+    std::shared_ptr<Scope> BindArguments(ValueSpan args);
 
-    void InsertMeToScope(const std::string &var);
+    void Trace(Heap *heap);
+
+    const std::shared_ptr<const std::vector<std::string>> &GetVariables() const;
+
+    std::shared_ptr<Scope> GetScope() const;
+
+    const std::vector<Value> &GetBody() const;
+
+    // Байткод тела, nullptr пока функция не была скомпилирована.
+    std::shared_ptr<Code> GetCode() const;
+
+    void SetCode(std::shared_ptr<Code> code);
 private:
-    std::vector<std::string> defined_variables_;
-    std::vector<std::shared_ptr<Object>> body_of_function_;
+    friend class ImageReader;
+
+    std::shared_ptr<const std::vector<std::string>> defined_variables_;
+    std::vector<Value> body_of_function_;
     std::shared_ptr<Scope> my_scope_;
+    std::shared_ptr<Code> code_;
 };
 
 class CreateLambda : public Syntax {
-    std::shared_ptr<Object> Apply(std::vector<std::shared_ptr<Object>> &args,
-                                  std::shared_ptr<Scope> scope);
+    Value Apply(ValueSpan args, const std::shared_ptr<Scope> &scope);
 };
 
 class Define : public Syntax {
 public:
-    std::shared_ptr<Object> Apply(std::vector<std::shared_ptr<Object>> &args,
-                                  std::shared_ptr<Scope> scope);
+    Value Apply(ValueSpan args, const std::shared_ptr<Scope> &scope);
 };
 
 class If : public Syntax {
 public:
-    std::shared_ptr<Object> Apply(std::vector<std::shared_ptr<Object>> &args,
-                                  std::shared_ptr<Scope> scope);
+    static constexpr ObjectType kType = ObjectType::IF;
+
+    If();
+
+    Value Apply(ValueSpan args, const std::shared_ptr<Scope> &scope);
+
+    // Вычисляет условие и возвращает ветку, которую осталось вычислить.
+    Value Branch(ValueSpan args, const std::shared_ptr<Scope> &scope);
 };
 
 class Set : public Syntax {
 public:
-    std::shared_ptr<Object> Apply(std::vector<std::shared_ptr<Object>> &args,
-                                  std::shared_ptr<Scope> scope);
+    Value Apply(ValueSpan args, const std::shared_ptr<Scope> &scope);
 };
 
-std::string PrintTo(const std::shared_ptr<Object> &obj);
\ No newline at end of file
+std::string PrintTo(const Value &obj);
+
+// Дописывает печатное представление obj в out; глубина вложенности
+// не ограничена стеком.
+void PrintTo(const Value &obj, std::string *out);
+
+// Печатает obj в поток кусками, не собирая весь результат в одну строку.
+void PrintTo(const Value &obj, std::ostream *out);
\ No newline at end of file
@@ -0,0 +1,136 @@
+#include <algorithm>
+#include <atomic>
+#include <future>
+#include <mutex>
+#include <string>
+#include <string_view>
+#include <thread>
+#include <utility>
+#include <vector>
+
+#include <pool.h>
+
+const size_t kPoolQueueCapacity = 4096;
+
+// Ошибку из EvalResult бросает тем же типом, что и Interpret.
+[[noreturn]] void ThrowEvalError(const EvalResult &result) {
+    switch (result.error_) {
+        case ErrorKind::SYNTAX:
+            throw SyntaxError(result.output_);
+        case ErrorKind::NAME:
+            throw NameError(result.output_);
+        default:
+            throw RuntimeError(result.output_);
+    }
+}
+
+InterpreterPool::InterpreterPool(size_t threads, std::string_view prelude, EvalMode mode)
+        : queue_(kPoolQueueCapacity) {
+    if (!threads) {
+        threads = std::max<size_t>(std::thread::hardware_concurrency(), 1);
+    }
+    std::vector<std::promise<void>> ready(threads);
+    threads_.reserve(threads);
+    for (auto &promise : ready) {
+        threads_.emplace_back(&InterpreterPool::Work, this, prelude, mode, &promise);
+    }
+    try {
+        for (auto &promise : ready) {
+            promise.get_future().get();
+        }
+    } catch (...) {
+        Stop();
+        throw;
+    }
+}
+
+InterpreterPool::~InterpreterPool() {
+    Stop();
+}
+
+std::future<EvalResult> InterpreterPool::Submit(std::string source) {
+    Job job{std::move(source), {}};
+    auto result = job.result_.get_future();
+    while (!queue_.TryPush(std::move(job))) {
+        std::this_thread::yield();
+    }
+    // пара к fetch_add в Work: либо поток увидит задание, либо мы - что он спит
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+    if (sleeping_.load(std::memory_order_relaxed)) {
+        std::lock_guard<std::mutex> lock(mutex_);
+        wake_.notify_one();
+    }
+    return result;
+}
+
+size_t InterpreterPool::GetThreadCount() const {
+    return threads_.size();
+}
+
+void InterpreterPool::Work(std::string_view prelude, EvalMode mode, std::promise<void> *ready) {
+    Scheme scheme;
+    scheme.SetEvalMode(mode);
+    std::vector<EvalResult> results;
+    try {
+        scheme.InterpretBatch(prelude, &results);
+        for (auto &result : results) {
+            if (result.error_ != ErrorKind::NONE) {
+                ThrowEvalError(result);
+            }
+        }
+    } catch (...) {
+        ready->set_exception(std::current_exception());
+        return;
+    }
+    auto snapshot = scheme.Snapshot();
+    // ready живёт в конструкторе только до этого момента
+    ready->set_value();
+
+    std::vector<std::string> sources(1);
+    Job job;
+    auto run = [&] {
+        sources[0] = std::move(job.source_);
+        try {
+            scheme.InterpretBatch(sources, &results);
+            job.result_.set_value(std::move(results[0]));
+        } catch (...) {
+            // ошибки Scheme уже в итоге; здесь, например, bad_alloc
+            job.result_.set_exception(std::current_exception());
+        }
+        scheme.Restore(snapshot);
+    };
+    while (true) {
+        if (queue_.TryPop(&job)) {
+            run();
+            continue;
+        }
+        std::unique_lock<std::mutex> lock(mutex_);
+        sleeping_.fetch_add(1, std::memory_order_relaxed);
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+        // задания, принятые до Stop, доделываются
+        if (queue_.TryPop(&job)) {
+            sleeping_.fetch_sub(1, std::memory_order_relaxed);
+            lock.unlock();
+            run();
+            continue;
+        }
+        if (stop_.load(std::memory_order_relaxed)) {
+            sleeping_.fetch_sub(1, std::memory_order_relaxed);
+            return;
+        }
+        wake_.wait(lock);
+        sleeping_.fetch_sub(1, std::memory_order_relaxed);
+    }
+}
+
+void InterpreterPool::Stop() {
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        stop_.store(true, std::memory_order_relaxed);
+        wake_.notify_all();
+    }
+    for (auto &thread : threads_) {
+        thread.join();
+    }
+    threads_.clear();
+}
@@ -0,0 +1,142 @@
+#pragma once
+
+#include <atomic>
+#include <condition_variable>
+#include <cstddef>
+#include <future>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <string_view>
+#include <thread>
+#include <vector>
+
+#include "scheme.h"
+
+// Ограниченная очередь без блокировок для многих писателей и читателей
+// (Вьюков): у каждой ячейки свой номер хода, и писатели с читателями
+// занимают ячейки сдвигом head_ и tail_ через compare_exchange.
+template <class T>
+class MpmcQueue {
+public:
+    // Ёмкость округляется вверх до степени двойки.
+    explicit MpmcQueue(size_t capacity) {
+        size_t size = 2;
+        while (size < capacity) {
+            size *= 2;
+        }
+        slots_ = std::make_unique<Slot[]>(size);
+        for (size_t i = 0; i < size; ++i) {
+            slots_[i].sequence_.store(i, std::memory_order_relaxed);
+        }
+        mask_ = size - 1;
+    }
+
+    MpmcQueue(const MpmcQueue &) = delete;
+
+    MpmcQueue &operator=(const MpmcQueue &) = delete;
+
+    // false, если очередь полна.
+    bool TryPush(T &&value) {
+        auto position = head_.load(std::memory_order_relaxed);
+        while (true) {
+            auto &slot = slots_[position & mask_];
+            auto sequence = slot.sequence_.load(std::memory_order_acquire);
+            auto diff = static_cast<std::ptrdiff_t>(sequence - position);
+            if (diff == 0) {
+                if (head_.compare_exchange_weak(position, position + 1,
+                                                std::memory_order_relaxed)) {
+                    slot.value_ = std::move(value);
+                    slot.sequence_.store(position + 1, std::memory_order_release);
+                    return true;
+                }
+            } else if (diff < 0) {
+                return false;
+            } else {
+                position = head_.load(std::memory_order_relaxed);
+            }
+        }
+    }
+
+    // false, если очередь пуста.
+    bool TryPop(T *value) {
+        auto position = tail_.load(std::memory_order_relaxed);
+        while (true) {
+            auto &slot = slots_[position & mask_];
+            auto sequence = slot.sequence_.load(std::memory_order_acquire);
+            auto diff = static_cast<std::ptrdiff_t>(sequence - (position + 1));
+            if (diff == 0) {
+                if (tail_.compare_exchange_weak(position, position + 1,
+                                                std::memory_order_relaxed)) {
+                    *value = std::move(slot.value_);
+                    slot.sequence_.store(position + mask_ + 1, std::memory_order_release);
+                    return true;
+                }
+            } else if (diff < 0) {
+                return false;
+            } else {
+                position = tail_.load(std::memory_order_relaxed);
+            }
+        }
+    }
+
+private:
+    struct Slot {
+        std::atomic<size_t> sequence_;
+        T value_;
+    };
+
+    std::unique_ptr<Slot[]> slots_;
+    size_t mask_;
+    // писатели и читатели не делят строку кэша
+    alignas(64) std::atomic<size_t> head_{0};
+    alignas(64) std::atomic<size_t> tail_{0};
+};
+
+// N независимых интерпретаторов, каждый на своём потоке. Scheme создаётся,
+// используется и уничтожается только своим потоком, так что общего между
+// потоками - лишь то, что Scheme и так делит между интерпретаторами
+// (см. scheme.h). Задания - исходный текст одной формы - приходят через
+// MpmcQueue и достаются любому свободному потоку. Каждое задание начинается
+// с одного и того же окружения: после prelude поток делает Snapshot
+// и после каждого задания возвращается к нему, поэтому define и set!
+// одного задания не видны другим, на каком бы потоке они ни шли.
+class InterpreterPool {
+public:
+    // threads == 0 - по числу ядер. Ошибка в prelude бросается отсюда
+    // тем же исключением, что бросил бы Interpret.
+    explicit InterpreterPool(size_t threads = 0, std::string_view prelude = {},
+                             EvalMode mode = EvalMode::BYTECODE);
+
+    InterpreterPool(const InterpreterPool &) = delete;
+
+    InterpreterPool &operator=(const InterpreterPool &) = delete;
+
+    // Дожидается всех уже принятых заданий.
+    ~InterpreterPool();
+
+    // Итог как у элемента InterpretBatch: значение или текст ошибки.
+    // Можно звать из любого числа потоков; если очередь полна, ждёт места.
+    std::future<EvalResult> Submit(std::string source);
+
+    size_t GetThreadCount() const;
+
+private:
+    struct Job {
+        std::string source_;
+        std::promise<EvalResult> result_;
+    };
+
+    void Work(std::string_view prelude, EvalMode mode, std::promise<void> *ready);
+
+    void Stop();
+
+    MpmcQueue<Job> queue_;
+    std::vector<std::thread> threads_;
+    // свободные потоки спят на wake_; sleeping_ позволяет Submit
+    // не брать mutex_, когда все заняты
+    std::atomic<size_t> sleeping_{0};
+    std::atomic<bool> stop_{false};
+    std::mutex mutex_;
+    std::condition_variable wake_;
+};
@@ -1,26 +1,274 @@
 #include "scheme.h"
+#include "heap.cpp"
 #include "parser.cpp"
+#include "compiler.cpp"
+#include "vm.cpp"
+#include "image.cpp"
+#include "pool.cpp"
+#include "buffer_tokenizer.cpp"
 #include "tokenizer.h"
 
-Scheme::Scheme() : global_scope_(std::make_shared<Scope>()), tokenizer_(Tokenizer()) {
+#include <fstream>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+// Файл, отображённый в память только для чтения.
+class MappedFile {
+public:
+    explicit MappedFile(const std::string &path) {
+        int fd = open(path.c_str(), O_RDONLY);
+        if (fd < 0) {
+            throw RuntimeError("Не удалось открыть файл " + path);
+        }
+        struct stat info;
+        if (fstat(fd, &info) != 0) {
+            close(fd);
+            throw RuntimeError("Не удалось прочитать файл " + path);
+        }
+        size_ = info.st_size;
+        // пустой файл отобразить нельзя, он и не нужен
+        if (size_) {
+            data_ = mmap(nullptr, size_, PROT_READ, MAP_PRIVATE, fd, 0);
+        }
+        close(fd);
+        if (data_ == MAP_FAILED) {
+            throw RuntimeError("Не удалось прочитать файл " + path);
+        }
+        if (size_) {
+            // файл читается один раз от начала до конца
+            madvise(data_, size_, MADV_SEQUENTIAL | MADV_WILLNEED);
+        }
+    }
+
+    MappedFile(const MappedFile &) = delete;
+
+    MappedFile &operator=(const MappedFile &) = delete;
+
+    ~MappedFile() {
+        if (size_) {
+            munmap(data_, size_);
+        }
+    }
+
+    std::string_view GetData() const {
+        return std::string_view(static_cast<const char *>(data_), size_);
+    }
+
+private:
+    void *data_ = nullptr;
+    size_t size_ = 0;
+};
+
+Scheme::Scheme() : tokenizer_(Tokenizer()), read_buffer_(false), mode_(EvalMode::BYTECODE),
+                   optimize_(true), max_depth_(kDefaultMaxDepth), vm_(&heap_) {
+    HeapContext context(&heap_);
+    global_scope_ = std::make_shared<Scope>(&journal_);
+    heap_.AddRoots(this);
+}
+
+Scheme::~Scheme() {
+    heap_.RemoveRoots(this);
+}
+
+void Scheme::TraceRoots(Heap *heap) {
+    global_scope_->Trace(heap);
+    journal_.Trace(heap);
+    eval_stack_.Trace(heap);
 }
 
 void Scheme::Clear() {
     global_scope_->Clear();
 }
 
+EnvSnapshot Scheme::Snapshot() {
+    return {this, journal_.TakeSnapshot()};
+}
+
+void Scheme::Restore(const EnvSnapshot &snapshot) {
+    HeapContext context(&heap_);
+    if (snapshot.owner_ != this || !journal_.RollBack(snapshot.id_)) {
+        throw RuntimeError("Снимок окружения недействителен");
+    }
+    // ячейка могла снова стать неопределённой
+    global_scope_->InvalidateCallSites();
+}
+
 void Scheme::SetTokenizer(std::stringstream *in) {
     tokenizer_ = Tokenizer(in);
+    read_buffer_ = false;
+}
+
+void Scheme::SetSource(std::string_view source) {
+    buffer_tokenizer_ = BufferTokenizer(source);
+    read_buffer_ = true;
+}
+
+void Scheme::SetEvalMode(EvalMode mode) {
+    mode_ = mode;
+}
+
+void Scheme::SetOptimization(bool enabled) {
+    optimize_ = enabled;
+    vm_.SetOptimization(enabled);
+}
+
+void Scheme::SetMaxDepth(size_t depth) {
+    max_depth_ = depth;
+    vm_.SetMaxDepth(depth);
 }
 
 std::string Scheme::Interpret() {
-    auto result = Read(&tokenizer_);
-    if (!result) {
+    HeapContext context(&heap_);
+    heap_.Safepoint();
+    auto result = read_buffer_ ? Read(&buffer_tokenizer_, max_depth_) : Read(&tokenizer_, max_depth_);
+    if (read_buffer_ ? !buffer_tokenizer_.IsEnd() : !tokenizer_.IsEnd()) {
+        throw SyntaxError("Должен быть конец ввода");
+    }
+    return PrintTo(Evaluate(result));
+}
+
+std::string Scheme::LoadFile(const std::string &path) {
+    MappedFile file(path);
+    BufferTokenizer tokenizer(file.GetData());
+    HeapContext context(&heap_);
+    std::string result;
+    while (!tokenizer.IsEnd()) {
+        heap_.Safepoint();
+        auto value = Evaluate(Read(&tokenizer, max_depth_));
+        // печатать промежуточные результаты незачем
+        if (tokenizer.IsEnd()) {
+            result = PrintTo(value);
+        }
+    }
+    return result;
+}
+
+void Scheme::SaveImage(const std::string &path) {
+    auto image = ImageWriter(global_scope_.get()).Write();
+    std::ofstream out(path, std::ios::binary | std::ios::trunc);
+    out.write(image.data(), image.size());
+    out.close();
+    if (!out) {
+        throw RuntimeError("Не удалось записать файл " + path);
+    }
+}
+
+void Scheme::LoadImage(const std::string &path) {
+    MappedFile file(path);
+    HeapContext context(&heap_);
+    ImageReader(file.GetData(), global_scope_).Read();
+}
+
+void Scheme::InterpretStream(std::istream *in, std::ostream *out) {
+    FormReader reader(in);
+    HeapContext context(&heap_);
+    while (true) {
+        heap_.Safepoint();
+        if (reader.IsEnd()) {
+            return;
+        }
+        PrintTo(Evaluate(reader.Read(max_depth_)), out);
+        *out << std::endl;
+    }
+}
+
+void Scheme::InterpretBatch(const std::vector<std::string> &sources,
+                            std::vector<EvalResult> *results) {
+    results->resize(sources.size());
+    HeapContext context(&heap_);
+    for (size_t i = 0; i < sources.size(); ++i) {
+        BufferTokenizer tokenizer;
+        auto &result = (*results)[i];
+        try {
+            tokenizer = BufferTokenizer(sources[i]);
+        } catch (const SyntaxError &error) {
+            result.error_ = ErrorKind::SYNTAX;
+            result.output_ = error.what();
+            continue;
+        }
+        EvaluateInto(&tokenizer, true, &result);
+    }
+}
+
+void Scheme::InterpretBatch(std::string_view source, std::vector<EvalResult> *results) {
+    results->clear();
+    HeapContext context(&heap_);
+    BufferTokenizer tokenizer;
+    try {
+        tokenizer = BufferTokenizer(source);
+    } catch (const SyntaxError &error) {
+        results->push_back({ErrorKind::SYNTAX, error.what()});
+        return;
+    }
+    while (!tokenizer.IsEnd()) {
+        results->emplace_back();
+        if (!EvaluateInto(&tokenizer, false, &results->back())) {
+            return;
+        }
+    }
+}
+
+bool Scheme::EvaluateInto(BufferTokenizer *tokenizer, bool whole_source, EvalResult *result) {
+    try {
+        heap_.Safepoint();
+        auto form = Read(tokenizer, max_depth_);
+        if (whole_source && !tokenizer->IsEnd()) {
+            throw SyntaxError("Должен быть конец ввода");
+        }
+        auto value = Evaluate(form);
+        // строка итога переиспользуется между пакетами
+        result->output_.clear();
+        PrintTo(value, &result->output_);
+        result->error_ = ErrorKind::NONE;
+    } catch (const SyntaxError &error) {
+        result->error_ = ErrorKind::SYNTAX;
+        result->output_ = error.what();
+        return false;
+    } catch (const NameError &error) {
+        result->error_ = ErrorKind::NAME;
+        result->output_ = error.what();
+    } catch (const RuntimeError &error) {
+        result->error_ = ErrorKind::RUNTIME;
+        result->output_ = error.what();
+    }
+    return true;
+}
+
+Value Scheme::Evaluate(Value form) {
+    if (!form) {
         throw RuntimeError("нельзя звать eval от пустого списка");
     }
-    if (!tokenizer_.IsEnd()) {
-        throw SyntaxError("Должен быть конец ввода");
+    EvalStackContext context(&eval_stack_);
+    if (mode_ == EvalMode::BYTECODE) {
+        return vm_.Run(Compile(form, global_scope_.get(), optimize_), global_scope_);
     }
-    result = result->Eval(global_scope_);
-    return PrintTo(result);
+    EvalDepthGuard::SetLimit(max_depth_);
+    return form.Eval(global_scope_);
+}
+
+size_t Scheme::InternTableSize() {
+    return Symbol::InternTableSize();
+}
+
+CallSiteStats Scheme::GetCallSiteStats() {
+    return ::GetCallSiteStats();
+}
+
+void Scheme::ResetCallSiteStats() {
+    ::GetCallSiteStats() = CallSiteStats();
+}
+
+void Scheme::CollectGarbage() {
+    heap_.Collect();
+}
+
+void Scheme::SetGcStressMode(bool enabled) {
+    heap_.SetStressMode(enabled);
+}
+
+size_t Scheme::GetHeapObjectCount() const {
+    return heap_.GetObjectCount();
 }
\ No newline at end of file
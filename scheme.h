@@ -1,20 +1,168 @@
 #pragma once
 
+#include <istream>
+#include <ostream>
 #include <sstream>
+#include <string>
 #include <memory>
+#include <string_view>
+#include <vector>
+#include "heap.h"
+#include "image.h"
 #include "parser.h"
+#include "vm.h"
 
-class Scheme {
+enum class EvalMode {
+    BYTECODE,   // компиляция в байткод и исполнение на VirtualMachine
+    TREE_WALK   // прямой обход дерева через Cell::Eval, для сравнения
+};
+
+enum class ErrorKind {
+    NONE,
+    SYNTAX,     // SyntaxError
+    NAME,       // NameError
+    RUNTIME     // RuntimeError
+};
+
+// Итог одного элемента пакета: напечатанное значение или текст ошибки.
+struct EvalResult {
+    ErrorKind error_ = ErrorKind::NONE;
+    std::string output_;
+};
+
+class Scheme;
+
+// Состояние глобальных переменных, к которому можно вернуться через Restore.
+struct EnvSnapshot {
+    const Scheme *owner_ = nullptr;
+    size_t id_ = 0;
+};
+
+// Каждый интерпретатор владеет своей кучей; глобальная область - её корень.
+// Потоки: интерпретатор не потокобезопасен, в каждый момент его методы
+// зовёт не больше одного потока. Передать его другому потоку можно между
+// вызовами, если передача синхронизирована (mutex, future): текущие куча
+// и стек вычисления выставляются на время каждого вызова, а глубина
+// вложенности к концу вызова возвращается к нулю. Разные интерпретаторы
+// работают в разных потоках одновременно: общие у них только таблица
+// символов (под mutex) и неизменяемая таблица встроенных функций; версия
+// ячеек для кэшей вызовов у каждой глобальной области своя. Значения одного
+// интерпретатора в другой передавать нельзя - только текст.
+// Пул интерпретаторов по одному на поток - InterpreterPool из pool.h.
+class Scheme : private RootSet {
 public:
     Scheme();
 
+    Scheme(const Scheme &) = delete;
+
+    Scheme &operator=(const Scheme &) = delete;
+
+    ~Scheme();
+
     void Clear();
 
+    // Снимок глобального окружения за O(1): ничего не копируется, а define
+    // и set! глобальной переменной после снимка сохраняют её прежнее значение,
+    // а первый set! в кадре замыкания - весь кадр.
+    // Так каждый запрос может начинаться с одного и того же подготовленного
+    // окружения без повторного вычисления библиотеки.
+    EnvSnapshot Snapshot();
+
+    // Возвращает к снимку глобальные переменные и переменные кадров, которые
+    // замыкания захватили до снимка; снимок можно восстанавливать снова,
+    // более поздние снимки пропадают. Изменения списков через
+    // set-car!/set-cdr! не откатываются. RuntimeError, если снимок чужой
+    // или пропал (после Clear или отката к более раннему).
+    void Restore(const EnvSnapshot &snapshot);
+
     void SetTokenizer(std::stringstream *in);
 
+    // Читать формы прямо из буфера, без std::istream. Буфер не копируется
+    // и должен жить, пока из него читают.
+    void SetSource(std::string_view source);
+
+    void SetEvalMode(EvalMode mode);
+
+    // Сворачивание констант и подстановка встроенных функций в байткоде.
+    // Включено по умолчанию; действует на то, что компилируется после вызова.
+    void SetOptimization(bool enabled);
+
+    // Предел вложенности списков при чтении и вложенности вызовов
+    // при вычислении; глубже - RuntimeError. Компилятор и обходчик дерева
+    // рекурсивны, поэтому для них предел ещё и ограничен стеком C++ потока:
+    // когда в нём остаётся меньше kNativeStackReserve, тоже RuntimeError.
+    void SetMaxDepth(size_t depth);
+
     std::string Interpret();
 
+    // Вычисляет по порядку все формы файла и возвращает результат последней.
+    // Файл отображается в память и читается без копирования.
+    std::string LoadFile(const std::string &path);
+
+    // Сохраняет глобальные переменные со всем, на что они ссылаются, в файл
+    // образа. Загрузить образ быстрее, чем заново вычислить формы библиотеки.
+    void SaveImage(const std::string &path);
+
+    // Определяет глобальные переменные из образа SaveImage, как define.
+    // Файл отображается в память. RuntimeError, если образ повреждён
+    // или записан другой версией интерпретатора.
+    void LoadImage(const std::string &path);
+
+    // Читает и вычисляет формы из in по одной, пока он не кончится, и пишет
+    // результат каждой в out отдельной строкой сразу после вычисления.
+    // В памяти только текущая форма, так что поток может быть бесконечным.
+    // Ошибка прерывает чтение; повторный вызов продолжит со следующей лексемы.
+    void InterpretStream(std::istream *in, std::ostream *out);
+
+    // Вычисляет пакет запросов в общей глобальной области. Каждая строка -
+    // одна форма, как у Interpret; results получает по итогу на строку.
+    // Ошибка одного запроса записывается в его итог и не мешает остальным.
+    // results можно переиспользовать между пакетами.
+    void InterpretBatch(const std::vector<std::string> &sources,
+                        std::vector<EvalResult> *results);
+
+    // То же для буфера из многих форм: по итогу на форму. После
+    // синтаксической ошибки границы форм неизвестны, и чтение прекращается.
+    void InterpretBatch(std::string_view source, std::vector<EvalResult> *results);
+
+    // Размер общей на процесс таблицы интернированных символов.
+    static size_t InternTableSize();
+
+    // Попадания и промахи кэшей вызовов обходчика дерева. Счётчики свои
+    // у каждого потока и общие для всех интерпретаторов в нём.
+    static CallSiteStats GetCallSiteStats();
+
+    static void ResetCallSiteStats();
+
+    // Немедленная сборка мусора.
+    void CollectGarbage();
+
+    // Собирать мусор в каждой безопасной точке, чтобы ловить
+    // неучтённые корни. Очень медленно, только для тестов.
+    void SetGcStressMode(bool enabled);
+
+    // Число живых (ещё не собранных) объектов в куче.
+    size_t GetHeapObjectCount() const;
+
 private:
+    void TraceRoots(Heap *heap) override;
+
+    Value Evaluate(Value form);
+
+    // Читает из tokenizer и вычисляет одну форму, записывая итог или ошибку
+    // в result. С whole_source форма должна занимать весь ввод.
+    // false - синтаксическая ошибка.
+    bool EvaluateInto(BufferTokenizer *tokenizer, bool whole_source, EvalResult *result);
+
+    Heap heap_;
+    BindingJournal journal_;
     std::shared_ptr<Scope> global_scope_;
     Tokenizer tokenizer_;
+    BufferTokenizer buffer_tokenizer_;
+    bool read_buffer_;
+    EvalMode mode_;
+    bool optimize_;
+    size_t max_depth_;
+    EvalStack eval_stack_;
+    VirtualMachine vm_;
 };
\ No newline at end of file
@@ -0,0 +1,432 @@
+#include <algorithm>
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <filesystem>
+#include <fstream>
+#include <future>
+#include <iostream>
+#include <new>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <utility>
+#include <vector>
+
+#include "pool.h"
+#include "scheme.h"
+
+// Бенчмарки интерпретатора. Собирается отдельно от тестов:
+// g++ -std=c++17 -O2 -pthread scheme.cpp tokenizer.cpp scheme_benchmark.cpp
+
+// Все выделения памяти в процессе проходят через этот счётчик.
+// Он свой у каждого потока, чтобы пул интерпретаторов не делил его.
+thread_local size_t allocations = 0;
+
+void *operator new(size_t size) {
+    ++allocations;
+    if (void *ptr = std::malloc(size ? size : 1)) {
+        return ptr;
+    }
+    throw std::bad_alloc();
+}
+
+void operator delete(void *ptr) noexcept {
+    std::free(ptr);
+}
+
+void operator delete(void *ptr, size_t) noexcept {
+    std::free(ptr);
+}
+
+std::string Run(Scheme *scheme, const std::string &expr) {
+    std::stringstream ss(expr);
+    scheme->SetTokenizer(&ss);
+    return scheme->Interpret();
+}
+
+struct Measurement {
+    size_t allocations_;
+    double seconds_;
+};
+
+Measurement Measure(Scheme *scheme, const std::string &expr) {
+    auto allocations_before = allocations;
+    auto start = std::chrono::steady_clock::now();
+    Run(scheme, expr);
+    std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+    return Measurement{allocations - allocations_before, elapsed.count()};
+}
+
+// Два одинаковых цикла, один из которых вдобавок вычисляет (< a b):
+// разница между ними - цена сравнения.
+void BenchComparison() {
+    const int64_t iterations = 100000;
+    Scheme scheme;
+    Run(&scheme, "(define idle (lambda (n a b) (if (= n 0) 0 (idle (- n 1) a b))))");
+    Run(&scheme,
+        "(define compare (lambda (n a b) (< a b) (if (= n 0) 0 (compare (- n 1) a b))))");
+
+    auto count = std::to_string(iterations);
+    // первый прогон растит стеки VM до нужного размера
+    Measure(&scheme, "(idle " + count + " 1 2)");
+    Measure(&scheme, "(compare " + count + " 1 2)");
+    auto idle = Measure(&scheme, "(idle " + count + " 1 2)");
+    auto compare = Measure(&scheme, "(compare " + count + " 1 2)");
+
+    std::cout << "(< a b): "
+              << static_cast<double>(compare.allocations_) / iterations -
+                     static_cast<double>(idle.allocations_) / iterations
+              << " allocations/op, "
+              << (compare.seconds_ - idle.seconds_) / iterations * 1e9 << " ns/op\n";
+}
+
+// Целочисленный цикл: числа живут прямо в Value, куча не нужна.
+// Без оптимизации + и * вызываются как обычные функции.
+void BenchArithmetic() {
+    const int64_t iterations = 100000;
+    for (auto optimize : {true, false}) {
+        Scheme scheme;
+        scheme.SetOptimization(optimize);
+        Run(&scheme,
+            "(define sum (lambda (n acc) (if (= n 0) acc (sum (- n 1) (+ acc (* n 3))))))");
+
+        auto expr = "(sum " + std::to_string(iterations) + " 0)";
+        Measure(&scheme, expr);
+        auto sum = Measure(&scheme, expr);
+
+        std::cout << "integer loop" << (optimize ? "" : " (no inlining)") << ": "
+                  << static_cast<double>(sum.allocations_) / iterations
+                  << " allocations/iteration, " << sum.seconds_ / iterations * 1e9
+                  << " ns/iteration\n";
+    }
+}
+
+// Построение списков через cons: ячейки выделяются в яслях,
+// а не по одной через operator new.
+void BenchListBuilding() {
+    const int64_t length = 1000;
+    const int64_t rounds = 100;
+    Scheme scheme;
+    Run(&scheme, "(define build (lambda (n acc) (if (= n 0) acc (build (- n 1) (cons n acc)))))");
+    Run(&scheme, "(define repeat (lambda (k) (if (= k 0) 0 (begin-round k))))");
+    Run(&scheme, "(define begin-round (lambda (k) (build " + std::to_string(length) +
+                     " '()) (repeat (- k 1))))");
+
+    auto expr = "(repeat " + std::to_string(rounds) + ")";
+    Measure(&scheme, expr);
+    auto build = Measure(&scheme, expr);
+
+    auto cells = static_cast<double>(length * rounds);
+    std::cout << "list building: " << build.allocations_ / cells << " allocations/cell, "
+              << build.seconds_ / cells * 1e9 << " ns/cell\n";
+}
+
+// Обход списка через car и cdr в обоих режимах. Каждый car и cdr
+// проверяет, что аргумент - список или пара, так что обход квадратичен
+// по длине, и почти всё время уходит на проверки типа ячеек.
+void BenchListTraversal() {
+    const int64_t length = 1000;
+    for (auto mode : {EvalMode::BYTECODE, EvalMode::TREE_WALK}) {
+        Scheme scheme;
+        scheme.SetEvalMode(mode);
+        Run(&scheme, "(define (build n acc) (if (= n 0) acc (build (- n 1) (cons n acc))))");
+        Run(&scheme, "(define (sum xs acc) (if (null? xs) acc (sum (cdr xs) (+ acc (car xs)))))");
+        Run(&scheme, "(define xs (build " + std::to_string(length) + " '()))");
+
+        Measure(&scheme, "(sum xs 0)");
+        auto sum = Measure(&scheme, "(sum xs 0)");
+        std::cout << "car/cdr traversal (" << (mode == EvalMode::BYTECODE ? "bytecode" : "tree")
+                  << "): " << sum.seconds_ / length * 1e9 << " ns/element, "
+                  << static_cast<double>(sum.allocations_) / length << " allocations/element\n";
+    }
+}
+
+// Создание замыкания в глобальной области, где кроме встроенных функций
+// определено ещё 200 переменных: цена не должна зависеть от их числа.
+void BenchClosures() {
+    const int64_t iterations = 10000;
+    for (auto mode : {EvalMode::BYTECODE, EvalMode::TREE_WALK}) {
+        Scheme scheme;
+        scheme.SetEvalMode(mode);
+        for (int i = 0; i < 200; ++i) {
+            Run(&scheme, "(define filler" + std::to_string(i) + " " + std::to_string(i) + ")");
+        }
+        Run(&scheme, "(define (id x) x)");
+
+        auto allocations_before = allocations;
+        auto start = std::chrono::steady_clock::now();
+        for (int64_t i = 0; i < iterations; ++i) {
+            Run(&scheme, "(id (lambda (x) x))");
+        }
+        std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+        std::cout << "closures (" << (mode == EvalMode::BYTECODE ? "bytecode" : "tree")
+                  << "): " << elapsed.count() / iterations * 1e9 << " ns/form, "
+                  << static_cast<double>(allocations - allocations_before) / iterations
+                  << " allocations/form\n";
+    }
+}
+
+// Создание интерпретатора на каждый запрос: сам конструктор и он же
+// вместе с вычислением одной короткой формы.
+void BenchConstruction() {
+    const int64_t iterations = 10000;
+    auto allocations_before = allocations;
+    auto start = std::chrono::steady_clock::now();
+    for (int64_t i = 0; i < iterations; ++i) {
+        Scheme scheme;
+    }
+    std::chrono::duration<double> construct = std::chrono::steady_clock::now() - start;
+    auto construct_allocations = allocations - allocations_before;
+
+    start = std::chrono::steady_clock::now();
+    for (int64_t i = 0; i < iterations; ++i) {
+        Scheme scheme;
+        Run(&scheme, "(if (< 1 2) (+ 1 2) (car '(1)))");
+    }
+    std::chrono::duration<double> request = std::chrono::steady_clock::now() - start;
+    std::cout << "Scheme(): " << construct.count() / iterations * 1e9 << " ns, "
+              << static_cast<double>(construct_allocations) / iterations
+              << " allocations; with one request " << request.count() / iterations * 1e9
+              << " ns\n";
+}
+
+// Запрос в изолированном окружении поверх библиотеки из 100 функций:
+// откат к снимку против нового интерпретатора с повторным вычислением
+// библиотеки.
+void BenchSnapshots() {
+    std::vector<std::string> prelude;
+    for (int i = 0; i < 100; ++i) {
+        auto name = "lib" + std::to_string(i);
+        prelude.push_back("(define (" + name + " x) (+ x " + std::to_string(i) + "))");
+    }
+    const std::vector<std::string> request = {"(define state (lib7 1))", "(set! lib3 lib5)",
+                                              "(lib3 state)"};
+    auto load = [](Scheme *scheme, const std::vector<std::string> &forms) {
+        for (auto &form : forms) {
+            Run(scheme, form);
+        }
+    };
+
+    const int64_t iterations = 2000;
+    auto start = std::chrono::steady_clock::now();
+    for (int64_t i = 0; i < iterations; ++i) {
+        Scheme scheme;
+        load(&scheme, prelude);
+        load(&scheme, request);
+    }
+    std::chrono::duration<double> rebuild = std::chrono::steady_clock::now() - start;
+
+    Scheme scheme;
+    load(&scheme, prelude);
+    auto prepared = scheme.Snapshot();
+    start = std::chrono::steady_clock::now();
+    for (int64_t i = 0; i < iterations; ++i) {
+        load(&scheme, request);
+        scheme.Restore(prepared);
+    }
+    std::chrono::duration<double> restore = std::chrono::steady_clock::now() - start;
+    std::cout << "isolated request: new interpreter " << rebuild.count() / iterations * 1e6
+              << " us, snapshot restore " << restore.count() / iterations * 1e6 << " us\n";
+}
+
+// Запуск с библиотекой из 5000 функций: вычисление её исходного текста
+// через LoadFile против загрузки сохранённого образа.
+void BenchImage() {
+    auto directory = std::filesystem::temp_directory_path();
+    auto source_path = (directory / "scheme_benchmark_prelude.scm").string();
+    auto image_path = (directory / "scheme_benchmark_prelude.img").string();
+    {
+        std::ofstream out(source_path);
+        for (int i = 0; i < 5000; ++i) {
+            auto name = "lib" + std::to_string(i);
+            out << "(define (" << name << " xs acc) (if (null? xs) acc (" << name
+                << " (cdr xs) (+ acc (* (car xs) " << i << ")))))\n";
+        }
+        out << "(define table '(1 2 3 4 5 6 7 8 9 10))\n";
+    }
+    {
+        Scheme scheme;
+        scheme.LoadFile(source_path);
+        scheme.SaveImage(image_path);
+    }
+
+    const int iterations = 20;
+    auto start = std::chrono::steady_clock::now();
+    for (int i = 0; i < iterations; ++i) {
+        Scheme scheme;
+        scheme.LoadFile(source_path);
+    }
+    std::chrono::duration<double> source = std::chrono::steady_clock::now() - start;
+
+    start = std::chrono::steady_clock::now();
+    for (int i = 0; i < iterations; ++i) {
+        Scheme scheme;
+        scheme.LoadImage(image_path);
+    }
+    std::chrono::duration<double> image = std::chrono::steady_clock::now() - start;
+    std::cout << "startup with 5000 definitions: source " << source.count() / iterations * 1e3
+              << " ms, image " << image.count() / iterations * 1e3 << " ms ("
+              << std::filesystem::file_size(image_path) / 1024 << " KiB)\n";
+    std::remove(source_path.c_str());
+    std::remove(image_path.c_str());
+}
+
+// Пропускная способность InterpreterPool на рекурсивной задаче без общего
+// состояния: от одного потока до числа ядер.
+void BenchPool() {
+    const int jobs = 256;
+    size_t cores = std::max<size_t>(std::thread::hardware_concurrency(), 1);
+    std::vector<size_t> counts;
+    for (size_t threads = 1; threads < cores; threads *= 2) {
+        counts.push_back(threads);
+    }
+    counts.push_back(cores);
+    double single = 0;
+    for (auto threads : counts) {
+        InterpreterPool pool(threads,
+                             "(define (fib n) (if (< n 2) n (+ (fib (- n 1)) (fib (- n 2)))))");
+        std::vector<std::future<EvalResult>> results;
+        results.reserve(jobs);
+        auto start = std::chrono::steady_clock::now();
+        for (int i = 0; i < jobs; ++i) {
+            results.push_back(pool.Submit("(fib 18)"));
+        }
+        for (auto &result : results) {
+            result.get();
+        }
+        std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+        auto rate = jobs / elapsed.count();
+        if (threads == 1) {
+            single = rate;
+        }
+        std::cout << "pool, " << threads << " threads: " << rate << " jobs/s, speedup "
+                  << rate / single << "\n";
+    }
+}
+
+template <class Tokens>
+size_t CountTokens(Tokens *tokenizer) {
+    size_t count = 0;
+    for (; !tokenizer->IsEnd(); tokenizer->Next()) {
+        tokenizer->GetToken();
+        ++count;
+    }
+    return count;
+}
+
+// Разбор на лексемы одного и того же текста через std::istream и прямо
+// по буферу с каждым из доступных способов поиска границ лексем.
+void BenchTokenizer() {
+    std::string source;
+    while (source.size() < (16 << 20)) {
+        source += "(define (fact-iterative number accumulator)\n"
+                  "        (if (<= number 1)\n"
+                  "            accumulator\n"
+                  "            (fact-iterative (- number 1) (* accumulator number))))\n";
+        source += "'(alpha beta . gamma) -42 +17 #t #f\n";
+    }
+    auto megabytes = static_cast<double>(source.size()) / (1 << 20);
+
+    auto start = std::chrono::steady_clock::now();
+    std::stringstream ss(source);
+    Tokenizer stream(&ss);
+    auto expected = CountTokens(&stream);
+    std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+    std::cout << "tokenizer: istream " << megabytes / elapsed.count() << " MB/s";
+
+    std::pair<CharScanner, const char *> scanners[] = {
+        {CharScanner::SCALAR, "scalar"}, {CharScanner::SSSE3, "ssse3"}, {CharScanner::AVX2, "avx2"}};
+    for (auto [scanner, name] : scanners) {
+        if (!BufferTokenizer::SetCharScanner(scanner)) {
+            continue;
+        }
+        start = std::chrono::steady_clock::now();
+        BufferTokenizer buffer(source);
+        auto tokens = CountTokens(&buffer);
+        elapsed = std::chrono::steady_clock::now() - start;
+        std::cout << ", " << name << " " << megabytes / elapsed.count() << " MB/s";
+        if (tokens != expected) {
+            std::cout << " (" << tokens << " tokens instead of " << expected << ")";
+        }
+    }
+    std::cout << "\n";
+}
+
+// Одни и те же запросы по одному через Interpret и пакетами разного размера.
+void BenchBatch() {
+    const size_t requests = 100000;
+    Scheme scheme;
+    Run(&scheme, "(define x 7)");
+    const std::string request = "(+ (* x 3) 1)";
+
+    auto start = std::chrono::steady_clock::now();
+    for (size_t i = 0; i < requests; ++i) {
+        Run(&scheme, request);
+    }
+    std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+    std::cout << "requests: Interpret " << requests / elapsed.count() << "/s";
+
+    std::vector<EvalResult> results;
+    for (size_t batch_size : {1, 100, 10000}) {
+        std::vector<std::string> batch(batch_size, request);
+        start = std::chrono::steady_clock::now();
+        for (size_t done = 0; done < requests; done += batch_size) {
+            scheme.InterpretBatch(batch, &results);
+        }
+        elapsed = std::chrono::steady_clock::now() - start;
+        std::cout << ", batch of " << batch_size << " " << requests / elapsed.count() << "/s";
+    }
+    std::cout << "\n";
+}
+
+// Печать длинного списка и глубоко вложенного.
+void BenchPrinting() {
+    const int64_t length = 1000000;
+    Scheme scheme;
+    Run(&scheme, "(define (chain n acc) (if (= n 0) acc (chain (- n 1) (cons n acc))))");
+    Run(&scheme, "(define (nest n acc) (if (= n 0) acc (nest (- n 1) (list acc))))");
+    Run(&scheme, "(define xs (chain " + std::to_string(length) + " '()))");
+    Run(&scheme, "(define deep (nest 10000 '()))");
+
+    auto flat = Measure(&scheme, "xs");
+    auto deep = Measure(&scheme, "deep");
+    std::cout << "printing: " << flat.seconds_ / length * 1e9 << " ns/element, nesting of 10000 "
+              << deep.seconds_ * 1e3 << " ms\n";
+}
+
+// Обходчик дерева на цикле из вызовов глобальных функций: почти каждая
+// голова вызова должна браться из кэша места вызова.
+void BenchCallSites() {
+    const int64_t iterations = 100000;
+    Scheme scheme;
+    scheme.SetEvalMode(EvalMode::TREE_WALK);
+    Run(&scheme, "(define (twice x) (+ x x))");
+    Run(&scheme, "(define (walk n acc) (if (= n 0) acc (walk (- n 1) (twice acc))))");
+
+    auto count = std::to_string(iterations);
+    Measure(&scheme, "(walk " + count + " 0)");
+    Scheme::ResetCallSiteStats();
+    auto walk = Measure(&scheme, "(walk " + count + " 0)");
+    auto stats = Scheme::GetCallSiteStats();
+    std::cout << "tree-walk calls: " << walk.seconds_ / iterations * 1e9 << " ns/iteration, "
+              << stats.hits_ << " hits, " << stats.misses_ << " misses\n";
+}
+
+int main() {
+    BenchComparison();
+    BenchArithmetic();
+    BenchListBuilding();
+    BenchListTraversal();
+    BenchClosures();
+    BenchConstruction();
+    BenchSnapshots();
+    BenchImage();
+    BenchPool();
+    BenchTokenizer();
+    BenchBatch();
+    BenchPrinting();
+    BenchCallSites();
+    return 0;
+}
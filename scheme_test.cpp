@@ -0,0 +1,926 @@
+#include <catch.hpp>
+
+#include <pool.h>
+#include <scheme.h>
+
+#include <pthread.h>
+
+#include <cstdio>
+#include <exception>
+#include <filesystem>
+#include <fstream>
+#include <functional>
+#include <future>
+#include <sstream>
+#include <string>
+#include <utility>
+#include <vector>
+
+std::string Run(Scheme *scheme, const std::string &expr) {
+    std::stringstream ss{expr};
+    scheme->SetTokenizer(&ss);
+    return scheme->Interpret();
+}
+
+// Выполняет body на потоке со стеком stack_size байт; исключение из body
+// бросается отсюда. Так проверка стека C++ не зависит от ulimit -s.
+void RunOnStack(size_t stack_size, const std::function<void()> &body) {
+    struct Task {
+        const std::function<void()> *body_;
+        std::exception_ptr error_;
+    } task{&body, nullptr};
+    pthread_attr_t attr;
+    pthread_attr_init(&attr);
+    pthread_attr_setstacksize(&attr, stack_size);
+    pthread_t thread;
+    auto start = [](void *arg) -> void * {
+        auto task = static_cast<Task *>(arg);
+        try {
+            (*task->body_)();
+        } catch (...) {
+            task->error_ = std::current_exception();
+        }
+        return nullptr;
+    };
+    int error = pthread_create(&thread, &attr, start, &task);
+    pthread_attr_destroy(&attr);
+    REQUIRE(error == 0);
+    pthread_join(thread, nullptr);
+    if (task.error_) {
+        std::rethrow_exception(task.error_);
+    }
+}
+
+TEST_CASE("Bytecode VM agrees with the tree walker") {
+    std::vector<std::string> program{
+        "(+ 1 2 3)",
+        "(- 10 4 3)",
+        "(* 2 (+ 3 4) (- 9 7))",
+        "(if (< 1 2) 'yes 'no)",
+        "(if #f 1)",
+        "(and 1 2 #f 3)",
+        "(or #f #f)",
+        "(or #f 7)",
+        "(and)",
+        "(define x 5)",
+        "(set! x (+ x 1))",
+        "x",
+        "(define (fact n) (if (< n 2) 1 (* n (fact (- n 1)))))",
+        "(fact 20)",
+        "(define (loop n acc) (if (= n 0) acc (loop (- n 1) (+ acc n))))",
+        "(loop 10000 0)",
+        "(define (compose f g) (lambda (v) (f (g v))))",
+        "((compose abs (lambda (v) (- v 10))) 3)",
+        "(define xs (list 1 2 3))",
+        "(cons 0 (cdr xs))",
+        "(list-ref xs 2)",
+        "'(a (b . c) #t)",
+        "(quote (1 . 2))",
+        "(max 3 9 2)",
+        "(null? '())",
+        "(pair? xs)",
+        "(symbol? 'x)",
+        "((lambda () (define y 2) (set! y (* y 10)) y))",
+        "undefined-variable",
+        "(car '())",
+        "(1 2)",
+        "(fact)",
+        "(+ 1 'a)",
+        "(set! nowhere 1)",
+        "(if)",
+    };
+    std::vector<EvalResult> expected;
+    Scheme tree;
+    tree.SetEvalMode(EvalMode::TREE_WALK);
+    tree.InterpretBatch(program, &expected);
+    for (auto optimize : {true, false}) {
+        Scheme vm;
+        vm.SetOptimization(optimize);
+        std::vector<EvalResult> results;
+        vm.InterpretBatch(program, &results);
+        REQUIRE(results.size() == program.size());
+        for (size_t i = 0; i < program.size(); ++i) {
+            INFO(program[i]);
+            REQUIRE(results[i].error_ == expected[i].error_);
+            if (expected[i].error_ == ErrorKind::NONE) {
+                REQUIRE(results[i].output_ == expected[i].output_);
+            }
+        }
+    }
+    REQUIRE(expected[13].output_ == "2432902008176640000");
+    REQUIRE(expected[15].output_ == "50005000");
+    REQUIRE(expected[28].error_ == ErrorKind::NAME);
+}
+
+TEST_CASE("Every lambda call gets its own frame") {
+    for (auto mode : {EvalMode::BYTECODE, EvalMode::TREE_WALK}) {
+        Scheme scheme;
+        scheme.SetEvalMode(mode);
+        Run(&scheme, "(define (fib n) (if (< n 2) n (+ (fib (- n 1)) (fib (- n 2)))))");
+        REQUIRE(Run(&scheme, "(fib 15)") == "610");
+
+        // аргументы вызывающего переживают вложенный вызов той же lambda
+        Run(&scheme, "(define (sum-to n) (if (= n 0) 0 (+ n (sum-to (- n 1)))))");
+        REQUIRE(Run(&scheme, "(sum-to 100)") == "5050");
+
+        // параметр перекрывает глобальную переменную только внутри вызова
+        Run(&scheme, "(define x 10)");
+        Run(&scheme, "(define shadow (lambda (x) (set! x (* x 2)) x))");
+        REQUIRE(Run(&scheme, "(shadow 3)") == "6");
+        REQUIRE(Run(&scheme, "x") == "10");
+
+        // замыкания держат каждое свой кадр
+        Run(&scheme, "(define (make-adder k) (lambda (v) (+ v k)))");
+        Run(&scheme, "(define add1 (make-adder 1))");
+        Run(&scheme, "(define add2 (make-adder 2))");
+        REQUIRE(Run(&scheme, "(add1 10)") == "11");
+        REQUIRE(Run(&scheme, "(add2 10)") == "12");
+        REQUIRE(Run(&scheme, "(add1 10)") == "11");
+
+        REQUIRE_THROWS_AS(Run(&scheme, "(fib)"), SyntaxError);
+        REQUIRE_THROWS_AS(Run(&scheme, "(fib 1 2)"), SyntaxError);
+    }
+}
+
+TEST_CASE("Variables resolve to the innermost lexical binding") {
+    for (auto mode : {EvalMode::BYTECODE, EvalMode::TREE_WALK}) {
+        Scheme scheme;
+        scheme.SetEvalMode(mode);
+        Run(&scheme, "(define (outer a) (lambda (b) (lambda (c) (list a b c))))");
+        REQUIRE(Run(&scheme, "(((outer 1) 2) 3)") == "(1 2 3)");
+
+        // set! меняет ячейку того кадра, где переменная объявлена
+        Run(&scheme, "(define (make-box v) (lambda (new) (set! v new) v))");
+        Run(&scheme, "(define box (make-box 1))");
+        REQUIRE(Run(&scheme, "(box 5)") == "5");
+        REQUIRE(Run(&scheme, "(box 6)") == "6");
+
+        Run(&scheme, "(define y 1)");
+        Run(&scheme, "(define h (lambda () (define y 2) y))");
+        REQUIRE(Run(&scheme, "(h)") == "2");
+        REQUIRE(Run(&scheme, "y") == "1");
+
+        Run(&scheme, "(define (inner-shadow x) ((lambda (x) (* x 10)) (+ x 1)))");
+        REQUIRE(Run(&scheme, "(inner-shadow 1)") == "20");
+
+        // define внутри тела виден всему телу, но только после выполнения
+        REQUIRE(Run(&scheme, "((lambda () (define (f) z) (define z 3) (f)))") == "3");
+        REQUIRE_THROWS_AS(Run(&scheme, "((lambda () (define w w) w))"), NameError);
+
+        // свободная переменная вложенной lambda - глобальная, определённая позже
+        Run(&scheme, "(define (deferred) (lambda () (* later 2)))");
+        Run(&scheme, "(define later 21)");
+        REQUIRE(Run(&scheme, "((deferred))") == "42");
+    }
+}
+
+TEST_CASE("Symbols are interned once per process") {
+    Scheme scheme;
+    auto before = Scheme::InternTableSize();
+    REQUIRE(Run(&scheme, "'interned-only-here") == "interned-only-here");
+    REQUIRE(Scheme::InternTableSize() == before + 1);
+    // тот же символ повторно, в списке и в другом интерпретаторе
+    REQUIRE(Run(&scheme, "'(interned-only-here interned-only-here)") ==
+            "(interned-only-here interned-only-here)");
+    Scheme other;
+    REQUIRE(Run(&other, "'interned-only-here") == "interned-only-here");
+    REQUIRE(Scheme::InternTableSize() == before + 1);
+
+    // служебные символы ридера сравниваются по указателю
+    REQUIRE(Run(&scheme, "(quote (a . b))") == "(a . b)");
+    REQUIRE(Run(&scheme, "'(1 . (2 3))") == "(1 2 3)");
+    REQUIRE(Run(&scheme, "(if #f 1 2)") == "2");
+    REQUIRE(Run(&scheme, "(boolean? #t)") == "#t");
+    REQUIRE(Run(&scheme, "(boolean? 't)") == "#f");
+}
+
+TEST_CASE("Booleans are shared constants") {
+    for (auto mode : {EvalMode::BYTECODE, EvalMode::TREE_WALK}) {
+        Scheme scheme;
+        scheme.SetEvalMode(mode);
+        REQUIRE(Run(&scheme, "(< 1 2)") == "#t");
+        REQUIRE(Run(&scheme, "(not 1)") == "#f");
+        REQUIRE(Run(&scheme, "(not #f)") == "#t");
+        REQUIRE(Run(&scheme, "(null? '())") == "#t");
+        REQUIRE(Run(&scheme, "(boolean? (= 1 2))") == "#t");
+        REQUIRE(Run(&scheme, "(if (> 1 2) 'yes 'no)") == "no");
+
+        // результаты сравнений живы в списке, но в куче только его пары
+        Run(&scheme, "(define (collect n acc) (if (= n 0) acc (collect (- n 1) (cons (< n 3) acc))))");
+        auto before = scheme.GetHeapObjectCount();
+        Run(&scheme, "(define flags (collect 10000 '()))");
+        REQUIRE(scheme.GetHeapObjectCount() < before + 10000 + 100);
+        REQUIRE(Run(&scheme, "(list-ref flags 1)") == "#t");
+        REQUIRE(Run(&scheme, "(list-ref flags 2)") == "#f");
+    }
+}
+
+TEST_CASE("Integers move between fixnums and boxes at 2^62") {
+    for (auto mode : {EvalMode::BYTECODE, EvalMode::TREE_WALK}) {
+        for (auto optimize : {true, false}) {
+            Scheme scheme;
+            scheme.SetEvalMode(mode);
+            scheme.SetOptimization(optimize);
+            // 2^62 - 1 и -2^62 - границы целого внутри Value
+            Run(&scheme, "(define max-fix (- (* 65536 65536 65536 16384) 1))");
+            Run(&scheme, "(define min-fix (- 0 max-fix 1))");
+            Run(&scheme, "(define (add a b) (+ a b))");
+            Run(&scheme, "(define (sub a b) (- a b))");
+            Run(&scheme, "(define (mul a b) (* a b))");
+            REQUIRE(Run(&scheme, "max-fix") == "4611686018427387903");
+            REQUIRE(Run(&scheme, "min-fix") == "-4611686018427387904");
+
+            REQUIRE(Run(&scheme, "(add max-fix 1)") == "4611686018427387904");
+            REQUIRE(Run(&scheme, "(+ max-fix max-fix)") == "9223372036854775806");
+            REQUIRE(Run(&scheme, "(sub min-fix 1)") == "-4611686018427387905");
+            REQUIRE(Run(&scheme, "(add min-fix min-fix)") == "-9223372036854775808");
+            // обратно в целое внутри Value
+            REQUIRE(Run(&scheme, "(sub (add max-fix 1) 1)") == "4611686018427387903");
+            REQUIRE(Run(&scheme, "(= (sub (add max-fix 1) 1) max-fix)") == "#t");
+
+            Run(&scheme, "(define two-31 (* 65536 32768))");
+            REQUIRE(Run(&scheme, "(mul two-31 two-31)") == "4611686018427387904");
+            REQUIRE(Run(&scheme, "(mul two-31 (- 0 two-31))") == "-4611686018427387904");
+            REQUIRE(Run(&scheme, "(mul max-fix 2)") == "9223372036854775806");
+            REQUIRE(Run(&scheme, "(* (+ two-31 1) (+ two-31 1))") == "4611686022722355201");
+            REQUIRE(Run(&scheme, "(mul (mul two-31 two-31) 1)") == "4611686018427387904");
+
+            // упакованные числа сравниваются и считаются как обычные
+            REQUIRE(Run(&scheme, "(< max-fix (add max-fix 1))") == "#t");
+            REQUIRE(Run(&scheme, "(= (add max-fix 1) (mul two-31 two-31))") == "#t");
+            REQUIRE(Run(&scheme, "(abs min-fix)") == "4611686018427387904");
+            REQUIRE(Run(&scheme, "(max 1 (add max-fix 1))") == "4611686018427387904");
+            REQUIRE(Run(&scheme, "(number? (add max-fix 1))") == "#t");
+        }
+    }
+}
+
+TEST_CASE("Programs survive collection at every safepoint") {
+    for (auto mode : {EvalMode::BYTECODE, EvalMode::TREE_WALK}) {
+        Scheme scheme;
+        scheme.SetEvalMode(mode);
+        scheme.SetGcStressMode(true);
+
+        Run(&scheme, "(define (range n acc) (if (= n 0) acc (range (- n 1) (cons n acc))))");
+        Run(&scheme, "(define xs (range 5 '()))");
+        Run(&scheme, "(define make-counter (lambda () (define n 0) (lambda () (set! n (+ n 1)) n)))");
+        Run(&scheme, "(define counter (make-counter))");
+        Run(&scheme, "(counter)");
+
+        REQUIRE(Run(&scheme, "xs") == "(1 2 3 4 5)");
+        REQUIRE(Run(&scheme, "(counter)") == "2");
+        REQUIRE(Run(&scheme, "(list (car xs) (list-tail xs 3) '(a . b))") ==
+                "(1 (4 5) (a . b))");
+        REQUIRE(Run(&scheme, "(set-cdr! xs '(7))") == "()");
+        REQUIRE(Run(&scheme, "xs") == "(1 7)");
+    }
+}
+
+TEST_CASE("Recursive closures are collected") {
+    for (auto mode : {EvalMode::BYTECODE, EvalMode::TREE_WALK}) {
+        Scheme scheme;
+        scheme.SetEvalMode(mode);
+        // lambda ссылается на свой кадр, а кадр - на неё
+        Run(&scheme, "(define make (lambda () (define (f n) (if (= n 0) 0 (f (- n 1)))) f))");
+        // кэши вызовов заводятся при втором вычислении и живут вместе с телом
+        Run(&scheme, "((make) 3)");
+        Run(&scheme, "((make) 3)");
+        scheme.CollectGarbage();
+        auto baseline = scheme.GetHeapObjectCount();
+
+        for (int i = 0; i < 100; ++i) {
+            Run(&scheme, "((make) 3)");
+        }
+        REQUIRE(scheme.GetHeapObjectCount() > baseline);
+        scheme.CollectGarbage();
+        REQUIRE(scheme.GetHeapObjectCount() == baseline);
+    }
+}
+
+TEST_CASE("Young values stored into old cells survive minor collections") {
+    for (auto mode : {EvalMode::BYTECODE, EvalMode::TREE_WALK}) {
+        Scheme scheme;
+        scheme.SetEvalMode(mode);
+        Run(&scheme, "(define xs (list 1 2))");
+        Run(&scheme, "(define churn (lambda (n) (if (= n 0) 0 (churn (- (car (list n)) 1)))))");
+        // xs переезжает в старшее поколение
+        scheme.CollectGarbage();
+        scheme.SetGcStressMode(true);
+
+        Run(&scheme, "(set-car! xs (list 3 (cons 4 5)))");
+        Run(&scheme, "(set-cdr! (cdr xs) (cons 6 '()))");
+        Run(&scheme, "(churn 100)");
+        REQUIRE(Run(&scheme, "xs") == "((3 (4 . 5)) 2 6)");
+    }
+}
+
+TEST_CASE("Tail calls run in constant stack") {
+    Scheme scheme;
+    Run(&scheme, "(define (count n) (if (= n 0) 0 (count (- n 1))))");
+    // без хвостовых вызовов кадры 10 млн вызовов не поместились бы в стек
+    REQUIRE(Run(&scheme, "(count 10000000)") == "0");
+
+    Run(&scheme, "(define (loop n acc) (or (and (= n 0) acc) (loop (- n 1) (+ acc 1))))");
+    REQUIRE(Run(&scheme, "(loop 1000000 0)") == "1000000");
+
+    scheme.SetEvalMode(EvalMode::TREE_WALK);
+    REQUIRE(Run(&scheme, "(count 1000000)") == "0");
+    REQUIRE(Run(&scheme, "(loop 1000000 0)") == "1000000");
+}
+
+TEST_CASE("Depth limit raises RuntimeError") {
+    for (auto mode : {EvalMode::BYTECODE, EvalMode::TREE_WALK}) {
+        Scheme scheme;
+        scheme.SetEvalMode(mode);
+        scheme.SetMaxDepth(100);
+        Run(&scheme, "(define (deep n) (if (= n 0) 0 (+ 1 (deep (- n 1)))))");
+
+        REQUIRE(Run(&scheme, "(deep 50)") == "50");
+        REQUIRE_THROWS_AS(Run(&scheme, "(deep 1000)"), RuntimeError);
+        REQUIRE_THROWS_AS(Run(&scheme, "'" + std::string(1000, '(') + std::string(1000, ')')),
+                          RuntimeError);
+        // после ошибки интерпретатор продолжает работать
+        REQUIRE(Run(&scheme, "(deep 50)") == "50");
+
+        // предел больше, чем помещается в стек C++: ошибка, а не падение
+        scheme.SetMaxDepth(1000000);
+        const size_t stack_size = 4 << 20;
+        std::string nested;
+        for (int i = 0; i < 100000; ++i) {
+            nested += "(+ 1 ";
+        }
+        nested += "0" + std::string(100000, ')');
+        REQUIRE_THROWS_AS(RunOnStack(stack_size, [&] { Run(&scheme, nested); }), RuntimeError);
+        std::string result;
+        auto deep = [&] { result = Run(&scheme, "(deep 300000)"); };
+        if (mode == EvalMode::BYTECODE) {
+            // кадры VM лежат не на стеке C++
+            RunOnStack(stack_size, deep);
+            REQUIRE(result == "300000");
+        } else {
+            REQUIRE_THROWS_AS(RunOnStack(stack_size, deep), RuntimeError);
+        }
+        REQUIRE(Run(&scheme, "(deep 50)") == "50");
+    }
+}
+
+TEST_CASE("Buffer tokenizer matches the stream tokenizer") {
+    std::string source = "(define (f x) (if (>= x -12) '(a . #t) (* x +3))) <= > - foo?! 42";
+    std::stringstream ss{source};
+    Tokenizer stream(&ss);
+    BufferTokenizer buffer(source);
+    while (!stream.IsEnd()) {
+        REQUIRE(!buffer.IsEnd());
+        auto expected = stream.GetToken();
+        auto token = buffer.GetToken();
+        stream.Next();
+        buffer.Next();
+        if (std::holds_alternative<SymbolToken>(expected)) {
+            REQUIRE(token.kind_ == TokenKind::SYMBOL);
+            REQUIRE(token.text_ == std::get<SymbolToken>(expected).name_);
+        } else if (std::holds_alternative<ConstantToken>(expected)) {
+            REQUIRE(token.kind_ == TokenKind::CONSTANT);
+            REQUIRE(token.value_ == std::get<ConstantToken>(expected).value_);
+        }
+        REQUIRE(source.substr(token.offset_, token.text_.size()) == token.text_);
+    }
+    REQUIRE(buffer.IsEnd());
+
+    Scheme scheme;
+    scheme.SetSource("(define xs '(2 . 3))");
+    scheme.Interpret();
+    scheme.SetSource("(cdr xs)");
+    REQUIRE(scheme.Interpret() == "3");
+    scheme.SetSource("(car xs) 2");
+    REQUIRE_THROWS_AS(scheme.Interpret(), SyntaxError);
+}
+
+TEST_CASE("LoadFile evaluates every form of a file") {
+    auto path = (std::filesystem::temp_directory_path() / "scheme_test_load.scm").string();
+    {
+        std::ofstream out(path);
+        out << "(define (square x) (* x x))\n"
+            << "(define xs (list 1 2 3))\n"
+            << "(square (car (cdr xs)))\n";
+    }
+    for (auto mode : {EvalMode::BYTECODE, EvalMode::TREE_WALK}) {
+        Scheme scheme;
+        scheme.SetEvalMode(mode);
+        REQUIRE(scheme.LoadFile(path) == "4");
+        REQUIRE(Run(&scheme, "(square 5)") == "25");
+    }
+    std::ofstream(path).close();
+    Scheme scheme;
+    REQUIRE(scheme.LoadFile(path).empty());
+    std::remove(path.c_str());
+    REQUIRE_THROWS_AS(scheme.LoadFile(path), RuntimeError);
+}
+
+TEST_CASE("Vectorised token scanners agree with the scalar one") {
+    // без '?' и '!' в начале лексемы и без цифр: первые заканчивают ввод,
+    // длинные числа не помещаются в int64
+    std::string alphabet = "ab+-*<>=/()'. \t\n;\"\x80\xff";
+    std::string source;
+    uint32_t seed = 1;
+    for (int i = 0; i < 20000; ++i) {
+        seed = seed * 1103515245 + 12345;
+        // длинные серии одного класса проходят через векторный путь
+        auto run = (seed >> 8) % 40 + 1;
+        auto c = alphabet[(seed >> 16) % alphabet.size()];
+        source.append(run, c);
+    }
+    auto tokenize = [&source] {
+        std::vector<std::pair<size_t, size_t>> tokens;
+        BufferTokenizer tokenizer(source);
+        for (; !tokenizer.IsEnd(); tokenizer.Next()) {
+            tokens.emplace_back(tokenizer.GetToken().offset_, tokenizer.GetToken().text_.size());
+        }
+        return tokens;
+    };
+
+    REQUIRE(BufferTokenizer::SetCharScanner(CharScanner::SCALAR));
+    auto expected = tokenize();
+    REQUIRE(expected.size() > 1000);
+    for (auto scanner : {CharScanner::SSSE3, CharScanner::AVX2}) {
+        if (BufferTokenizer::SetCharScanner(scanner)) {
+            REQUIRE(tokenize() == expected);
+        }
+    }
+}
+
+// Отдаёт входные данные кусками и запоминает, что к моменту запроса
+// очередного куска уже было выведено.
+class ChunkedInput : public std::streambuf {
+public:
+    ChunkedInput(std::vector<std::string> chunks, std::stringstream *out)
+        : chunks_(std::move(chunks)), out_(out) {
+    }
+
+    std::vector<std::string> seen_;
+
+protected:
+    int_type underflow() override {
+        if (next_ == chunks_.size()) {
+            return traits_type::eof();
+        }
+        seen_.push_back(out_->str());
+        auto &chunk = chunks_[next_++];
+        setg(chunk.data(), chunk.data(), chunk.data() + chunk.size());
+        return traits_type::to_int_type(chunk[0]);
+    }
+
+private:
+    std::vector<std::string> chunks_;
+    size_t next_ = 0;
+    std::stringstream *out_;
+};
+
+TEST_CASE("InterpretStream prints each result before reading further") {
+    for (auto mode : {EvalMode::BYTECODE, EvalMode::TREE_WALK}) {
+        Scheme scheme;
+        scheme.SetEvalMode(mode);
+        std::stringstream out;
+        ChunkedInput input({"(define x 4) ", "(* x x)\n", "'(1 . 2)\n"}, &out);
+        std::istream in(&input);
+        scheme.InterpretStream(&in, &out);
+
+        REQUIRE(out.str() == "()\n16\n(1 . 2)\n");
+        REQUIRE(input.seen_ == std::vector<std::string>{"", "()\n", "()\n16\n"});
+    }
+
+    Scheme scheme;
+    std::stringstream in{"(+ 1 2) (car '()) (+ 3 4)"};
+    std::stringstream out;
+    REQUIRE_THROWS_AS(scheme.InterpretStream(&in, &out), RuntimeError);
+    // после ошибки чтение продолжается со следующей формы
+    scheme.InterpretStream(&in, &out);
+    REQUIRE(out.str() == "3\n7\n");
+}
+
+TEST_CASE("InterpretBatch captures errors per item") {
+    Scheme scheme;
+    std::vector<EvalResult> results;
+    scheme.InterpretBatch({"(define x 5)", "(+ x 1)", "(car '())", "y", "(+ 1", "1 2", "(* x x)"},
+                          &results);
+    REQUIRE(results.size() == 7);
+    REQUIRE(results[1].error_ == ErrorKind::NONE);
+    REQUIRE(results[1].output_ == "6");
+    REQUIRE(results[2].error_ == ErrorKind::RUNTIME);
+    REQUIRE(results[3].error_ == ErrorKind::NAME);
+    REQUIRE(results[4].error_ == ErrorKind::SYNTAX);
+    REQUIRE(results[5].error_ == ErrorKind::SYNTAX);
+    REQUIRE(results[6].output_ == "25");
+
+    scheme.InterpretBatch("(set! x 2) (car x) (* x 10) (+ x", &results);
+    REQUIRE(results.size() == 4);
+    REQUIRE(results[0].error_ == ErrorKind::NONE);
+    REQUIRE(results[1].error_ == ErrorKind::RUNTIME);
+    REQUIRE(results[2].output_ == "20");
+    REQUIRE(results[3].error_ == ErrorKind::SYNTAX);
+}
+
+TEST_CASE("Printer handles deep nesting and streams long lists") {
+    Scheme scheme;
+    Run(&scheme, "(define (nest n acc) (if (= n 0) acc (nest (- n 1) (list acc))))");
+    Run(&scheme, "(define (chain n acc) (if (= n 0) acc (chain (- n 1) (cons n acc))))");
+    const size_t depth = 200000;
+    auto count = std::to_string(depth);
+    REQUIRE(Run(&scheme, "(nest " + count + " '())") ==
+            std::string(depth, '(') + "()" + std::string(depth, ')'));
+    REQUIRE(Run(&scheme, "(chain 3 '(a . b))") == "(1 2 3 a . b)");
+    REQUIRE(Run(&scheme, "(cons (list 1 (cons 2 3)) (cons '() 4))") == "((1 (2 . 3)) () . 4)");
+
+    std::stringstream in{"(chain " + count + " '())"};
+    std::stringstream out;
+    scheme.InterpretStream(&in, &out);
+    auto printed = out.str();
+    REQUIRE(printed.size() > depth * 6);
+    REQUIRE(printed.substr(0, 8) == "(1 2 3 4");
+    REQUIRE(printed.substr(printed.size() - 9) == " 200000)\n");
+}
+
+TEST_CASE("Inlined builtins deoptimise when rebound") {
+    for (auto optimize : {true, false}) {
+        Scheme scheme;
+        scheme.SetOptimization(optimize);
+        Run(&scheme, "(define (inc x) (+ x 1))");
+        Run(&scheme, "(define (folded) (* 2 (+ 3 4)))");
+        Run(&scheme, "(define (small? n) (< n 3))");
+        Run(&scheme, "(define (pair a b) (cons a b))");
+        Run(&scheme, "(define (broken) (+ 1 (car '())))");
+
+        REQUIRE(Run(&scheme, "(inc 4)") == "5");
+        // 2^62 - 1 - наибольшее целое внутри Value
+        REQUIRE(Run(&scheme, "(inc (- (* 65536 65536 65536 16384) 1))") == "4611686018427387904");
+        REQUIRE(Run(&scheme, "(folded)") == "14");
+        REQUIRE(Run(&scheme, "(small? 5)") == "#f");
+        REQUIRE(Run(&scheme, "(pair 1 2)") == "(1 . 2)");
+        REQUIRE_THROWS_AS(Run(&scheme, "(inc 'a)"), RuntimeError);
+        REQUIRE_THROWS_AS(Run(&scheme, "(broken)"), RuntimeError);
+
+        Run(&scheme, "(define + -)");
+        Run(&scheme, "(set! * max)");
+        Run(&scheme, "(define < (lambda (a b) #t))");
+        REQUIRE(Run(&scheme, "(inc 4)") == "3");
+        REQUIRE(Run(&scheme, "(folded)") == "2");
+        REQUIRE(Run(&scheme, "(small? 5)") == "#t");
+        REQUIRE(Run(&scheme, "(* 2 (+ 3 4))") == "2");
+
+        // параметр с именем встроенной функции её перекрывает
+        Run(&scheme, "(define (apply-op cons a b) (cons a b))");
+        REQUIRE(Run(&scheme, "(apply-op - 5 2)") == "3");
+    }
+}
+
+TEST_CASE("Call site caches follow rebinding") {
+    Scheme scheme;
+    scheme.SetEvalMode(EvalMode::TREE_WALK);
+    Run(&scheme, "(define (g x) (* x 2))");
+    Run(&scheme, "(define (f x) (g x))");
+    Run(&scheme, "(define (loop n acc) (if (= n 0) acc (loop (- n 1) (+ acc (f n)))))");
+
+    Scheme::ResetCallSiteStats();
+    REQUIRE(Run(&scheme, "(loop 100 0)") == "10100");
+    auto stats = Scheme::GetCallSiteStats();
+    REQUIRE(stats.hits_ > 500);
+    REQUIRE(stats.misses_ < 50);
+
+    Run(&scheme, "(set! g (lambda (x) x))");
+    REQUIRE(Run(&scheme, "(loop 100 0)") == "5050");
+    Run(&scheme, "(define (g x) 1)");
+    REQUIRE(Run(&scheme, "(loop 100 0)") == "100");
+
+    // define в теле перекрывает глобальную функцию только в своём кадре
+    Run(&scheme, "(define k (lambda (flag x) (if flag (define g (lambda (y) 100)) #f) (g x)))");
+    REQUIRE(Run(&scheme, "(k #f 5)") == "1");
+    REQUIRE(Run(&scheme, "(k #t 5)") == "100");
+    REQUIRE(Run(&scheme, "(k #f 5)") == "1");
+
+    // параметр с тем же именем в кэш не попадает
+    Run(&scheme, "(define (call g x) (g x))");
+    REQUIRE(Run(&scheme, "(call not #f)") == "#t");
+    REQUIRE(Run(&scheme, "(call abs -7)") == "7");
+    REQUIRE_THROWS_AS(Run(&scheme, "(call 1 2)"), RuntimeError);
+
+    // define в другом интерпретаторе чужие кэши не сбрасывает
+    Scheme other;
+    auto count_misses = [&](bool define_in_other) {
+        Scheme::ResetCallSiteStats();
+        for (int i = 0; i < 20; ++i) {
+            if (define_in_other) {
+                Run(&other, "(define v" + std::to_string(i) + " 1)");
+            }
+            REQUIRE(Run(&scheme, "(loop 10 0)") == "10");
+        }
+        return Scheme::GetCallSiteStats().misses_;
+    };
+    count_misses(false);
+    auto quiet = count_misses(false);
+    REQUIRE(count_misses(true) == quiet);
+}
+
+TEST_CASE("Compiling does not create global bindings") {
+    Scheme scheme;
+    Run(&scheme, "(define (loop n) (if (= n 0) 0 (loop (- n 1))))");
+    // новая ячейка сбросила бы кэши вызовов обходчика дерева
+    auto misses_after = [&](const std::string &compiled) {
+        scheme.SetEvalMode(EvalMode::BYTECODE);
+        Run(&scheme, compiled);
+        scheme.SetEvalMode(EvalMode::TREE_WALK);
+        Scheme::ResetCallSiteStats();
+        REQUIRE(Run(&scheme, "(loop 10)") == "0");
+        return Scheme::GetCallSiteStats().misses_;
+    };
+    misses_after("0");
+    auto quiet = misses_after("0");
+    REQUIRE(misses_after("(if #f unknown 0)") == quiet);
+    REQUIRE(misses_after("(if #f (unknown 1) 0)") == quiet);
+    REQUIRE(misses_after("(define (later-user) (+ later 1))") > quiet);
+
+    // скомпилированный код находит ячейку, заведённую позже
+    scheme.SetEvalMode(EvalMode::BYTECODE);
+    REQUIRE_THROWS_AS(Run(&scheme, "(later-user)"), NameError);
+    REQUIRE_THROWS_AS(Run(&scheme, "(set! later 1)"), NameError);
+    Run(&scheme, "(define later 5)");
+    REQUIRE(Run(&scheme, "(later-user)") == "6");
+}
+
+TEST_CASE("List primitives accept lists and pairs only") {
+    for (auto mode : {EvalMode::BYTECODE, EvalMode::TREE_WALK}) {
+        Scheme scheme;
+        scheme.SetEvalMode(mode);
+        REQUIRE(Run(&scheme, "(car '(1 2 3))") == "1");
+        REQUIRE(Run(&scheme, "(cdr (cons 1 2))") == "2");
+        REQUIRE(Run(&scheme, "(car (cdr (list 1 2 3)))") == "2");
+        REQUIRE(Run(&scheme, "(cdr '(1 . 2))") == "2");
+        REQUIRE(Run(&scheme, "(list-tail '(1 2 3) 1)") == "(2 3)");
+        REQUIRE(Run(&scheme, "(list-ref (list 1 2 3) 2)") == "3");
+        Run(&scheme, "(define xs (list 1 2))");
+        Run(&scheme, "(set-car! xs 5)");
+        Run(&scheme, "(set-cdr! xs 6)");
+        REQUIRE(Run(&scheme, "xs") == "(5 . 6)");
+
+        REQUIRE_THROWS_AS(Run(&scheme, "(car 1)"), RuntimeError);
+        REQUIRE_THROWS_AS(Run(&scheme, "(cdr 'a)"), RuntimeError);
+        REQUIRE_THROWS_AS(Run(&scheme, "(car car)"), RuntimeError);
+        REQUIRE_THROWS_AS(Run(&scheme, "(list-tail 1 0)"), RuntimeError);
+        REQUIRE_THROWS_AS(Run(&scheme, "(set-car! 1 2)"), RuntimeError);
+        REQUIRE(Run(&scheme, "(pair? '(1 2))") == "#t");
+        REQUIRE(Run(&scheme, "(list? '(1 . 2))") == "#f");
+        REQUIRE(Run(&scheme, "(number? car)") == "#f");
+        REQUIRE(Run(&scheme, "(symbol? 'car)") == "#t");
+    }
+}
+
+TEST_CASE("Tree walker arguments span evaluation stack blocks") {
+    Scheme scheme;
+    scheme.SetEvalMode(EvalMode::TREE_WALK);
+    std::string many = "(+";
+    for (int i = 1; i <= 5000; ++i) {
+        many += " " + std::to_string(i);
+    }
+    many += ")";
+    REQUIRE(Run(&scheme, many) == "12502500");
+    // вложенные вызовы, которые не помещаются в остаток блока
+    REQUIRE(Run(&scheme, "(max 1 " + many + " (min 2 " + many + "))") == "12502500");
+
+    Run(&scheme, "(define (count n) (if (= n 0) 0 (+ 1 (count (- n 1)))))");
+    REQUIRE(Run(&scheme, "(count 3000)") == "3000");
+    REQUIRE_THROWS_AS(Run(&scheme, "(+ 1 (car '()) 2)"), RuntimeError);
+    REQUIRE_THROWS_AS(Run(&scheme, "(+ 1 (count 'a))"), RuntimeError);
+    REQUIRE(Run(&scheme, "(list 1 (+ 2 3) 'x '(4 5))") == "(1 5 x (4 5))");
+    REQUIRE(Run(&scheme, many) == "12502500");
+}
+
+TEST_CASE("Closures share their defining environment") {
+    for (auto mode : {EvalMode::BYTECODE, EvalMode::TREE_WALK}) {
+        Scheme scheme;
+        scheme.SetEvalMode(mode);
+        // глобальная функция, определённая позже, видна
+        Run(&scheme, "(define (late) (h 3))");
+        Run(&scheme, "(define (h x) (+ x 1))");
+        REQUIRE(Run(&scheme, "(late)") == "4");
+
+        Run(&scheme, "(define (even? n) (if (= n 0) #t (odd? (- n 1))))");
+        Run(&scheme, "(define (odd? n) (if (= n 0) #f (even? (- n 1))))");
+        REQUIRE(Run(&scheme, "(even? 10)") == "#t");
+
+        // define в кадре после создания замыкания тоже виден
+        Run(&scheme, "(define rec (lambda (n) (define (go k acc) (if (= k 0) acc "
+                     "(go (- k 1) (+ acc a0)))) (define a0 n) (go 3 0)))");
+        REQUIRE(Run(&scheme, "(rec 7)") == "21");
+
+        // замыкание не вносит своё имя в чужое окружение
+        Run(&scheme, "(define outer (lambda () (define (inner) (g 1)) inner))");
+        Run(&scheme, "(define g (outer))");
+        Run(&scheme, "(define (g x) (* x 10))");
+        REQUIRE(Run(&scheme, "((outer))") == "10");
+    }
+}
+
+TEST_CASE("Closures from the tree walker run in the VM") {
+    Scheme scheme;
+    scheme.SetEvalMode(EvalMode::TREE_WALK);
+    Run(&scheme, "(define make-counter (lambda () (define n 0) (lambda () (set! n (+ n 1)) n)))");
+    Run(&scheme, "(define c (make-counter))");
+    Run(&scheme, "(define (adder k) (lambda (x) (+ x k)))");
+    Run(&scheme, "(define add5 (adder 5))");
+    Run(&scheme, "(define (square x) (* x x))");
+
+    scheme.SetEvalMode(EvalMode::BYTECODE);
+    REQUIRE(Run(&scheme, "(c)") == "1");
+    REQUIRE(Run(&scheme, "(c)") == "2");
+    REQUIRE(Run(&scheme, "(add5 1)") == "6");
+    REQUIRE(Run(&scheme, "(square 9)") == "81");
+    // подставленная встроенная функция уступает новому значению
+    Run(&scheme, "(define * +)");
+    REQUIRE(Run(&scheme, "(square 9)") == "18");
+    REQUIRE_THROWS_AS(Run(&scheme, "(square)"), SyntaxError);
+
+    scheme.SetEvalMode(EvalMode::TREE_WALK);
+    REQUIRE(Run(&scheme, "(c)") == "3");
+}
+
+TEST_CASE("Rebinding a builtin stays inside one interpreter") {
+    for (auto mode : {EvalMode::BYTECODE, EvalMode::TREE_WALK}) {
+        Scheme first;
+        Scheme second;
+        first.SetEvalMode(mode);
+        second.SetEvalMode(mode);
+        Run(&first, "(define + -)");
+        Run(&first, "(set! car cdr)");
+        REQUIRE(Run(&first, "(+ 5 2)") == "3");
+        REQUIRE(Run(&first, "(car '(1 2))") == "(2)");
+        REQUIRE(Run(&second, "(+ 5 2)") == "7");
+        REQUIRE(Run(&second, "(car '(1 2))") == "1");
+
+        Scheme third;
+        third.SetEvalMode(mode);
+        REQUIRE(Run(&third, "(if (number? 1) (max 1 2) 0)") == "2");
+        REQUIRE_THROWS_AS(Run(&third, "(car-and-cdr 1)"), NameError);
+    }
+}
+
+TEST_CASE("Restoring a snapshot isolates requests") {
+    for (auto mode : {EvalMode::BYTECODE, EvalMode::TREE_WALK}) {
+        Scheme scheme;
+        scheme.SetEvalMode(mode);
+        Run(&scheme, "(define counter 0)");
+        Run(&scheme, "(define (square x) (* x x))");
+        Run(&scheme, "(define (bump) (set! counter (+ counter 1)))");
+        // set! в кадрах, созданных до снимка, тоже откатывается
+        Run(&scheme, "(define tick ((lambda (n) (lambda () (set! n (+ n 1)) n)) 0))");
+        Run(&scheme, "(define make-counter (lambda () (define n 0) (lambda () (set! n (+ n 1)) n)))");
+        Run(&scheme, "(define tock (make-counter))");
+        auto prepared = scheme.Snapshot();
+
+        for (int request = 0; request < 3; ++request) {
+            REQUIRE(Run(&scheme, "(square 4)") == "16");
+            REQUIRE(Run(&scheme, "(tick)") == "1");
+            REQUIRE(Run(&scheme, "(tick)") == "2");
+            REQUIRE(Run(&scheme, "(tock)") == "1");
+            Run(&scheme, "(bump)");
+            Run(&scheme, "(define (square x) x)");
+            Run(&scheme, "(define fresh (lambda () counter))");
+            Run(&scheme, "(define + -)");
+            REQUIRE(Run(&scheme, "(fresh)") == "1");
+            REQUIRE(Run(&scheme, "(+ 5 2)") == "3");
+            scheme.CollectGarbage();
+            scheme.Restore(prepared);
+
+            REQUIRE(Run(&scheme, "counter") == "0");
+            REQUIRE(Run(&scheme, "(+ 5 2)") == "7");
+            REQUIRE_THROWS_AS(Run(&scheme, "(fresh)"), NameError);
+        }
+
+        // снимки вкладываются; откат к раннему удаляет поздние
+        Run(&scheme, "(bump)");
+        auto nested = scheme.Snapshot();
+        Run(&scheme, "(bump)");
+        scheme.Restore(nested);
+        REQUIRE(Run(&scheme, "counter") == "1");
+        scheme.Restore(prepared);
+        REQUIRE(Run(&scheme, "counter") == "0");
+        REQUIRE_THROWS_AS(scheme.Restore(nested), RuntimeError);
+
+        Scheme other;
+        REQUIRE_THROWS_AS(other.Restore(prepared), RuntimeError);
+    }
+}
+
+TEST_CASE("Heap image restores the global environment") {
+    auto path = (std::filesystem::temp_directory_path() / "scheme_test_image.bin").string();
+    {
+        Scheme scheme;
+        Run(&scheme, "(define (fact n) (if (< n 2) 1 (* n (fact (- n 1)))))");
+        Run(&scheme, "(define make-counter (lambda () (define n 0) (lambda () (set! n (+ n 1)) n)))");
+        Run(&scheme, "(define counter (make-counter))");
+        Run(&scheme, "(counter)");
+        Run(&scheme, "(define xs '(1 2 3))");
+        Run(&scheme, "(define ys (cons 0 xs))");
+        Run(&scheme, "(define big (* 2147483647 2147483647 2))");
+        Run(&scheme, "(define sym 'hello)");
+        Run(&scheme, "(define plus +)");
+        Run(&scheme, "(define car cdr)");
+        // внутренний кадр попадает в образ раньше внешнего
+        Run(&scheme, "(define (mk n) (lambda (m) (lambda () (+ n m))))");
+        Run(&scheme, "(define a (mk 1))");
+        Run(&scheme, "(define b (a 2))");
+        scheme.SaveImage(path);
+    }
+    for (auto mode : {EvalMode::BYTECODE, EvalMode::TREE_WALK}) {
+        Scheme scheme;
+        scheme.SetEvalMode(mode);
+        scheme.LoadImage(path);
+        scheme.CollectGarbage();
+        REQUIRE(Run(&scheme, "(fact 10)") == "3628800");
+        REQUIRE(Run(&scheme, "(counter)") == "2");
+        REQUIRE(Run(&scheme, "(counter)") == "3");
+        REQUIRE(Run(&scheme, "big") == "9223372028264841218");
+        REQUIRE(Run(&scheme, "sym") == "hello");
+        REQUIRE(Run(&scheme, "(plus 5 2)") == "7");
+        REQUIRE(Run(&scheme, "(car '(1 2))") == "(2)");
+        REQUIRE(Run(&scheme, "(b)") == "3");
+        REQUIRE(Run(&scheme, "((a 5))") == "6");
+        // общая структура списков сохраняется
+        Run(&scheme, "(set-car! xs 9)");
+        REQUIRE(Run(&scheme, "ys") == "(0 9 2 3)");
+    }
+
+    std::string image;
+    {
+        std::ifstream in(path, std::ios::binary);
+        image.assign(std::istreambuf_iterator<char>(in), std::istreambuf_iterator<char>());
+    }
+    auto write = [&path](const std::string &data) {
+        std::ofstream(path, std::ios::binary).write(data.data(), data.size());
+    };
+    auto corrupted = image;
+    corrupted.back() ^= 1;
+    write(corrupted);
+    Scheme scheme;
+    REQUIRE_THROWS_AS(scheme.LoadImage(path), RuntimeError);
+    REQUIRE_THROWS_AS(Run(&scheme, "fact"), NameError);
+    corrupted = image;
+    corrupted[8] = 99;
+    write(corrupted);
+    REQUIRE_THROWS_AS(scheme.LoadImage(path), RuntimeError);
+    write(image.substr(0, 20));
+    REQUIRE_THROWS_AS(scheme.LoadImage(path), RuntimeError);
+    std::remove(path.c_str());
+}
+
+TEST_CASE("Interpreter pool runs isolated jobs on every thread") {
+    for (auto mode : {EvalMode::BYTECODE, EvalMode::TREE_WALK}) {
+        InterpreterPool pool(4,
+                             "(define (fact n) (if (< n 2) 1 (* n (fact (- n 1)))))\n"
+                             "(define counter 0)\n"
+                             "(define tick ((lambda (n) (lambda () (set! n (+ n 1)) n)) 0))",
+                             mode);
+        REQUIRE(pool.GetThreadCount() == 4);
+        std::vector<std::future<EvalResult>> results;
+        for (int i = 0; i < 200; ++i) {
+            switch (i % 5) {
+                case 0:
+                    results.push_back(pool.Submit("(fact " + std::to_string(i % 15) + ")"));
+                    break;
+                case 1:
+                    results.push_back(pool.Submit("(define counter (+ counter 1))"));
+                    break;
+                case 2:
+                    results.push_back(pool.Submit("(+ counter (tick))"));
+                    break;
+                case 3:
+                    results.push_back(pool.Submit("(car '())"));
+                    break;
+                default:
+                    results.push_back(pool.Submit("(fact"));
+            }
+        }
+        for (int i = 0; i < 200; ++i) {
+            auto result = results[i].get();
+            switch (i % 5) {
+                case 0: {
+                    int64_t expected = 1;
+                    for (int k = 2; k <= i % 15; ++k) {
+                        expected *= k;
+                    }
+                    REQUIRE(result.error_ == ErrorKind::NONE);
+                    REQUIRE(result.output_ == std::to_string(expected));
+                    break;
+                }
+                case 2:
+                    // ни define, ни set! в кадре замыкания из другого задания не видны
+                    REQUIRE(result.output_ == "1");
+                    break;
+                case 3:
+                    REQUIRE(result.error_ == ErrorKind::RUNTIME);
+                    break;
+                case 4:
+                    REQUIRE(result.error_ == ErrorKind::SYNTAX);
+                    break;
+            }
+        }
+    }
+    REQUIRE_THROWS_AS(InterpreterPool(2, "(define x y)"), NameError);
+}
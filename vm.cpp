@@ -0,0 +1,393 @@
+#include <algorithm>
+#include <memory>
+#include <vector>
+
+#include <vm.h>
+
+VirtualMachine::VirtualMachine(Heap *heap) : heap_(heap) {
+    heap_->AddRoots(this);
+}
+
+VirtualMachine::~VirtualMachine() {
+    heap_->RemoveRoots(this);
+}
+
+void VirtualMachine::SetMaxDepth(size_t depth) {
+    max_depth_ = depth;
+}
+
+void VirtualMachine::SetOptimization(bool enabled) {
+    optimize_ = enabled;
+}
+
+void VirtualMachine::TraceRoots(Heap *heap) {
+    for (auto &value : stack_) {
+        heap->Mark(value);
+    }
+    for (auto &frame : frames_) {
+        frame.code_->Trace(heap);
+        frame.scope_->Trace(heap);
+    }
+}
+
+Value VirtualMachine::Pop() {
+    auto value = stack_.back();
+    stack_.pop_back();
+    return value;
+}
+
+Binding &VirtualMachine::GlobalBinding(const Frame &frame, int32_t index) {
+    auto &binding = frame.code_->bindings_[index];
+    if (!binding) {
+        binding = frame.code_->globals_->FindBinding(frame.code_->names_[index]);
+    }
+    if (!binding || !binding->defined_) {
+        throw NameError("Использование необъявленной переменной");
+    }
+    return *binding;
+}
+
+Value &VirtualMachine::EnvSlot(const Frame &frame,
+                                                 const Instruction &instruction) {
+    auto &slot = frame.scope_->GetSlot(instruction.depth_, instruction.arg_);
+    if (slot == Scope::Unbound()) {
+        throw NameError("Использование необъявленной переменной");
+    }
+    return slot;
+}
+
+void VirtualMachine::Call(size_t count) {
+    size_t base = stack_.size() - count - 1;
+    auto callee = stack_[base];
+    if (!callee || !callee.IsFunction()) {
+        throw RuntimeError("Первый элемент должен быть функцией");
+    }
+
+    if (callee.IsLambda()) {
+        auto lambda = callee.As<Lambda>();
+        // lambda, созданная обходчиком дерева или прочитанная из образа,
+        // компилируется при первом вызове
+        if (!lambda->GetCode()) {
+            lambda->SetCode(CompileClosure(*lambda, optimize_));
+        }
+        auto code = lambda->GetCode();
+        if (count != code->variables_->size()) {
+            throw SyntaxError("Неверное число аргументов у lambda функции");
+        }
+        if (frames_.size() >= max_depth_) {
+            throw RuntimeError("Превышена глубина рекурсии");
+        }
+        if (code->heap_frame_) {
+            std::vector<Value> slots(stack_.begin() + base + 1, stack_.end());
+            slots.resize(code->locals_->size(), Scope::Unbound());
+            auto scope = std::make_shared<Scope>(lambda->GetScope(), code->locals_,
+                                                 std::move(slots), true);
+            frames_.push_back(Frame{code, 0, scope, base});
+            return;
+        }
+        frames_.push_back(Frame{code, 0, lambda->GetScope(), base});
+        return;
+    }
+
+    // встроенные функции не возвращаются в VM, так что stack_ не переедет
+    auto result = callee.As<Function>()->Call(ValueSpan(stack_.data() + base + 1, count));
+    stack_.resize(base);
+    stack_.push_back(result);
+}
+
+bool VirtualMachine::FixnumOperands(const Frame &frame, const Instruction &instruction,
+                                    int64_t *lhs, int64_t *rhs) {
+    if (instruction.depth_ != 2 || !frame.code_->bindings_[instruction.arg_]->HoldsBuiltin()) {
+        return false;
+    }
+    auto &first = stack_[stack_.size() - 2];
+    auto &second = stack_.back();
+    if (!first.IsFixnum() || !second.IsFixnum()) {
+        return false;
+    }
+    *lhs = first.GetFixnum();
+    *rhs = second.GetFixnum();
+    return true;
+}
+
+void VirtualMachine::CallPrimitive(const Frame &frame, const Instruction &instruction) {
+    auto &binding = GlobalBinding(frame, instruction.arg_);
+    size_t base = stack_.size() - instruction.depth_;
+    if (binding.HoldsBuiltin()) {
+        auto result =
+            binding.value_.As<Function>()->Call(ValueSpan(stack_.data() + base, instruction.depth_));
+        Replace(instruction.depth_, result);
+        return;
+    }
+    stack_.insert(stack_.begin() + base, binding.value_);
+    Call(instruction.depth_);
+}
+
+void VirtualMachine::Replace(size_t count, Value value) {
+    stack_.resize(stack_.size() - count);
+    stack_.push_back(value);
+}
+
+Value VirtualMachine::Run(const std::shared_ptr<Code> &code, const std::shared_ptr<Scope> &scope) {
+    // после исключения на стеках мог остаться мусор
+    stack_.clear();
+    frames_.clear();
+    frames_.push_back(Frame{code, 0, scope, 0});
+
+    while (true) {
+        heap_->Safepoint();
+        auto &frame = frames_.back();
+        auto instruction = frame.code_->instructions_[frame.pc_++];
+        int64_t lhs, rhs;
+
+        switch (instruction.op_) {
+            case OpCode::PUSH_CONST:
+                stack_.push_back(frame.code_->constants_[instruction.arg_]);
+                break;
+
+            case OpCode::LOAD_VAR:
+                stack_.push_back(frame.scope_->LookUp(frame.code_->names_[instruction.arg_]));
+                break;
+
+            case OpCode::LOAD_LOCAL:
+                stack_.push_back(stack_[frame.stack_base_ + 1 + instruction.arg_]);
+                break;
+
+            case OpCode::LOAD_ENV:
+                stack_.push_back(EnvSlot(frame, instruction));
+                break;
+
+            case OpCode::LOAD_GLOBAL:
+                stack_.push_back(GlobalBinding(frame, instruction.arg_).value_);
+                break;
+
+            case OpCode::DEFINE_VAR: {
+                auto value = Pop();
+                frame.scope_->OverrideVariable(frame.code_->names_[instruction.arg_], value);
+                stack_.push_back(nullptr);
+                break;
+            }
+
+            case OpCode::DEFINE_ENV: {
+                auto value = Pop();
+                frame.scope_->SetSlot(0, instruction.arg_, value);
+                stack_.push_back(nullptr);
+                break;
+            }
+
+            case OpCode::DEFINE_GLOBAL: {
+                auto &binding = frame.code_->bindings_[instruction.arg_];
+                if (!binding) {
+                    binding = frame.code_->globals_->GetBinding(
+                        frame.code_->names_[instruction.arg_]);
+                }
+                binding->Assign(Pop());
+                stack_.push_back(nullptr);
+                break;
+            }
+
+            case OpCode::SET_VAR: {
+                auto value = Pop();
+                frame.scope_->ChangeVariable(frame.code_->names_[instruction.arg_], value);
+                stack_.push_back(nullptr);
+                break;
+            }
+
+            case OpCode::SET_LOCAL:
+                stack_[frame.stack_base_ + 1 + instruction.arg_] = Pop();
+                stack_.push_back(nullptr);
+                break;
+
+            case OpCode::SET_ENV:
+                EnvSlot(frame, instruction);
+                frame.scope_->SetSlot(instruction.depth_, instruction.arg_, Pop());
+                stack_.push_back(nullptr);
+                break;
+
+            case OpCode::SET_GLOBAL: {
+                GlobalBinding(frame, instruction.arg_).Assign(Pop());
+                stack_.push_back(nullptr);
+                break;
+            }
+
+            case OpCode::MAKE_LAMBDA: {
+                auto prototype = frame.code_->lambdas_[instruction.arg_];
+                auto lambda = Make<Lambda>(prototype->variables_, prototype->body_, frame.scope_);
+                lambda->SetCode(prototype);
+                stack_.push_back(lambda);
+                break;
+            }
+
+            case OpCode::CALL:
+                // может положить новый кадр, так что frame дальше не используется
+                Call(instruction.arg_);
+                break;
+
+            case OpCode::JUMP:
+                frame.pc_ = instruction.arg_;
+                break;
+
+            case OpCode::JUMP_IF_FALSE: {
+                auto condition = Pop();
+                if (condition != kTrueSymbol && condition != kFalseSymbol) {
+                    throw SyntaxError("Условие if должно быть #t или #f");
+                }
+                if (condition == kFalseSymbol) {
+                    frame.pc_ = instruction.arg_;
+                }
+                break;
+            }
+
+            case OpCode::JUMP_IF_FALSE_OR_POP:
+                if (stack_.back() && stack_.back().IsFalse()) {
+                    frame.pc_ = instruction.arg_;
+                } else {
+                    stack_.pop_back();
+                }
+                break;
+
+            case OpCode::JUMP_IF_TRUE_OR_POP:
+                if (!stack_.back() || !stack_.back().IsFalse()) {
+                    frame.pc_ = instruction.arg_;
+                } else {
+                    stack_.pop_back();
+                }
+                break;
+
+            case OpCode::POP:
+                stack_.pop_back();
+                break;
+
+            case OpCode::TAIL_CALL: {
+                size_t callee = stack_.size() - instruction.arg_ - 1;
+                if (stack_[callee].IsLambda()) {
+                    // текущий кадр больше не нужен: функция и аргументы встают
+                    // на его место, так что хвостовая рекурсия не растит стеки
+                    auto base = frame.stack_base_;
+                    std::move(stack_.begin() + callee, stack_.end(), stack_.begin() + base);
+                    stack_.resize(base + instruction.arg_ + 1);
+                    frames_.pop_back();
+                    Call(instruction.arg_);
+                    break;
+                }
+                // встроенная функция не кладёт кадр: результат уже на стеке
+                Call(instruction.arg_);
+                [[fallthrough]];
+            }
+
+            case OpCode::RETURN: {
+                auto result = Pop();
+                stack_.resize(frame.stack_base_);
+                frames_.pop_back();
+                if (frames_.empty()) {
+                    return result;
+                }
+                stack_.push_back(result);
+                break;
+            }
+
+            // медленный путь может положить кадр, так что после CallPrimitive
+            // frame не используется
+            case OpCode::ADD:
+                if (FixnumOperands(frame, instruction, &lhs, &rhs)) {
+                    Replace(2, MakeNumber(lhs + rhs));
+                } else {
+                    CallPrimitive(frame, instruction);
+                }
+                break;
+
+            case OpCode::SUBTRACT:
+                if (FixnumOperands(frame, instruction, &lhs, &rhs)) {
+                    Replace(2, MakeNumber(lhs - rhs));
+                } else {
+                    CallPrimitive(frame, instruction);
+                }
+                break;
+
+            case OpCode::MULTIPLY: {
+                int64_t product;
+                if (FixnumOperands(frame, instruction, &lhs, &rhs) &&
+                    !__builtin_mul_overflow(lhs, rhs, &product)) {
+                    Replace(2, MakeNumber(product));
+                } else {
+                    CallPrimitive(frame, instruction);
+                }
+                break;
+            }
+
+            case OpCode::LESS:
+                if (FixnumOperands(frame, instruction, &lhs, &rhs)) {
+                    Replace(2, ToBoolean(lhs < rhs));
+                } else {
+                    CallPrimitive(frame, instruction);
+                }
+                break;
+
+            case OpCode::LESS_EQ:
+                if (FixnumOperands(frame, instruction, &lhs, &rhs)) {
+                    Replace(2, ToBoolean(lhs <= rhs));
+                } else {
+                    CallPrimitive(frame, instruction);
+                }
+                break;
+
+            case OpCode::MORE:
+                if (FixnumOperands(frame, instruction, &lhs, &rhs)) {
+                    Replace(2, ToBoolean(lhs > rhs));
+                } else {
+                    CallPrimitive(frame, instruction);
+                }
+                break;
+
+            case OpCode::MORE_EQ:
+                if (FixnumOperands(frame, instruction, &lhs, &rhs)) {
+                    Replace(2, ToBoolean(lhs >= rhs));
+                } else {
+                    CallPrimitive(frame, instruction);
+                }
+                break;
+
+            case OpCode::NUM_EQ:
+                if (FixnumOperands(frame, instruction, &lhs, &rhs)) {
+                    Replace(2, ToBoolean(lhs == rhs));
+                } else {
+                    CallPrimitive(frame, instruction);
+                }
+                break;
+
+            case OpCode::NOT:
+                if (instruction.depth_ == 1 &&
+                    frame.code_->bindings_[instruction.arg_]->HoldsBuiltin()) {
+                    stack_.back() = ToBoolean(stack_.back() && stack_.back().IsFalse());
+                } else {
+                    CallPrimitive(frame, instruction);
+                }
+                break;
+
+            case OpCode::IS_NULL:
+                if (instruction.depth_ == 1 &&
+                    frame.code_->bindings_[instruction.arg_]->HoldsBuiltin()) {
+                    stack_.back() = ToBoolean(!stack_.back());
+                } else {
+                    CallPrimitive(frame, instruction);
+                }
+                break;
+
+            case OpCode::CONS:
+                if (instruction.depth_ == 2 &&
+                    frame.code_->bindings_[instruction.arg_]->HoldsBuiltin()) {
+                    auto cell = Make<Cell>(stack_[stack_.size() - 2], stack_.back());
+                    Replace(2, cell);
+                } else {
+                    CallPrimitive(frame, instruction);
+                }
+                break;
+
+            case OpCode::GUARD:
+                if (!frame.code_->bindings_[instruction.depth_]->HoldsBuiltin()) {
+                    frame.pc_ = instruction.arg_;
+                }
+                break;
+        }
+    }
+}
@@ -0,0 +1,70 @@
+#pragma once
+
+#include <cstdint>
+#include <memory>
+#include <vector>
+
+#include "compiler.h"
+
+// Стековая машина для байткода из compiler.h.
+// Вызовы lambda не уходят в рекурсию C++: кадр просто кладётся в frames_.
+// Стеки машины - корни кучи; сборка идёт только между инструкциями.
+class VirtualMachine : public RootSet {
+public:
+    explicit VirtualMachine(Heap *heap);
+
+    VirtualMachine(const VirtualMachine &) = delete;
+
+    VirtualMachine &operator=(const VirtualMachine &) = delete;
+
+    ~VirtualMachine();
+
+    Value Run(const std::shared_ptr<Code> &code, const std::shared_ptr<Scope> &scope);
+
+    // Больше depth вложенных вызовов lambda - RuntimeError.
+    void SetMaxDepth(size_t depth);
+
+    // Для lambda, которые компилируются при первом вызове.
+    void SetOptimization(bool enabled);
+
+    void TraceRoots(Heap *heap) override;
+
+private:
+    struct Frame {
+        std::shared_ptr<Code> code_;
+        size_t pc_;
+        std::shared_ptr<Scope> scope_;
+        // начало кадра на стеке значений: вызываемая функция и её аргументы.
+        // Если code_->heap_frame_ не выставлен, аргументы читаются прямо отсюда,
+        // а scope_ указывает на область видимости, где была создана lambda.
+        size_t stack_base_;
+    };
+
+    Value Pop();
+
+    // Ячейка глобальной переменной; NameError, если она ещё не определена.
+    Binding &GlobalBinding(const Frame &frame, int32_t index);
+
+    // Ячейка кадра в куче; NameError, если её define ещё не выполнен.
+    Value &EnvSlot(const Frame &frame, const Instruction &instruction);
+
+    void Call(size_t count);
+
+    // Два целых аргумента подставленной встроенной функции, если она
+    // всё ещё лежит в своей переменной.
+    bool FixnumOperands(const Frame &frame, const Instruction &instruction, int64_t *lhs,
+                        int64_t *rhs);
+
+    // Медленный путь подставленной встроенной функции. Если её переопределили,
+    // вызывается новое значение переменной, как обычная функция.
+    void CallPrimitive(const Frame &frame, const Instruction &instruction);
+
+    // Заменяет count верхних значений стека на value.
+    void Replace(size_t count, Value value);
+
+    Heap *heap_;
+    size_t max_depth_ = kDefaultMaxDepth;
+    bool optimize_ = true;
+    std::vector<Value> stack_;
+    std::vector<Frame> frames_;
+};